@@ -0,0 +1,50 @@
+#pragma once
+
+#include "../core/molecule.hpp"
+#include "../core/thread_pool.hpp"
+#include <Eigen/Dense>
+#include <vector>
+
+namespace chargeopt {
+
+// Picks representative conformers from an ensemble (e.g. MD snapshots), so
+// ESP cubes and fits are needed for the representatives only.
+//
+// Frames are compared by RMSD after optimal superposition (Kabsch). Every
+// pair within the cutoff is found, pruned first by the radius-of-gyration
+// bound |Rg_a - Rg_b| <= RMSD; the rest go through one 3 x N by N x 3
+// product and a quaternion eigenvalue (QCP). Clusters then follow Daura et al. (1999): the
+// frame with the most unclustered neighbours becomes a representative and
+// takes those neighbours with it, until every frame is clustered. Each
+// representative is weighted by the fraction of frames it stands for.
+class ConformerClustering {
+public:
+    struct Config {
+        double rmsd_cutoff = 1.0;   // Bohr (~0.53 Angstrom)
+        
+        Config() {}
+    };
+    
+    struct Representative {
+        size_t frame;           // Index into the ensemble
+        size_t population;      // Frames in its cluster, itself included
+        double weight;          // population / frames
+    };
+    
+    struct Result {
+        std::vector<Representative> representatives;  // Largest cluster first
+        std::vector<size_t> cluster;                  // Per frame: index into representatives
+        size_t pairs_aligned = 0;                     // Pairs that needed the full Kabsch kernel
+    };
+    
+    // Frames must list the same elements in the same order. Pairs are split
+    // across the pool when one is given.
+    static Result cluster(const std::vector<Molecule>& frames,
+                          const Config& config = Config(),
+                          ThreadPool* pool = nullptr);
+    
+    // RMSD of two N x 3 coordinate sets after optimal rigid superposition
+    static double aligned_rmsd(const Eigen::MatrixXd& a, const Eigen::MatrixXd& b);
+};
+
+} // namespace chargeopt
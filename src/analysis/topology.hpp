@@ -0,0 +1,67 @@
+#pragma once
+
+#include "../core/molecule.hpp"
+#include "../core/hash.hpp"
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+
+namespace chargeopt {
+
+class Topology {
+public:
+    // Bond perception from covalent radii (positions in Bohr)
+    // Returns adjacency lists
+    static std::vector<std::vector<int>> bonds(const Molecule& mol, double tolerance = 1.25) {
+        constexpr double angstrom_to_bohr = 1.889726125;
+        const size_t n = mol.num_atoms();
+        std::vector<std::vector<int>> adj(n);
+        
+        for (size_t i = 0; i < n; ++i) {
+            const auto& a = mol.atom(i);
+            for (size_t j = i + 1; j < n; ++j) {
+                const auto& b = mol.atom(j);
+                double cutoff = tolerance * (a.covalent_radius() + b.covalent_radius()) * angstrom_to_bohr;
+                if ((a.position - b.position).norm() < cutoff) {
+                    adj[i].push_back(j);
+                    adj[j].push_back(i);
+                }
+            }
+        }
+        
+        return adj;
+    }
+    
+    // Canonical atom-environment hashes (Weisfeiler-Lehman refinement):
+    //   h_0(i)   = hash(element)
+    //   h_t+1(i) = hash(h_t(i), sorted { h_t(j) : j bonded to i })
+    // After depth rounds, h(i) identifies the depth-bond neighborhood of
+    // atom i independent of atom ordering and of the 3D geometry.
+    static std::vector<uint64_t> environment_hashes(const Molecule& mol, int depth = 2) {
+        const auto adj = bonds(mol);
+        const size_t n = mol.num_atoms();
+        
+        std::vector<uint64_t> labels(n), next(n);
+        for (size_t i = 0; i < n; ++i) {
+            labels[i] = hash::mix(hash::fnv1a(mol.atom(i).element));
+        }
+        
+        std::vector<uint64_t> neighbors;
+        for (int t = 0; t < depth; ++t) {
+            for (size_t i = 0; i < n; ++i) {
+                neighbors.clear();
+                for (int j : adj[i]) neighbors.push_back(labels[j]);
+                std::sort(neighbors.begin(), neighbors.end());
+                
+                uint64_t h = hash::combine(labels[i], neighbors.size());
+                for (uint64_t nb : neighbors) h = hash::combine(h, nb);
+                next[i] = h;
+            }
+            labels.swap(next);
+        }
+        
+        return labels;
+    }
+};
+
+} // namespace chargeopt
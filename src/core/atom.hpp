@@ -41,6 +41,19 @@ struct Atom {
         if (element == "Cl") return 1.75;
         return 1.70;
     }
+    
+    // Covalent radius (Angstroms) - for bond perception (Cordero et al. 2008)
+    double covalent_radius() const {
+        if (element == "H") return 0.31;
+        if (element == "C") return 0.76;
+        if (element == "N") return 0.71;
+        if (element == "O") return 0.66;
+        if (element == "F") return 0.57;
+        if (element == "P") return 1.07;
+        if (element == "S") return 1.05;
+        if (element == "Cl") return 1.02;
+        return 0.76;
+    }
 };
 
 } // namespace chargeopt
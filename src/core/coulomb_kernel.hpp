@@ -0,0 +1,79 @@
+#pragma once
+
+#include <Eigen/Dense>
+#include <cmath>
+
+namespace chargeopt {
+
+// Shared Coulomb interaction kernel (atomic units: Bohr, e, Hartree/e)
+// Builds whole columns at a time with Eigen array expressions so the
+// compiler can vectorize the distance/inverse loops.
+class CoulombKernel {
+public:
+    // Minimum distance used to avoid division by zero
+    static constexpr double min_distance = 1e-10;
+    
+    // Potential matrix: K(i,j) = 1/|p_i - s_j|
+    // points: Mx3, sites: Nx3  ->  MxN
+    static Eigen::MatrixXd potential_matrix(const Eigen::MatrixXd& points,
+                                            const Eigen::MatrixXd& sites) {
+        Eigen::MatrixXd K(points.rows(), sites.rows());
+        for (Eigen::Index j = 0; j < sites.rows(); ++j) {
+            K.col(j) = potential_column(points, sites.row(j).transpose());
+        }
+        return K;
+    }
+    
+    // Single column of the potential matrix for one site
+    static Eigen::VectorXd potential_column(const Eigen::MatrixXd& points,
+                                            const Eigen::Vector3d& site) {
+        Eigen::ArrayXd r = (points.rowwise() - site.transpose()).rowwise().norm().array();
+        return r.max(min_distance).inverse().matrix();
+    }
+    
+    // Screened (Ohno) column: 1/sqrt(|p_i - s|^2 + a_i^2)
+    // a: per-point screening length (Bohr); finite at zero distance
+    static Eigen::VectorXd screened_column(const Eigen::MatrixXd& points,
+                                           const Eigen::Vector3d& site,
+                                           const Eigen::ArrayXd& a) {
+        Eigen::ArrayXd r2 = (points.rowwise() - site.transpose()).rowwise().squaredNorm().array();
+        return (r2 + a.square()).rsqrt().matrix();
+    }
+    
+    // Potential of one site's multipoles through rank 2, in Stone's real
+    // spherical components Q = (Q00, Q10, Q11c, Q11s, Q20, Q21c, Q21s,
+    // Q22c, Q22s), e a0^l: V = sum_lm Q_lm R_lm(r) / r^(2l+1) with R_lm the
+    // regular solid harmonics. Q may stop after rank 0 (1) or 1 (4 values).
+    static Eigen::VectorXd multipole_column(const Eigen::MatrixXd& points,
+                                            const Eigen::Vector3d& site,
+                                            const Eigen::VectorXd& Q) {
+        const Eigen::MatrixXd d = points.rowwise() - site.transpose();
+        const Eigen::ArrayXd x = d.col(0).array(), y = d.col(1).array(), z = d.col(2).array();
+        const Eigen::ArrayXd r2 = (x * x + y * y + z * z).max(min_distance * min_distance);
+        const Eigen::ArrayXd inv_r = r2.rsqrt();
+        const Eigen::ArrayXd inv_r3 = inv_r * inv_r * inv_r;
+        
+        Eigen::ArrayXd v = Q(0) * inv_r;
+        if (Q.size() >= 4) {
+            v += (Q(1) * z + Q(2) * x + Q(3) * y) * inv_r3;
+        }
+        if (Q.size() >= 9) {
+            const double s3 = std::sqrt(3.0);
+            v += (Q(4) * 0.5 * (3.0 * z * z - r2) + Q(5) * s3 * x * z + Q(6) * s3 * y * z
+                  + Q(7) * 0.5 * s3 * (x * x - y * y) + Q(8) * s3 * x * y) * inv_r3 / r2;
+        }
+        return v.matrix();
+    }
+    
+    // Gradient of column j with respect to the site position:
+    // d(1/|p_i - s|)/ds = (p_i - s) / |p_i - s|^3   ->  Mx3
+    static Eigen::MatrixXd site_gradient(const Eigen::MatrixXd& points,
+                                         const Eigen::Vector3d& site) {
+        Eigen::MatrixXd diff = points.rowwise() - site.transpose();
+        Eigen::ArrayXd r = diff.rowwise().norm().array().max(min_distance);
+        Eigen::ArrayXd inv_r3 = (r * r * r).inverse();
+        return diff.array().colwise() * inv_r3;
+    }
+};
+
+} // namespace chargeopt
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <memory>
 #include <vector>
 #include <Eigen/Dense>
 
@@ -14,62 +15,115 @@ struct GridPoint {
         : position(pos), potential(pot) {}
 };
 
+// Regular lattice a grid was sampled from (cube files). Points that were
+// filtered out are simply absent; node maps each kept point to its lattice
+// node, flattened as (i * ny + j) * nz + k.
+struct GridLattice {
+    Eigen::Vector3d origin = Eigen::Vector3d::Zero();
+    Eigen::Matrix3d axes = Eigen::Matrix3d::Zero();  // Row a: step along index a (Bohr)
+    int dims[3] = {0, 0, 0};
+    std::vector<size_t> node;
+    
+    size_t num_nodes() const {
+        return static_cast<size_t>(dims[0]) * dims[1] * dims[2];
+    }
+};
+
 class ESPGrid {
 public:
     ESPGrid() {}
     
+    // Read-only grid over points owned elsewhere (e.g. a shared-memory
+    // mapping, SharedGridCache); backing keeps that memory alive for as
+    // long as any copy of the grid uses it
+    static ESPGrid view(const GridPoint* points, size_t count,
+                        std::shared_ptr<const void> backing) {
+        ESPGrid grid;
+        grid.view_ = points;
+        grid.view_size_ = count;
+        grid.backing_ = std::move(backing);
+        return grid;
+    }
+    
     void add_point(const GridPoint& point) {
+        own();
         points_.push_back(point);
     }
     
     void add_point(const Eigen::Vector3d& pos, double potential) {
+        own();
         points_.emplace_back(pos, potential);
     }
     
-    size_t num_points() const { return points_.size(); }
+    size_t num_points() const { return backing_ ? view_size_ : points_.size(); }
+    
+    const GridPoint& point(size_t i) const { return data()[i]; }
+    const GridPoint* data() const { return backing_ ? view_ : points_.data(); }
     
-    const GridPoint& point(size_t i) const { return points_[i]; }
-    const std::vector<GridPoint>& points() const { return points_; }
+    // True for grids made by view()
+    bool is_view() const { return backing_ != nullptr; }
     
     // Get all positions as Nx3 matrix
     Eigen::MatrixXd positions() const {
-        Eigen::MatrixXd pos(points_.size(), 3);
-        for (size_t i = 0; i < points_.size(); ++i) {
-            pos.row(i) = points_[i].position;
+        const GridPoint* points = data();
+        Eigen::MatrixXd pos(num_points(), 3);
+        for (size_t i = 0; i < num_points(); ++i) {
+            pos.row(i) = points[i].position;
         }
         return pos;
     }
     
     // Get all potentials as vector
     Eigen::VectorXd potentials() const {
-        Eigen::VectorXd pot(points_.size());
-        for (size_t i = 0; i < points_.size(); ++i) {
-            pot(i) = points_[i].potential;
+        const GridPoint* points = data();
+        Eigen::VectorXd pot(num_points());
+        for (size_t i = 0; i < num_points(); ++i) {
+            pot(i) = points[i].potential;
         }
         return pot;
     }
     
     // Grid statistics
     double min_potential() const {
-        if (points_.empty()) return 0.0;
-        double min_val = points_[0].potential;
-        for (const auto& p : points_) {
-            if (p.potential < min_val) min_val = p.potential;
+        if (num_points() == 0) return 0.0;
+        const GridPoint* points = data();
+        double min_val = points[0].potential;
+        for (size_t i = 0; i < num_points(); ++i) {
+            if (points[i].potential < min_val) min_val = points[i].potential;
         }
         return min_val;
     }
     
+    // Lattice metadata; only valid while it covers every point
+    void set_lattice(const GridLattice& lattice) { lattice_ = lattice; }
+    bool has_lattice() const { return num_points() > 0 && lattice_.node.size() == num_points(); }
+    const GridLattice& lattice() const { return lattice_; }
+    
     double max_potential() const {
-        if (points_.empty()) return 0.0;
-        double max_val = points_[0].potential;
-        for (const auto& p : points_) {
-            if (p.potential > max_val) max_val = p.potential;
+        if (num_points() == 0) return 0.0;
+        const GridPoint* points = data();
+        double max_val = points[0].potential;
+        for (size_t i = 0; i < num_points(); ++i) {
+            if (points[i].potential > max_val) max_val = points[i].potential;
         }
         return max_val;
     }
 
 private:
+    // A view becomes an ordinary grid (own copy) before it is modified
+    void own() {
+        if (!backing_) return;
+        points_.assign(view_, view_ + view_size_);
+        view_ = nullptr;
+        view_size_ = 0;
+        backing_.reset();
+    }
+    
     std::vector<GridPoint> points_;
+    const GridPoint* view_ = nullptr;
+    size_t view_size_ = 0;
+    std::shared_ptr<const void> backing_;
+    GridLattice lattice_;
 };
 
 } // namespace chargeopt
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+
+namespace chargeopt {
+
+// Small non-cryptographic hashing helpers (stable across runs and platforms,
+// unlike std::hash) for on-disk keys
+namespace hash {
+
+constexpr uint64_t fnv_offset = 1469598103934665603ULL;
+constexpr uint64_t fnv_prime = 1099511628211ULL;
+
+// FNV-1a over a byte range, continuing from seed
+inline uint64_t fnv1a(const void* data, size_t size, uint64_t seed = fnv_offset) {
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    uint64_t h = seed;
+    for (size_t i = 0; i < size; ++i) {
+        h ^= bytes[i];
+        h *= fnv_prime;
+    }
+    return h;
+}
+
+inline uint64_t fnv1a(const std::string& s, uint64_t seed = fnv_offset) {
+    return fnv1a(s.data(), s.size(), seed);
+}
+
+// splitmix64 finalizer: well-mixed 64-bit avalanche
+inline uint64_t mix(uint64_t x) {
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+// Order-dependent combination of two hashes
+inline uint64_t combine(uint64_t seed, uint64_t value) {
+    return mix(seed ^ (value + 0x9e3779b97f4a7c15ULL + (seed << 6) + (seed >> 2)));
+}
+
+} // namespace hash
+
+} // namespace chargeopt
@@ -0,0 +1,217 @@
+#include "resource_limits.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <vector>
+
+#include <sched.h>
+#include <unistd.h>
+
+namespace chargeopt {
+
+namespace {
+
+std::atomic<size_t> thread_override(0);
+
+// Values of 2^60 and up mean "no limit" in cgroup v1
+constexpr uint64_t v1_unlimited = 1ULL << 60;
+
+bool read_line(const std::string& path, std::string& line) {
+    std::ifstream in(path);
+    return static_cast<bool>(std::getline(in, line));
+}
+
+std::vector<std::string> split(const std::string& s, char sep) {
+    std::vector<std::string> parts;
+    std::string part;
+    std::istringstream in(s);
+    while (std::getline(in, part, sep)) parts.push_back(part);
+    return parts;
+}
+
+bool contains(const std::vector<std::string>& list, const std::string& item) {
+    return std::find(list.begin(), list.end(), item) != list.end();
+}
+
+// Directory of the process's cgroup for one hierarchy
+struct Hierarchy {
+    std::string mount;      // Mount point, already prefixed with root
+    std::string dir;        // Process cgroup directory below it
+};
+
+// Map a /proc/self/cgroup path onto the mount that shows it. Inside a
+// container the mount's root is usually the container's own cgroup.
+bool locate(const std::string& root, bool v2, const std::string& controller,
+            const std::string& cgroup_path, Hierarchy& h) {
+    std::ifstream mountinfo(root + "/proc/self/mountinfo");
+    std::string line;
+    while (std::getline(mountinfo, line)) {
+        // id parent major:minor root mount-point options [optional...] - fstype source super-options
+        const size_t dash = line.find(" - ");
+        if (dash == std::string::npos) continue;
+        std::istringstream pre(line.substr(0, dash));
+        std::istringstream post(line.substr(dash + 3));
+        std::string id, parent, dev, mount_root, mount_point, fstype, source, options;
+        pre >> id >> parent >> dev >> mount_root >> mount_point;
+        post >> fstype >> source >> options;
+        if (v2 ? fstype != "cgroup2" : (fstype != "cgroup" || !contains(split(options, ','), controller))) {
+            continue;
+        }
+        
+        h.mount = root + mount_point;
+        std::string relative = cgroup_path;
+        if (mount_root != "/" && relative.compare(0, mount_root.size(), mount_root) == 0) {
+            relative = relative.substr(mount_root.size());
+        } else if (mount_root != "/") {
+            relative.clear();   // Not visible below this mount; use its root
+        }
+        h.dir = h.mount + (relative == "/" ? "" : relative);
+        std::ifstream probe(h.dir + (v2 ? "/cgroup.controllers" : "/tasks"));
+        if (!probe) h.dir = h.mount;
+        return true;
+    }
+    return false;
+}
+
+// Calls visit(dir) for the cgroup and each ancestor up to the mount
+template <typename Visit>
+void walk_up(const Hierarchy& h, Visit visit) {
+    std::string dir = h.dir;
+    for (;;) {
+        visit(dir);
+        if (dir.size() <= h.mount.size()) break;
+        dir = dir.substr(0, dir.rfind('/'));
+    }
+}
+
+void keep_lower(double& current, double value) {
+    if (value > 0.0 && (current == 0.0 || value < current)) current = value;
+}
+
+void keep_lower(uint64_t& current, uint64_t value) {
+    if (value > 0 && (current == 0 || value < current)) current = value;
+}
+
+} // namespace
+
+size_t ResourceLimits::cpus() const {
+    size_t n = affinity_cpus > 0 ? affinity_cpus : host_cpus;
+    if (cpu_quota > 0.0) {
+        n = std::min(n, static_cast<size_t>(std::ceil(cpu_quota)));
+    }
+    return std::max<size_t>(n, 1);
+}
+
+uint64_t ResourceLimits::memory_budget() const {
+    if (memory_limit == 0) return physical_memory;
+    if (physical_memory == 0) return memory_limit;
+    return std::min(memory_limit, physical_memory);
+}
+
+std::string ResourceLimits::describe() const {
+    char text[160];
+    const char* limited_by = cpu_quota > 0.0 && std::ceil(cpu_quota) < (affinity_cpus ? affinity_cpus : host_cpus)
+        ? (cgroup_version == 1 ? " (cgroup v1 quota)" : " (cgroup v2 quota)")
+        : (affinity_cpus > 0 && affinity_cpus < host_cpus ? " (affinity)" : "");
+    std::snprintf(text, sizeof(text), "%zu of %zu CPUs%s, memory %.1f GiB%s", cpus(), host_cpus, limited_by,
+                  memory_budget() / (1024.0 * 1024.0 * 1024.0),
+                  memory_limit > 0 && memory_limit == memory_budget() ? " (cgroup limit)" : "");
+    return text;
+}
+
+ResourceLimits ResourceLimits::read(const std::string& root) {
+    ResourceLimits limits;
+    const long online = sysconf(_SC_NPROCESSORS_ONLN);
+    limits.host_cpus = online > 0 ? online : 1;
+    const long pages = sysconf(_SC_PHYS_PAGES), page_size = sysconf(_SC_PAGESIZE);
+    if (pages > 0 && page_size > 0) {
+        limits.physical_memory = static_cast<uint64_t>(pages) * page_size;
+    }
+    cpu_set_t mask;
+    if (sched_getaffinity(0, sizeof(mask), &mask) == 0) {
+        limits.affinity_cpus = CPU_COUNT(&mask);
+    }
+    
+    // hierarchy-id:controllers:path; v2 is the single "0::" line. In hybrid
+    // setups the v1 cpu and memory controllers are the ones enforced.
+    std::string v2_path, cpu_path, memory_path;
+    {
+        std::ifstream cgroup(root + "/proc/self/cgroup");
+        std::string line;
+        while (std::getline(cgroup, line)) {
+            const size_t a = line.find(':'), b = line.find(':', a + 1);
+            if (a == std::string::npos || b == std::string::npos) continue;
+            const std::string controllers = line.substr(a + 1, b - a - 1);
+            const std::string path = line.substr(b + 1);
+            if (line.compare(0, a, "0") == 0 && controllers.empty()) v2_path = path;
+            const auto list = split(controllers, ',');
+            if (contains(list, "cpu")) cpu_path = path;
+            if (contains(list, "memory")) memory_path = path;
+        }
+    }
+    
+    Hierarchy h;
+    if (!cpu_path.empty() || !memory_path.empty()) {
+        if (!cpu_path.empty() && locate(root, false, "cpu", cpu_path, h)) {
+            walk_up(h, [&](const std::string& dir) {
+                std::string quota, period;
+                if (read_line(dir + "/cpu.cfs_quota_us", quota) && read_line(dir + "/cpu.cfs_period_us", period)) {
+                    const double q = std::atof(quota.c_str()), p = std::atof(period.c_str());
+                    if (q > 0.0 && p > 0.0) keep_lower(limits.cpu_quota, q / p);
+                }
+            });
+            limits.cgroup_version = 1;
+        }
+        if (!memory_path.empty() && locate(root, false, "memory", memory_path, h)) {
+            walk_up(h, [&](const std::string& dir) {
+                std::string value;
+                if (read_line(dir + "/memory.limit_in_bytes", value)) {
+                    const uint64_t bytes = std::strtoull(value.c_str(), nullptr, 10);
+                    if (bytes < v1_unlimited) keep_lower(limits.memory_limit, bytes);
+                }
+            });
+            limits.cgroup_version = 1;
+        }
+    } else if (!v2_path.empty() && locate(root, true, "", v2_path, h)) {
+        walk_up(h, [&](const std::string& dir) {
+            std::string value;
+            if (read_line(dir + "/cpu.max", value)) {
+                // "<quota> <period>" or "max <period>"
+                std::istringstream in(value);
+                std::string quota;
+                double period = 0.0;
+                in >> quota >> period;
+                if (quota != "max" && period > 0.0) keep_lower(limits.cpu_quota, std::atof(quota.c_str()) / period);
+            }
+            if (read_line(dir + "/memory.max", value) && value != "max") {
+                keep_lower(limits.memory_limit, std::strtoull(value.c_str(), nullptr, 10));
+            }
+        });
+        limits.cgroup_version = 2;
+    }
+    if (limits.cpu_quota == 0.0 && limits.memory_limit == 0) {
+        limits.cgroup_version = 0;
+    }
+    
+    return limits;
+}
+
+const ResourceLimits& ResourceLimits::detect() {
+    static const ResourceLimits limits = read("");
+    return limits;
+}
+
+size_t ResourceLimits::threads() {
+    const size_t n = thread_override.load();
+    return n > 0 ? n : detect().cpus();
+}
+
+void ResourceLimits::set_threads(size_t n) {
+    thread_override.store(n);
+}
+
+} // namespace chargeopt
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace chargeopt {
+
+// CPU and memory actually available to this process, as opposed to the
+// host's: the affinity mask (cpusets, taskset) and the cgroup v1/v2 CPU
+// bandwidth quota and memory limit of the process's cgroup and its
+// ancestors. In a container, std::thread::hardware_concurrency() reports
+// every host core; thread pools and working-set sizes are derived from
+// these limits instead.
+struct ResourceLimits {
+    size_t host_cpus = 1;           // Online CPUs on the machine
+    size_t affinity_cpus = 0;       // CPUs this process may run on (0 = unknown)
+    double cpu_quota = 0.0;         // CPU bandwidth in cores (0 = unlimited)
+    uint64_t memory_limit = 0;      // Bytes (0 = unlimited)
+    uint64_t physical_memory = 0;   // Bytes (0 = unknown)
+    int cgroup_version = 0;         // 1 or 2; 0 when no cgroup limits were found
+    
+    // Threads worth running: affinity, capped by the quota rounded up
+    size_t cpus() const;
+    
+    // Memory the process may use: the cgroup limit or physical memory,
+    // whichever is smaller (0 = unknown)
+    uint64_t memory_budget() const;
+    
+    // One line for logs, e.g. "8 of 128 CPUs (cgroup v2 quota), memory 4.0 GiB"
+    std::string describe() const;
+    
+    // Limits of the running process, read once
+    static const ResourceLimits& detect();
+    
+    // Reads cgroup files below root ("" = the real /proc and /sys), for tests
+    static ResourceLimits read(const std::string& root);
+    
+    // Worker threads to use: set_threads() if called with n > 0, else cpus()
+    static size_t threads();
+    static void set_threads(size_t n);
+};
+
+} // namespace chargeopt
@@ -0,0 +1,65 @@
+#pragma once
+
+#include "molecule.hpp"
+#include <Eigen/Dense>
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+namespace chargeopt {
+
+// Merz-Kollman fitting points: shells at several multiples of each atom's
+// van der Waals radius, keeping only points outside every other atom's
+// shell of the same scale. For targets given analytically (distributed
+// multipoles) rather than on a cube. Points on each sphere follow a
+// Fibonacci spiral, which spreads them evenly.
+class ShellGrid {
+public:
+    struct Config {
+        std::vector<double> scales = {1.4, 1.6, 1.8, 2.0};
+        double density = 6.0;   // Points per square Angstrom of shell
+        
+        Config() {}
+    };
+    
+    // Mx3 positions in Bohr
+    static Eigen::MatrixXd positions(const Molecule& mol, const Config& config = Config()) {
+        constexpr double angstrom_to_bohr = 1.889726125;
+        const double golden_angle = M_PI * (3.0 - std::sqrt(5.0));
+        const Eigen::MatrixXd sites = mol.positions();
+        
+        std::vector<Eigen::Vector3d> points;
+        for (double scale : config.scales) {
+            Eigen::VectorXd radius(mol.num_atoms());
+            for (size_t j = 0; j < mol.num_atoms(); ++j) {
+                radius(j) = scale * mol.atom(j).vdw_radius() * angstrom_to_bohr;
+            }
+            
+            for (size_t i = 0; i < mol.num_atoms(); ++i) {
+                const double r_angstrom = radius(i) / angstrom_to_bohr;
+                const int n = std::max(1, static_cast<int>(std::ceil(config.density * 4.0 * M_PI * r_angstrom * r_angstrom)));
+                for (int k = 0; k < n; ++k) {
+                    const double z = 1.0 - (2.0 * k + 1.0) / n;
+                    const double rho = std::sqrt(1.0 - z * z);
+                    const double phi = k * golden_angle;
+                    const Eigen::Vector3d p = sites.row(i).transpose()
+                        + radius(i) * Eigen::Vector3d(rho * std::cos(phi), rho * std::sin(phi), z);
+                    
+                    bool outside = true;
+                    for (size_t j = 0; outside && j < mol.num_atoms(); ++j) {
+                        outside = j == i || (p - sites.row(j).transpose()).norm() >= radius(j);
+                    }
+                    if (outside) points.push_back(p);
+                }
+            }
+        }
+        
+        Eigen::MatrixXd result(points.size(), 3);
+        for (size_t k = 0; k < points.size(); ++k) {
+            result.row(k) = points[k].transpose();
+        }
+        return result;
+    }
+};
+
+} // namespace chargeopt
@@ -0,0 +1,109 @@
+#pragma once
+
+#include "thread_pool.hpp"
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+
+namespace chargeopt {
+
+// Small dependency graph of tasks. On a ThreadPool each task is queued as
+// soon as everything it depends on has finished, so independent tasks
+// overlap and a run takes about its critical-path time. Tasks may only
+// depend on tasks added before them, so insertion order is a valid serial
+// order. If a task throws, nothing new is started and run() rethrows the
+// first exception once the running tasks have finished.
+class TaskGraph {
+public:
+    // Returns the task's id for use in later dependency lists
+    size_t add(std::function<void()> task, const std::vector<size_t>& deps = {}) {
+        const size_t id = nodes_.size();
+        for (size_t d : deps) {
+            if (d >= id) {
+                throw std::runtime_error("TaskGraph: dependency on a later task");
+            }
+            nodes_[d].dependents.push_back(id);
+        }
+        nodes_.push_back({std::move(task), {}, deps.size()});
+        return id;
+    }
+    
+    size_t size() const { return nodes_.size(); }
+    
+    // Without a pool, tasks run in the calling thread in insertion order.
+    // The pool must not be one whose workers are blocked in this call.
+    void run(ThreadPool* pool) {
+        if (!pool) {
+            for (auto& node : nodes_) {
+                node.task();
+            }
+            return;
+        }
+        
+        std::mutex mutex;
+        std::condition_variable idle;
+        std::vector<size_t> waiting(nodes_.size());
+        size_t running = 0;
+        std::exception_ptr error;
+        
+        std::function<void(size_t)> launch = [&](size_t i) {
+            pool->submit([&, i] {
+                std::exception_ptr failure;
+                try {
+                    nodes_[i].task();
+                } catch (...) {
+                    failure = std::current_exception();
+                }
+                
+                std::vector<size_t> ready;
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    if (failure && !error) error = failure;
+                    if (!error) {
+                        for (size_t d : nodes_[i].dependents) {
+                            if (--waiting[d] == 0) ready.push_back(d);
+                        }
+                    }
+                    running += ready.size();
+                }
+                for (size_t d : ready) {
+                    launch(d);
+                }
+                
+                std::lock_guard<std::mutex> lock(mutex);
+                if (--running == 0) idle.notify_all();
+            });
+        };
+        
+        std::vector<size_t> roots;
+        for (size_t i = 0; i < nodes_.size(); ++i) {
+            waiting[i] = nodes_[i].deps;
+            if (waiting[i] == 0) roots.push_back(i);
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            running = roots.size();
+        }
+        for (size_t i : roots) {
+            launch(i);
+        }
+        
+        std::unique_lock<std::mutex> lock(mutex);
+        idle.wait(lock, [&] { return running == 0; });
+        if (error) std::rethrow_exception(error);
+    }
+
+private:
+    struct Node {
+        std::function<void()> task;
+        std::vector<size_t> dependents;
+        size_t deps;
+    };
+    
+    std::vector<Node> nodes_;
+};
+
+} // namespace chargeopt
@@ -0,0 +1,203 @@
+#include "charge_database.hpp"
+#include "../core/hash.hpp"
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <stdexcept>
+#include <cstdio>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace chargeopt {
+
+namespace {
+
+struct Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t depth;
+    uint64_t count;
+};
+
+constexpr char db_magic[8] = {'C', 'H', 'G', 'D', 'B', '0', '1', '\0'};
+constexpr uint32_t db_version = 1;
+
+// Exclusive flock on <db>.lock for the duration of an update. The database
+// itself is replaced by rename(), so it cannot carry the lock.
+class UpdateLock {
+public:
+    explicit UpdateLock(const std::string& path) {
+        const std::string lock_path = path + ".lock";
+        fd_ = ::open(lock_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (fd_ < 0) {
+            throw std::runtime_error("Cannot open charge database lock: " + lock_path);
+        }
+        if (flock(fd_, LOCK_EX) != 0) {
+            ::close(fd_);
+            throw std::runtime_error("Cannot lock charge database: " + lock_path);
+        }
+    }
+    
+    ~UpdateLock() {
+        ::close(fd_);  // Releases the lock
+    }
+    
+    UpdateLock(const UpdateLock&) = delete;
+    UpdateLock& operator=(const UpdateLock&) = delete;
+
+private:
+    int fd_ = -1;
+};
+
+} // namespace
+
+ChargeDatabase::~ChargeDatabase() {
+    release();
+}
+
+ChargeDatabase::ChargeDatabase(ChargeDatabase&& other) noexcept {
+    *this = std::move(other);
+}
+
+ChargeDatabase& ChargeDatabase::operator=(ChargeDatabase&& other) noexcept {
+    if (this != &other) {
+        release();
+        mapping_ = other.mapping_;
+        mapping_size_ = other.mapping_size_;
+        records_ = other.records_;
+        count_ = other.count_;
+        depth_ = other.depth_;
+        content_hash_ = other.content_hash_;
+        other.mapping_ = nullptr;
+        other.mapping_size_ = 0;
+        other.records_ = nullptr;
+        other.count_ = 0;
+    }
+    return *this;
+}
+
+void ChargeDatabase::release() {
+    if (mapping_) {
+        munmap(mapping_, mapping_size_);
+    }
+    mapping_ = nullptr;
+    mapping_size_ = 0;
+    records_ = nullptr;
+    count_ = 0;
+    content_hash_ = 0;
+}
+
+ChargeDatabase ChargeDatabase::open(const std::string& path) {
+    ChargeDatabase db;
+    
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return db;  // Missing database behaves as empty
+    }
+    
+    struct stat st;
+    if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(Header)) {
+        ::close(fd);
+        throw std::runtime_error("Invalid charge database: " + path);
+    }
+    
+    void* map = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (map == MAP_FAILED) {
+        throw std::runtime_error("Cannot map charge database: " + path);
+    }
+    
+    db.mapping_ = map;
+    db.mapping_size_ = st.st_size;
+    
+    const Header* header = static_cast<const Header*>(map);
+    if (std::memcmp(header->magic, db_magic, sizeof(db_magic)) != 0 || header->version != db_version) {
+        throw std::runtime_error("Not a charge database (bad magic/version): " + path);
+    }
+    if (sizeof(Header) + header->count * sizeof(Record) > db.mapping_size_) {
+        throw std::runtime_error("Truncated charge database: " + path);
+    }
+    
+    db.depth_ = header->depth;
+    db.count_ = header->count;
+    db.records_ = reinterpret_cast<const Record*>(static_cast<const char*>(map) + sizeof(Header));
+    db.content_hash_ = hash::fnv1a(map, db.mapping_size_);
+    
+    return db;
+}
+
+bool ChargeDatabase::lookup(uint64_t key, double& charge) const {
+    const Record* end = records_ + count_;
+    const Record* it = std::lower_bound(records_, end, key,
+        [](const Record& r, uint64_t k) { return r.key < k; });
+    if (it == end || it->key != key) {
+        return false;
+    }
+    charge = it->charge;
+    return true;
+}
+
+void ChargeDatabase::update(const std::string& path,
+                            const std::vector<uint64_t>& keys,
+                            const Eigen::VectorXd& charges,
+                            int depth) {
+    // Concurrent updaters take turns; without the lock both would merge
+    // into the same old version and the last rename would drop the other's
+    UpdateLock lock(path);
+    std::map<uint64_t, Record> merged;
+    
+    {
+        ChargeDatabase existing = open(path);
+        if (existing.size() > 0 && existing.depth() != depth) {
+            throw std::runtime_error("Charge database depth mismatch: " + path);
+        }
+        for (size_t i = 0; i < existing.count_; ++i) {
+            merged[existing.records_[i].key] = existing.records_[i];
+        }
+    }
+    
+    for (size_t i = 0; i < keys.size(); ++i) {
+        auto it = merged.find(keys[i]);
+        if (it == merged.end()) {
+            merged[keys[i]] = Record{keys[i], charges(i), 1, 0};
+        } else {
+            Record& r = it->second;
+            r.count += 1;
+            r.charge += (charges(i) - r.charge) / r.count;
+        }
+    }
+    
+    Header header;
+    std::memcpy(header.magic, db_magic, sizeof(db_magic));
+    header.version = db_version;
+    header.depth = depth;
+    header.count = merged.size();
+    
+    // Write next to the target, then rename over it (atomic on POSIX)
+    const std::string tmp = path + ".tmp." + std::to_string(getpid());
+    {
+        std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+        if (!out.is_open()) {
+            throw std::runtime_error("Cannot write charge database: " + tmp);
+        }
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        for (const auto& kv : merged) {
+            out.write(reinterpret_cast<const char*>(&kv.second), sizeof(Record));
+        }
+        if (!out) {
+            throw std::runtime_error("Error writing charge database: " + tmp);
+        }
+    }
+    
+    if (std::rename(tmp.c_str(), path.c_str()) != 0) {
+        std::remove(tmp.c_str());
+        throw std::runtime_error("Cannot replace charge database: " + path);
+    }
+}
+
+} // namespace chargeopt
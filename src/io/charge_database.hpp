@@ -0,0 +1,71 @@
+#pragma once
+
+#include <Eigen/Dense>
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+namespace chargeopt {
+
+// On-disk database of fitted atomic charges keyed by atom-environment hash
+// (Topology::environment_hashes).
+//
+// File layout (native endianness):
+//   Header  { char magic[8]; uint32 version; uint32 depth; uint64 count; }
+//   Record  { uint64 key; double charge; uint32 count; uint32 reserved; } x count
+// Records are sorted by key. Readers mmap the file read-only and binary-search
+// it, so lookups take no locks and any number of threads can share one
+// instance. Updates write a new file and rename() it over the old one;
+// existing readers keep their mapping of the previous version. Updaters
+// serialize on an flock of <path>.lock.
+class ChargeDatabase {
+public:
+    struct Record {
+        uint64_t key;
+        double charge;      // Running mean of all observations
+        uint32_t count;     // Number of fitted atoms averaged
+        uint32_t reserved;
+    };
+    
+    ChargeDatabase() {}
+    ~ChargeDatabase();
+    
+    ChargeDatabase(const ChargeDatabase&) = delete;
+    ChargeDatabase& operator=(const ChargeDatabase&) = delete;
+    ChargeDatabase(ChargeDatabase&& other) noexcept;
+    ChargeDatabase& operator=(ChargeDatabase&& other) noexcept;
+    
+    // Map an existing database read-only. A missing file gives an empty database.
+    static ChargeDatabase open(const std::string& path);
+    
+    // Thread-safe: read-only binary search in the mapped records
+    bool lookup(uint64_t key, double& charge) const;
+    
+    size_t size() const { return count_; }
+    
+    // Hash of the mapped file contents, computed once at open()
+    uint64_t content_hash() const { return content_hash_; }
+    int depth() const { return depth_; }
+    
+    // Merge fitted charges into the database at path (created if missing)
+    // and atomically replace the file; holds <path>.lock throughout
+    static void update(const std::string& path,
+                       const std::vector<uint64_t>& keys,
+                       const Eigen::VectorXd& charges,
+                       int depth);
+    
+    static constexpr int default_depth = 2;
+
+private:
+    void* mapping_ = nullptr;
+    size_t mapping_size_ = 0;
+    const Record* records_ = nullptr;
+    size_t count_ = 0;
+    int depth_ = default_depth;
+    uint64_t content_hash_ = 0;
+    
+    void release();
+};
+
+} // namespace chargeopt
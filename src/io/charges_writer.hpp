@@ -0,0 +1,96 @@
+#pragma once
+
+#include "../core/molecule.hpp"
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <stdexcept>
+
+namespace chargeopt {
+
+class ChargesWriter {
+public:
+    // Charges file: '#' header lines followed by the fixed-width atom table
+    static void write(const std::string& path,
+                      const std::vector<std::string>& header,
+                      const Molecule& mol) {
+        std::ofstream out(path);
+        if (!out.is_open()) {
+            throw std::runtime_error("Cannot open output file: " + path);
+        }
+        write(out, header, mol);
+    }
+    
+    static void write(std::ostream& out,
+                      const std::vector<std::string>& header,
+                      const Molecule& mol) {
+        for (const auto& line : header) {
+            out << "# " << line << std::endl;
+        }
+        out << "#" << std::endl;
+        out << "# Atom  Element  Charge(e)" << std::endl;
+        
+        out << std::fixed << std::setprecision(6);
+        for (size_t i = 0; i < mol.num_atoms(); ++i) {
+            const auto& atom = mol.atom(i);
+            out << std::setw(5) << (i + 1) << "  "
+                << std::setw(7) << std::left << atom.element << std::right << "  "
+                << std::setw(12) << atom.charge << std::endl;
+        }
+    }
+    
+    // Reads back a file written above. False if it is missing or was cut
+    // short: no atom table, or a table row that is incomplete.
+    static bool read(const std::string& path,
+                     std::vector<std::string>& header,
+                     std::vector<std::string>& elements,
+                     std::vector<double>& charges) {
+        std::ifstream in(path);
+        if (!in.is_open()) {
+            return false;
+        }
+        header.clear();
+        elements.clear();
+        charges.clear();
+        
+        std::string line;
+        bool table = false;
+        while (std::getline(in, line)) {
+            if (in.eof()) {
+                return false;  // Every line written ends in a newline
+            }
+            if (!table) {
+                if (line == "# Atom  Element  Charge(e)") {
+                    table = true;
+                } else if (line.compare(0, 2, "# ") == 0) {
+                    header.push_back(line.substr(2));
+                } else if (line != "#") {
+                    return false;
+                }
+                continue;
+            }
+            std::istringstream row(line);
+            size_t index = 0;
+            std::string element;
+            double charge = 0.0;
+            if (!(row >> index >> element >> charge) || index != charges.size() + 1) {
+                return false;
+            }
+            elements.push_back(element);
+            charges.push_back(charge);
+        }
+        return table && !charges.empty();
+    }
+    
+    // Format a value the way an unmodified ostream would
+    template <typename T>
+    static std::string to_text(const T& value) {
+        std::ostringstream oss;
+        oss << value;
+        return oss.str();
+    }
+};
+
+} // namespace chargeopt
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "../core/esp_grid.hpp"
+#include "memory_stream.hpp"
 #include <string>
 #include <fstream>
 #include <sstream>
@@ -13,12 +14,29 @@ namespace chargeopt {
 
 class CubeParser {
 public:
-    static ESPGrid parse(const std::string& filename) {
+    // filter_extreme: drop points whose |ESP| exceeds the distance-dependent
+    // limits below. Robust fitting (RobustFitter) downweights such points
+    // itself and parses with the filter off.
+    // Progress messages go to log.
+    static ESPGrid parse(const std::string& filename, bool filter_extreme = true,
+                         std::ostream& log = std::cout) {
         std::ifstream file(filename);
         if (!file.is_open()) {
             throw std::runtime_error("Cannot open CUBE file: " + filename);
         }
-        
+        return parse_stream(file, filter_extreme, log);
+    }
+    
+    // File contents already in memory (e.g. from FilePrefetcher)
+    static ESPGrid parse_buffer(const std::string& data, bool filter_extreme = true,
+                                std::ostream& log = std::cout) {
+        MemoryStreamBuf buffer(data);
+        std::istream in(&buffer);
+        return parse_stream(in, filter_extreme, log);
+    }
+    
+    static ESPGrid parse_stream(std::istream& file, bool filter_extreme = true,
+                                std::ostream& log = std::cout) {
         ESPGrid grid;
         std::string line;
         
@@ -51,8 +69,8 @@ public:
         std::istringstream iss4(line);
         iss4 >> nz >> vz(0) >> vz(1) >> vz(2);
         
-        std::cout << "  Grid dimensions: " << nx << " x " << ny << " x " << nz << std::endl;
-        std::cout << "  Grid spacing: " << vx.norm() << " Bohr (keeping atomic units)" << std::endl;
+        log << "  Grid dimensions: " << nx << " x " << ny << " x " << nz << std::endl;
+        log << "  Grid spacing: " << vx.norm() << " Bohr (keeping atomic units)" << std::endl;
         
         // Read and store atom positions (KEEP IN BOHR!)
         std::vector<Eigen::Vector3d> atom_positions;
@@ -71,7 +89,7 @@ public:
             atomic_numbers.push_back(atomic_num);
         }
         
-        std::cout << "  Atom positions stored in Bohr (atomic units)" << std::endl;
+        log << "  Atom positions stored in Bohr (atomic units)" << std::endl;
         
         // Read volumetric data (ESP in atomic units)
         std::vector<double> values;
@@ -82,7 +100,7 @@ public:
             values.push_back(val);
         }
         
-        std::cout << "  ESP values read: " << values.size() << " (expected: " << (nx*ny*nz) << ")" << std::endl;
+        log << "  ESP values read: " << values.size() << " (expected: " << (nx*ny*nz) << ")" << std::endl;
         
         if (values.empty()) {
             throw std::runtime_error("No ESP values read from CUBE file!");
@@ -131,20 +149,30 @@ public:
             
             if (count > 100) {
                 double avg_esp = sum_esp / count;
-                std::cout << "  Sign detection: sampled " << count << " points" << std::endl;
-                std::cout << "  Average ESP in molecular shell: " << avg_esp << " a.u." << std::endl;
+                log << "  Sign detection: sampled " << count << " points" << std::endl;
+                log << "  Average ESP in molecular shell: " << avg_esp << " a.u." << std::endl;
                 
                 // For molecules with electronegative atoms, avg ESP should be negative
                 if (avg_esp > 0.001) {
                     should_flip_sign = true;
-                    std::cout << "  ⚠️  INVERTED SIGN DETECTED - flipping ESP signs!" << std::endl;
+                    log << "  ⚠️  INVERTED SIGN DETECTED - flipping ESP signs!" << std::endl;
                 } else {
-                    std::cout << "  ✓ Standard ESP sign convention" << std::endl;
+                    log << "  ✓ Standard ESP sign convention" << std::endl;
                 }
             }
         }
         
-        // Build grid, filtering extreme points
+        // Build grid, filtering extreme points; the lattice node of every
+        // kept point is recorded for lattice-based kernels
+        GridLattice lattice;
+        lattice.origin = origin;
+        lattice.axes.row(0) = vx;
+        lattice.axes.row(1) = vy;
+        lattice.axes.row(2) = vz;
+        lattice.dims[0] = nx;
+        lattice.dims[1] = ny;
+        lattice.dims[2] = nz;
+        
         size_t idx = 0;
         int filtered_close = 0;
         int filtered_extreme = 0;
@@ -177,7 +205,7 @@ public:
                         esp_limit = 50.0;  // More lenient for closer points
                     }
                     
-                    if (std::abs(esp_val) > esp_limit) {
+                    if (filter_extreme && std::abs(esp_val) > esp_limit) {
                         too_close = true;
                         filtered_extreme++;
                     }
@@ -189,6 +217,7 @@ public:
                         // CRITICAL: Store position in BOHR (atomic units)
                         // Store ESP in a.u. (Hartree/e)
                         grid.add_point(pos, final_esp);
+                        lattice.node.push_back(idx);
                     }
                     
                     idx++;
@@ -196,9 +225,11 @@ public:
             }
         }
         
-        std::cout << "  Grid points accepted: " << grid.num_points() << std::endl;
-        std::cout << "  Filtered (too close to nuclei): " << filtered_close << std::endl;
-        std::cout << "  Filtered (extreme ESP values): " << filtered_extreme << std::endl;
+        grid.set_lattice(lattice);
+        
+        log << "  Grid points accepted: " << grid.num_points() << std::endl;
+        log << "  Filtered (too close to nuclei): " << filtered_close << std::endl;
+        log << "  Filtered (extreme ESP values): " << filtered_extreme << std::endl;
         
         if (grid.num_points() == 0) {
             throw std::runtime_error("No valid ESP points after filtering!");
@@ -207,8 +238,8 @@ public:
         // Report final ESP range
         double min_val = grid.min_potential();
         double max_val = grid.max_potential();
-        std::cout << "  Final ESP range: [" << min_val << ", " << max_val << "] a.u." << std::endl;
-        std::cout << "  ✓ All data in atomic units (Bohr, Hartree/e)" << std::endl;
+        log << "  Final ESP range: [" << min_val << ", " << max_val << "] a.u." << std::endl;
+        log << "  ✓ All data in atomic units (Bohr, Hartree/e)" << std::endl;
         
         return grid;
     }
@@ -0,0 +1,254 @@
+#include "file_prefetcher.hpp"
+#include <fstream>
+#include <stdexcept>
+
+#ifdef CHARGEOPT_HAVE_LIBURING
+#include <liburing.h>
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace chargeopt {
+
+#ifdef CHARGEOPT_HAVE_LIBURING
+
+// One ring owned by one thread: it opens files, queues reads, reaps
+// completions and resubmits short reads. Opening happens on this thread
+// too, so a slow metadata server never blocks the caller.
+class FilePrefetcher::UringReader {
+public:
+    explicit UringReader(unsigned depth) : depth_(std::max(depth, 1u)) {
+        int rc = io_uring_queue_init(depth_, &ring_, 0);
+        if (rc < 0) {
+            throw std::runtime_error(std::string("io_uring unavailable: ") + std::strerror(-rc));
+        }
+        thread_ = std::thread([this] { loop(); });
+    }
+    
+    ~UringReader() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        wake_.notify_one();
+        thread_.join();
+        io_uring_queue_exit(&ring_);
+    }
+    
+    std::shared_future<Buffer> read(const std::string& path) {
+        std::unique_ptr<Request> request(new Request);
+        request->path = path;
+        std::shared_future<Buffer> result = request->promise.get_future().share();
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            incoming_.push_back(std::move(request));
+        }
+        wake_.notify_one();
+        return result;
+    }
+
+private:
+    struct Request {
+        std::string path;
+        std::promise<Buffer> promise;
+        std::shared_ptr<std::string> data;
+        size_t done = 0;
+        int fd = -1;
+    };
+    
+    // Largest single read; longer files are read in several submissions
+    static constexpr size_t max_read = size_t(1) << 30;
+    
+    void finish(Request* request, const std::string& error = std::string()) {
+        if (request->fd >= 0) {
+            ::close(request->fd);
+        }
+        if (error.empty()) {
+            request->data->resize(request->done);
+            request->promise.set_value(request->data);
+        } else {
+            request->promise.set_exception(std::make_exception_ptr(std::runtime_error(error)));
+        }
+        delete request;
+    }
+    
+    void queue_read(Request* request) {
+        io_uring_sqe* sqe = io_uring_get_sqe(&ring_);
+        if (!sqe) {
+            io_uring_submit(&ring_);
+            sqe = io_uring_get_sqe(&ring_);
+        }
+        const size_t length = std::min(request->data->size() - request->done, max_read);
+        io_uring_prep_read(sqe, request->fd, &(*request->data)[request->done],
+                           static_cast<unsigned>(length), request->done);
+        io_uring_sqe_set_data(sqe, request);
+    }
+    
+    // Returns true if a read was queued
+    bool start(Request* request) {
+        request->fd = ::open(request->path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (request->fd < 0) {
+            finish(request, "Cannot open file: " + request->path);
+            return false;
+        }
+        struct stat st;
+        if (::fstat(request->fd, &st) != 0) {
+            finish(request, "Cannot stat file: " + request->path);
+            return false;
+        }
+        request->data = std::make_shared<std::string>(static_cast<size_t>(st.st_size), '\0');
+        if (st.st_size == 0) {
+            finish(request);
+            return false;
+        }
+        queue_read(request);
+        return true;
+    }
+    
+    void complete(io_uring_cqe* cqe) {
+        Request* request = static_cast<Request*>(io_uring_cqe_get_data(cqe));
+        const int res = cqe->res;
+        io_uring_cqe_seen(&ring_, cqe);
+        
+        if (res < 0) {
+            in_flight_--;
+            finish(request, "Read failed for " + request->path + ": " + std::strerror(-res));
+        } else if (res == 0 || request->done + res >= request->data->size()) {
+            // Done, or the file shrank underneath us
+            request->done += res;
+            in_flight_--;
+            finish(request);
+        } else {
+            request->done += res;
+            queue_read(request);
+            resubmit_ = true;
+        }
+    }
+    
+    void loop() {
+        for (;;) {
+            bool queued = false;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                if (in_flight_ == 0) {
+                    wake_.wait(lock, [this] { return stopping_ || !incoming_.empty(); });
+                    if (incoming_.empty()) return;
+                }
+                while (!incoming_.empty() && in_flight_ < depth_) {
+                    Request* request = incoming_.front().release();
+                    incoming_.pop_front();
+                    lock.unlock();
+                    if (start(request)) {
+                        in_flight_++;
+                        queued = true;
+                    }
+                    lock.lock();
+                }
+            }
+            if (queued || resubmit_) {
+                io_uring_submit(&ring_);
+                resubmit_ = false;
+            }
+            if (in_flight_ == 0) continue;
+            
+            // Short timeout so newly requested files are picked up promptly
+            io_uring_cqe* cqe = nullptr;
+            __kernel_timespec timeout = {0, 1000000};
+            if (io_uring_wait_cqe_timeout(&ring_, &cqe, &timeout) == 0) {
+                complete(cqe);
+                while (io_uring_peek_cqe(&ring_, &cqe) == 0) {
+                    complete(cqe);
+                }
+            }
+        }
+    }
+    
+    io_uring ring_;
+    unsigned depth_;
+    unsigned in_flight_ = 0;    // Reaper thread only
+    bool resubmit_ = false;     // Reaper thread only
+    std::thread thread_;
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::deque<std::unique_ptr<Request>> incoming_;
+    bool stopping_ = false;
+};
+
+#else
+
+// Placeholder so unique_ptr<UringReader> has a complete type
+class FilePrefetcher::UringReader {};
+
+#endif
+
+FilePrefetcher::FilePrefetcher(const Config& config) {
+#ifdef CHARGEOPT_HAVE_LIBURING
+    if (config.use_io_uring) {
+        try {
+            ring_.reset(new UringReader(config.queue_depth));
+            backend_ = Backend::IoUring;
+            return;
+        } catch (const std::exception&) {
+            // Kernel too old or io_uring blocked (e.g. by a seccomp profile)
+        }
+    }
+#endif
+    pool_.reset(new ThreadPool(config.threads));
+    backend_ = Backend::Threads;
+}
+
+FilePrefetcher::~FilePrefetcher() {
+    // Outstanding reads finish before the backend goes away
+    ring_.reset();
+    pool_.reset();
+}
+
+const char* FilePrefetcher::backend_name(Backend backend) {
+    return backend == Backend::IoUring ? "io_uring" : "threads";
+}
+
+void FilePrefetcher::request(const std::string& path) {
+    if (pending_.count(path)) {
+        return;
+    }
+#ifdef CHARGEOPT_HAVE_LIBURING
+    if (ring_) {
+        pending_.emplace(path, ring_->read(path));
+        return;
+    }
+#endif
+    pending_.emplace(path, pool_->submit([path] { return read_file(path); }).share());
+}
+
+FilePrefetcher::Buffer FilePrefetcher::take(const std::string& path) {
+    auto it = pending_.find(path);
+    if (it == pending_.end()) {
+        return nullptr;
+    }
+    std::shared_future<Buffer> result = std::move(it->second);
+    pending_.erase(it);
+    return result.get();
+}
+
+FilePrefetcher::Buffer FilePrefetcher::read_file(const std::string& path) {
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if (!file.is_open()) {
+        throw std::runtime_error("Cannot open file: " + path);
+    }
+    auto data = std::make_shared<std::string>(static_cast<size_t>(file.tellg()), '\0');
+    file.seekg(0);
+    if (!file.read(&(*data)[0], data->size())) {
+        throw std::runtime_error("Read failed for " + path);
+    }
+    return data;
+}
+
+} // namespace chargeopt
@@ -0,0 +1,63 @@
+#pragma once
+
+#include "../core/thread_pool.hpp"
+#include <future>
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+namespace chargeopt {
+
+// Reads whole input files ahead of use so the fitting loop never waits on
+// storage latency. Callers request() the files of the next jobs and take()
+// each buffer when the job starts; take() only blocks if the read is still
+// in flight.
+//
+// Backends: io_uring (when built with liburing and permitted by the kernel)
+// with a single reaper thread, otherwise a small pool of reader threads.
+// request()/take() are meant to be called from one thread.
+class FilePrefetcher {
+public:
+    using Buffer = std::shared_ptr<const std::string>;
+    
+    enum class Backend { Threads, IoUring };
+    
+    struct Config {
+        size_t threads = 4;             // Reader threads (thread backend)
+        unsigned queue_depth = 64;      // Reads in flight (io_uring backend)
+        bool use_io_uring = true;       // Fall back to threads if unavailable
+        
+        Config() {}
+    };
+    
+    explicit FilePrefetcher(const Config& config = Config());
+    ~FilePrefetcher();
+    
+    FilePrefetcher(const FilePrefetcher&) = delete;
+    FilePrefetcher& operator=(const FilePrefetcher&) = delete;
+    
+    Backend backend() const { return backend_; }
+    static const char* backend_name(Backend backend);
+    
+    // Starts reading path; no-op if it is already pending
+    void request(const std::string& path);
+    
+    bool pending(const std::string& path) const { return pending_.count(path) > 0; }
+    
+    // Contents of a requested file, waiting if needed; rethrows read
+    // errors. Returns nullptr if path was never requested.
+    Buffer take(const std::string& path);
+    
+    // Blocking read of a whole file
+    static Buffer read_file(const std::string& path);
+
+private:
+    class UringReader;
+    
+    Backend backend_ = Backend::Threads;
+    std::unique_ptr<ThreadPool> pool_;
+    std::unique_ptr<UringReader> ring_;
+    std::unordered_map<std::string, std::shared_future<Buffer>> pending_;
+};
+
+} // namespace chargeopt
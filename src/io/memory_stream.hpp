@@ -0,0 +1,22 @@
+#pragma once
+
+#include <streambuf>
+#include <string>
+
+namespace chargeopt {
+
+// Read-only streambuf over an existing buffer, so in-memory file contents
+// can go through the stream-based parsers without a copy. The buffer must
+// outlive the stream.
+class MemoryStreamBuf : public std::streambuf {
+public:
+    MemoryStreamBuf(const char* data, size_t size) {
+        char* begin = const_cast<char*>(data);
+        setg(begin, begin, begin + size);
+    }
+    
+    explicit MemoryStreamBuf(const std::string& data)
+        : MemoryStreamBuf(data.data(), data.size()) {}
+};
+
+} // namespace chargeopt
@@ -0,0 +1,130 @@
+#include "multipole_parser.hpp"
+#include "memory_stream.hpp"
+#include "../core/coulomb_kernel.hpp"
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+namespace chargeopt {
+
+namespace {
+
+std::string strip_comment(const std::string& line) {
+    return line.substr(0, line.find('!'));
+}
+
+} // namespace
+
+std::vector<MultipoleSite> MultipoleParser::parse(const std::string& filename, std::ostream& log) {
+    std::ifstream file(filename);
+    if (!file.is_open()) {
+        throw std::runtime_error("Cannot open multipole file: " + filename);
+    }
+    return parse_stream(file, log);
+}
+
+std::vector<MultipoleSite> MultipoleParser::parse_buffer(const std::string& data, std::ostream& log) {
+    MemoryStreamBuf buffer(data);
+    std::istream in(&buffer);
+    return parse_stream(in, log);
+}
+
+std::vector<MultipoleSite> MultipoleParser::parse_stream(std::istream& file, std::ostream& log) {
+    constexpr double angstrom_to_bohr = 1.889726125;
+    double length_scale = 1.0;
+    std::vector<MultipoleSite> sites;
+    int max_rank = 0;
+    std::string line;
+    int line_num = 0;
+    
+    while (std::getline(file, line)) {
+        line_num++;
+        std::istringstream iss(strip_comment(line));
+        std::string word;
+        if (!(iss >> word)) continue;
+        
+        std::string lower = word;
+        std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+        if (lower == "units") {
+            std::string unit;
+            iss >> unit;
+            std::transform(unit.begin(), unit.end(), unit.begin(), ::tolower);
+            if (unit == "angstrom" || unit == "a") {
+                length_scale = angstrom_to_bohr;
+            } else if (unit == "bohr") {
+                length_scale = 1.0;
+            } else {
+                throw std::runtime_error("Unknown units on line " + std::to_string(line_num) + ": " + unit);
+            }
+            continue;
+        }
+        
+        // Site header: name x y z, then keywords (Type, Radius, Rank)
+        MultipoleSite site;
+        site.name = word;
+        double x, y, z;
+        if (!(iss >> x >> y >> z)) {
+            throw std::runtime_error("Invalid multipole site line " + std::to_string(line_num));
+        }
+        site.position = Eigen::Vector3d(x, y, z) * length_scale;
+        int rank = -1;
+        while (iss >> word) {
+            if (word == "Rank" || word == "rank") iss >> rank;
+        }
+        if (rank < 0) {
+            throw std::runtime_error("Missing Rank on multipole site line " + std::to_string(line_num));
+        }
+        
+        // (rank + 1)^2 values, over as many lines as needed
+        const int count = (rank + 1) * (rank + 1);
+        std::vector<double> values;
+        while (static_cast<int>(values.size()) < count && std::getline(file, line)) {
+            line_num++;
+            std::istringstream vss(strip_comment(line));
+            double v;
+            while (vss >> v) values.push_back(v);
+            if (!vss.eof()) {
+                throw std::runtime_error("Invalid multipole value on line " + std::to_string(line_num));
+            }
+        }
+        if (static_cast<int>(values.size()) != count) {
+            throw std::runtime_error("Site " + site.name + ": expected " + std::to_string(count) +
+                                     " multipole values, read " + std::to_string(values.size()));
+        }
+        
+        const int kept = std::min(count, 9);
+        site.moments = Eigen::Map<const Eigen::VectorXd>(values.data(), kept);
+        max_rank = std::max(max_rank, rank);
+        sites.push_back(site);
+    }
+    
+    if (sites.empty()) {
+        throw std::runtime_error("No multipole sites read");
+    }
+    
+    double total = 0.0;
+    for (const auto& site : sites) total += site.moments(0);
+    log << "  Multipole sites: " << sites.size() << " (rank " << max_rank
+        << (max_rank > 2 ? ", ranks above 2 ignored" : "") << ")" << std::endl;
+    log << "  Total charge of sites: " << total << " e" << std::endl;
+    return sites;
+}
+
+Eigen::VectorXd MultipoleParser::potential(const std::vector<MultipoleSite>& sites, const Eigen::MatrixXd& points) {
+    Eigen::VectorXd v = Eigen::VectorXd::Zero(points.rows());
+    for (const auto& site : sites) {
+        v += CoulombKernel::multipole_column(points, site.position, site.moments);
+    }
+    return v;
+}
+
+bool MultipoleParser::is_multipole_file(const std::string& path) {
+    const size_t dot = path.rfind('.');
+    if (dot == std::string::npos) return false;
+    std::string ext = path.substr(dot + 1);
+    std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+    return ext == "punch" || ext == "pun" || ext == "dma";
+}
+
+} // namespace chargeopt
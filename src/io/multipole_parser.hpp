@@ -0,0 +1,43 @@
+#pragma once
+
+#include <Eigen/Dense>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace chargeopt {
+
+// One site of a distributed multipole analysis
+struct MultipoleSite {
+    std::string name;
+    Eigen::Vector3d position;   // Bohr
+    Eigen::VectorXd moments;    // Q00, Q10 Q11c Q11s, Q20 .. Q22s (a.u.), through rank 2
+};
+
+// Reads GDMA punch files (also used by Orient):
+//   ! comment
+//   Units angstrom                 (or bohr, the default)
+//   O   0.000  0.000  0.117   Rank 2
+//     -0.331
+//      0.000  0.000 -0.134
+//     -0.481  0.000  0.000  0.608  0.000
+// Each site header is followed by (rank + 1)^2 moments in a.u., in any
+// line layout. Ranks above 2 are read and dropped: at fitting-point
+// distances their contribution is small and the charges cannot carry it.
+class MultipoleParser {
+public:
+    static std::vector<MultipoleSite> parse(const std::string& filename, std::ostream& log = std::cout);
+    
+    // File contents already in memory (e.g. from FilePrefetcher)
+    static std::vector<MultipoleSite> parse_buffer(const std::string& data, std::ostream& log = std::cout);
+    
+    static std::vector<MultipoleSite> parse_stream(std::istream& file, std::ostream& log = std::cout);
+    
+    // Potential of every site at each of the Mx3 points (Bohr), in a.u.
+    static Eigen::VectorXd potential(const std::vector<MultipoleSite>& sites, const Eigen::MatrixXd& points);
+    
+    // Punch files are recognised by extension (.punch, .pun, .dma)
+    static bool is_multipole_file(const std::string& path);
+};
+
+} // namespace chargeopt
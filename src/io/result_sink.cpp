@@ -0,0 +1,353 @@
+#include "result_sink.hpp"
+#include "../core/atom.hpp"
+#include <charconv>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace chargeopt {
+
+namespace {
+
+constexpr size_t io_buffer_size = 1 << 20;
+
+std::FILE* open_output(const std::string& path, std::vector<char>& buffer) {
+    std::FILE* file = std::fopen(path.c_str(), "wb");
+    if (!file) {
+        throw std::runtime_error("Cannot open output file: " + path);
+    }
+    buffer.resize(io_buffer_size);
+    std::setvbuf(file, buffer.data(), _IOFBF, buffer.size());
+    return file;
+}
+
+void append_json_string(std::string& out, const std::string& s) {
+    out += '"';
+    for (unsigned char c : s) {
+        switch (c) {
+            case '"':  out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n"; break;
+            case '\r': out += "\\r"; break;
+            case '\t': out += "\\t"; break;
+            default:
+                if (c < 0x20) {
+                    char esc[8];
+                    std::snprintf(esc, sizeof(esc), "\\u%04x", c);
+                    out += esc;
+                } else {
+                    out += static_cast<char>(c);
+                }
+        }
+    }
+    out += '"';
+}
+
+// Shortest round-trip representation; JSON has no NaN/Inf
+void append_json_number(std::string& out, double value) {
+    if (!std::isfinite(value)) {
+        out += "null";
+        return;
+    }
+    char text[32];
+    auto end = std::to_chars(text, text + sizeof(text), value).ptr;
+    out.append(text, end);
+}
+
+void append_json_field(std::string& out, const char* name, double value) {
+    out += ",\"";
+    out += name;
+    out += "\":";
+    append_json_number(out, value);
+}
+
+template <typename T>
+void put(std::string& out, T value) {
+    char bytes[sizeof(T)];
+    std::memcpy(bytes, &value, sizeof(T));
+    out.append(bytes, sizeof(T));
+}
+
+void put_string(std::string& out, const std::string& s) {
+    put<uint32_t>(out, static_cast<uint32_t>(s.size()));
+    out += s;
+}
+
+// Pipes, sockets and terminals have a reader waiting on each record
+bool is_stream(std::FILE* file) {
+    const int fd = fileno(file);
+    struct stat st;
+    return isatty(fd) || (fstat(fd, &st) == 0 && (S_ISFIFO(st.st_mode) || S_ISSOCK(st.st_mode)));
+}
+
+void write_all(std::FILE* file, const std::string& data) {
+    if (std::fwrite(data.data(), 1, data.size(), file) != data.size()) {
+        throw std::runtime_error("Failed to write result sink");
+    }
+}
+
+} // namespace
+
+// ---------------------------------------------------------------- NDJSON
+
+NdjsonSink::NdjsonSink(const std::string& path) {
+    if (path == "-") {
+        file_ = stdout;
+    } else {
+        file_ = open_output(path, buffer_);
+        owned_ = true;
+    }
+    flush_each_ = is_stream(file_);
+}
+
+NdjsonSink::~NdjsonSink() {
+    try {
+        close();
+    } catch (...) {
+    }
+}
+
+void NdjsonSink::write(const JobRecord& r) {
+    std::string line;
+    line.reserve(256 + 24 * r.charges.size());
+    
+    line += "{\"job\":";
+    line += std::to_string(r.job);
+    line += ",\"xyz\":";
+    append_json_string(line, r.xyz_file);
+    line += ",\"cube\":";
+    append_json_string(line, r.cube_file);
+    line += ",\"output\":";
+    append_json_string(line, r.output_file);
+    line += ",\"status\":";
+    append_json_string(line, r.status);
+    if (!r.error.empty()) {
+        line += ",\"error\":";
+        append_json_string(line, r.error);
+    }
+    if (r.status == "ok") {
+        line += ",\"source\":";
+        append_json_string(line, r.source);
+        append_json_field(line, "total_charge", r.total_charge);
+        
+        line += ",\"elements\":[";
+        for (size_t i = 0; i < r.elements.size(); ++i) {
+            if (i) line += ',';
+            append_json_string(line, r.elements[i]);
+        }
+        line += "],\"charges\":[";
+        for (size_t i = 0; i < r.charges.size(); ++i) {
+            if (i) line += ',';
+            append_json_number(line, r.charges[i]);
+        }
+        line += ']';
+        
+        if (r.esp_rmse >= 0.0) {
+            append_json_field(line, "esp_rmse", r.esp_rmse);
+            append_json_field(line, "esp_max_error", r.esp_max_error);
+        } else {
+            line += ",\"esp_rmse\":null,\"esp_max_error\":null";
+        }
+        append_json_field(line, "dipole_debye", r.dipole);
+    }
+    
+    line += ",\"timings\":{\"parse_xyz\":";
+    append_json_number(line, r.t_parse_xyz);
+    append_json_field(line, "parse_cube", r.t_parse_cube);
+    append_json_field(line, "assemble", r.t_assemble);
+    append_json_field(line, "solve", r.t_solve);
+    append_json_field(line, "validate", r.t_validate);
+    append_json_field(line, "total", r.t_total);
+    line += "}}\n";
+    
+    write_all(file_, line);
+    if (flush_each_ && std::fflush(file_) != 0) {
+        throw std::runtime_error("Failed to write NDJSON output");
+    }
+}
+
+void NdjsonSink::close() {
+    if (!file_) return;
+    std::FILE* file = file_;
+    file_ = nullptr;
+    bool ok = std::fflush(file) == 0;
+    if (owned_) {
+        ok = std::fclose(file) == 0 && ok;
+    }
+    if (!ok) {
+        throw std::runtime_error("Failed to write NDJSON output");
+    }
+}
+
+// ---------------------------------------------------------------- Binary
+
+BinarySink::BinarySink(const std::string& path, size_t group_rows)
+    : group_rows_(group_rows > 0 ? group_rows : default_group_rows) {
+    file_ = open_output(path, buffer_);
+    
+    std::string header("CHGCOL01", 8);
+    put<uint32_t>(header, version);
+    put<uint32_t>(header, 0);
+    write_all(file_, header);
+    pending_.reserve(group_rows_);
+}
+
+BinarySink::~BinarySink() {
+    try {
+        close();
+    } catch (...) {
+    }
+}
+
+void BinarySink::write(const JobRecord& record) {
+    pending_.push_back(record);
+    if (pending_.size() >= group_rows_) {
+        flush_group();
+    }
+}
+
+void BinarySink::flush_group() {
+    if (pending_.empty()) return;
+    
+    uint64_t atoms = 0;
+    for (const auto& r : pending_) {
+        atoms += r.charges.size();
+    }
+    
+    std::string group("RGRP", 4);
+    put<uint32_t>(group, static_cast<uint32_t>(pending_.size()));
+    put<uint64_t>(group, atoms);
+    
+    for (const auto& r : pending_) put<uint64_t>(group, r.job);
+    for (const auto& r : pending_) put<uint8_t>(group, r.status == "ok" ? 0 : 1);
+    for (const auto& r : pending_) put<uint32_t>(group, static_cast<uint32_t>(r.charges.size()));
+    
+    const double JobRecord::* columns[] = {
+        &JobRecord::total_charge, &JobRecord::esp_rmse, &JobRecord::esp_max_error,
+        &JobRecord::dipole, &JobRecord::t_parse_xyz, &JobRecord::t_parse_cube,
+        &JobRecord::t_assemble, &JobRecord::t_solve, &JobRecord::t_validate,
+        &JobRecord::t_total
+    };
+    for (auto column : columns) {
+        for (const auto& r : pending_) put<double>(group, r.*column);
+    }
+    
+    Atom atom;
+    for (const auto& r : pending_) {
+        for (size_t i = 0; i < r.charges.size(); ++i) {
+            atom.element = i < r.elements.size() ? r.elements[i] : std::string();
+            put<uint8_t>(group, static_cast<uint8_t>(atom.atomic_number()));
+        }
+    }
+    for (const auto& r : pending_) {
+        for (double q : r.charges) put<double>(group, q);
+    }
+    for (const auto& r : pending_) put_string(group, r.xyz_file);
+    for (const auto& r : pending_) put_string(group, r.status == "ok" ? r.source : r.error);
+    
+    write_all(file_, group);
+    rows_written_ += pending_.size();
+    pending_.clear();
+}
+
+void BinarySink::close() {
+    if (!file_) return;
+    flush_group();
+    
+    std::string trailer("CHGEND01", 8);
+    put<uint64_t>(trailer, rows_written_);
+    write_all(file_, trailer);
+    
+    std::FILE* file = file_;
+    file_ = nullptr;
+    if (std::fclose(file) != 0) {
+        throw std::runtime_error("Failed to write binary output");
+    }
+}
+
+// ---------------------------------------------------------------- Writer
+
+AsyncResultWriter::AsyncResultWriter() = default;
+
+AsyncResultWriter::~AsyncResultWriter() {
+    try {
+        close();
+    } catch (...) {
+    }
+}
+
+void AsyncResultWriter::add_sink(std::unique_ptr<ResultSink> sink) {
+    if (thread_.joinable() || closed_) {
+        throw std::runtime_error("AsyncResultWriter: sinks must be added before submitting");
+    }
+    sinks_.push_back(std::move(sink));
+}
+
+void AsyncResultWriter::submit(JobRecord record) {
+    if (sinks_.empty()) return;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (closing_) {
+            throw std::runtime_error("AsyncResultWriter: submit after close");
+        }
+        if (!thread_.joinable()) {
+            thread_ = std::thread(&AsyncResultWriter::loop, this);
+        }
+        queue_.push_back(std::move(record));
+    }
+    ready_.notify_one();
+}
+
+void AsyncResultWriter::loop() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (;;) {
+        ready_.wait(lock, [this] { return closing_ || !queue_.empty(); });
+        if (queue_.empty()) break;
+        
+        // Take everything queued so far and format it without the lock
+        std::deque<JobRecord> batch;
+        batch.swap(queue_);
+        lock.unlock();
+        
+        for (const auto& record : batch) {
+            for (auto& sink : sinks_) {
+                try {
+                    sink->write(record);
+                } catch (const std::exception& e) {
+                    std::lock_guard<std::mutex> guard(mutex_);
+                    if (error_.empty()) error_ = e.what();
+                }
+            }
+        }
+        lock.lock();
+    }
+}
+
+void AsyncResultWriter::close() {
+    if (closed_) return;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        closing_ = true;
+    }
+    ready_.notify_one();
+    if (thread_.joinable()) {
+        thread_.join();
+    }
+    closed_ = true;
+    
+    for (auto& sink : sinks_) {
+        try {
+            sink->close();
+        } catch (const std::exception& e) {
+            if (error_.empty()) error_ = e.what();
+        }
+    }
+    if (!error_.empty()) {
+        throw std::runtime_error(error_);
+    }
+}
+
+} // namespace chargeopt
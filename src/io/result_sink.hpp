@@ -0,0 +1,133 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace chargeopt {
+
+// One finished (or failed) job, as emitted to machine-oriented sinks
+struct JobRecord {
+    uint64_t job = 0;                   // Index in the manifest
+    std::string xyz_file;
+    std::string cube_file;
+    std::string output_file;
+    std::string status = "ok";          // "ok" or "failed"
+    std::string source;                 // fitted, duplicate of ..., stored result, ...
+    std::string error;                  // Set when status is "failed"
+    double total_charge = 0.0;
+    std::vector<std::string> elements;
+    std::vector<double> charges;
+    double esp_rmse = -1.0;             // a.u.; negative = not available
+    double esp_max_error = -1.0;
+    double dipole = 0.0;                // Debye
+    
+    // Seconds per stage; zero for jobs that were not fitted
+    double t_parse_xyz = 0.0;
+    double t_parse_cube = 0.0;
+    double t_assemble = 0.0;
+    double t_solve = 0.0;
+    double t_validate = 0.0;
+    double t_total = 0.0;
+};
+
+class ResultSink {
+public:
+    virtual ~ResultSink() = default;
+    virtual void write(const JobRecord& record) = 0;
+    virtual void close() = 0;
+};
+
+// Newline-delimited JSON, one object per job. Path "-" writes to stdout.
+// Files are written through a large buffer; pipes, sockets and terminals
+// get each record as soon as it is written.
+class NdjsonSink : public ResultSink {
+public:
+    explicit NdjsonSink(const std::string& path);
+    ~NdjsonSink() override;
+    
+    void write(const JobRecord& record) override;
+    void close() override;
+
+private:
+    std::FILE* file_ = nullptr;
+    bool owned_ = false;
+    bool flush_each_ = false;   // Pipe, socket or terminal: flush per record
+    std::vector<char> buffer_;
+};
+
+// Compact little-endian columnar format.
+//
+//   file      := "CHGCOL01" u32 version u32 reserved  group*  "CHGEND01" u64 rows
+//   group     := "RGRP" u32 rows u64 atoms  column*
+//
+// Columns of each group, in order (one value per row unless noted):
+//   u64 job, u8 status (0 ok, 1 failed), u32 n_atoms,
+//   f64 total_charge, esp_rmse, esp_max_error, dipole,
+//   f64 t_parse_xyz, t_parse_cube, t_assemble, t_solve, t_validate, t_total,
+//   u8 atomic_number[atoms], f64 charge[atoms]      (flattened, row order),
+//   u32 length + bytes for xyz_file, then for source.
+//
+// Rows are buffered and written a group at a time; a file without the
+// trailer was truncated, but every complete group before it is readable.
+class BinarySink : public ResultSink {
+public:
+    static constexpr uint32_t version = 1;
+    static constexpr size_t default_group_rows = 1024;
+    
+    explicit BinarySink(const std::string& path, size_t group_rows = default_group_rows);
+    ~BinarySink() override;
+    
+    void write(const JobRecord& record) override;
+    void close() override;
+
+private:
+    void flush_group();
+    
+    std::FILE* file_ = nullptr;
+    std::vector<char> buffer_;
+    size_t group_rows_;
+    uint64_t rows_written_ = 0;
+    std::vector<JobRecord> pending_;
+};
+
+// Fans records out to its sinks from a dedicated writer thread so that
+// formatting and I/O never stall the fitting loop.
+class AsyncResultWriter {
+public:
+    AsyncResultWriter();
+    ~AsyncResultWriter();
+    
+    AsyncResultWriter(const AsyncResultWriter&) = delete;
+    AsyncResultWriter& operator=(const AsyncResultWriter&) = delete;
+    
+    // Sinks must be added before the first submit()
+    void add_sink(std::unique_ptr<ResultSink> sink);
+    bool empty() const { return sinks_.empty(); }
+    
+    void submit(JobRecord record);
+    
+    // Drains the queue, closes every sink and joins the thread.
+    // Rethrows the first error raised by a sink.
+    void close();
+
+private:
+    void loop();
+    
+    std::vector<std::unique_ptr<ResultSink>> sinks_;
+    std::deque<JobRecord> queue_;
+    std::mutex mutex_;
+    std::condition_variable ready_;
+    std::thread thread_;
+    bool closing_ = false;
+    bool closed_ = false;
+    std::string error_;
+};
+
+} // namespace chargeopt
@@ -0,0 +1,452 @@
+#include "shared_grid_cache.hpp"
+#include "cube_parser.hpp"
+#include "../core/hash.hpp"
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <thread>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace chargeopt {
+
+namespace {
+
+enum SlotState : uint32_t {
+    Empty = 0,
+    Building = 1,
+    Ready = 2,
+    Evicting = 3
+};
+
+constexpr size_t max_holders = 32;
+
+// All-zero is a valid empty slot, so a freshly truncated index needs no
+// initialization beyond its magic. A slot is taken by setting owner, and
+// freed by clearing it last, so a slot with a key always has an owner.
+struct Slot {
+    std::atomic<uint64_t> key;
+    std::atomic<uint32_t> state;
+    std::atomic<int32_t> owner;     // Claimer/publisher pid; 0 when free
+    std::atomic<uint64_t> bytes;    // Segment size, for diagnostics
+    std::atomic<int32_t> holders[max_holders];  // Pids of processes mapping it
+};
+
+struct Index {
+    std::atomic<uint64_t> magic;    // 0 while the creator initializes it
+    Slot slots[SharedGridCache::num_slots];
+};
+
+struct GridHeader {
+    uint64_t magic;
+    uint64_t key;
+    uint64_t count;
+    uint64_t has_lattice;
+    int32_t dims[3];
+    int32_t reserved;
+    double origin[3];
+    double axes[9];                 // Row-major, rows = lattice steps
+};
+
+constexpr uint64_t index_magic = 0x3244495347504f43ULL;  // "COPGSID2"
+constexpr uint64_t grid_magic = 0x3130444947504f43ULL;   // "COPGDI01"
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free && std::atomic<uint32_t>::is_always_lock_free
+              && std::atomic<int32_t>::is_always_lock_free,
+              "shared-memory slots need lock-free atomics");
+// Eigen's fixed-size vectors are plain arrays of doubles, though not
+// formally trivially copyable
+static_assert(sizeof(GridPoint) == 4 * sizeof(double) && alignof(GridPoint) == alignof(double),
+              "GridPoint is stored in shared memory as four doubles");
+
+std::string segment_name(const std::string& prefix, uint64_t key) {
+    char hex[17];
+    std::snprintf(hex, sizeof(hex), "%016llx", static_cast<unsigned long long>(key));
+    return "/" + prefix + "." + hex;
+}
+
+// The index mapping, shared by every grid mapped through it
+struct IndexMapping {
+    Index* index = nullptr;
+    
+    ~IndexMapping() {
+        if (index) munmap(index, sizeof(Index));
+    }
+};
+
+// Backing of a mapped grid: drops its slot reference when the last copy
+// of the grid goes away
+struct GridMapping {
+    std::shared_ptr<IndexMapping> index;
+    std::atomic<int32_t>* holder = nullptr;
+    void* map = nullptr;
+    size_t size = 0;
+    
+    ~GridMapping() {
+        if (map) munmap(map, size);
+        if (holder) holder->store(0);
+    }
+};
+
+bool process_alive(pid_t pid) {
+    return kill(pid, 0) == 0 || errno != ESRCH;
+}
+
+// Shared objects are trusted only if this user created them and nobody
+// else can write (or read) them
+bool private_object(int fd) {
+    struct stat st;
+    return fstat(fd, &st) == 0 && st.st_uid == getuid() && (st.st_mode & (S_IRWXG | S_IRWXO)) == 0;
+}
+
+std::shared_ptr<IndexMapping> open_index(const std::string& prefix) {
+    const std::string name = "/" + prefix + ".index";
+    bool created = false;
+    int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd >= 0) {
+        created = true;
+        if (ftruncate(fd, sizeof(Index)) != 0) {
+            ::close(fd);
+            shm_unlink(name.c_str());
+            return nullptr;
+        }
+    } else if (errno == EEXIST) {
+        fd = shm_open(name.c_str(), O_RDWR, 0600);
+        if (fd < 0) return nullptr;
+        // The creator may not have sized it yet
+        struct stat st;
+        for (int tries = 0; fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) < sizeof(Index); ++tries) {
+            if (tries == 1000) {
+                ::close(fd);
+                return nullptr;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    } else {
+        return nullptr;
+    }
+    if (!private_object(fd)) {
+        ::close(fd);
+        return nullptr;
+    }
+    
+    void* map = mmap(nullptr, sizeof(Index), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (map == MAP_FAILED) return nullptr;
+    
+    auto mapping = std::make_shared<IndexMapping>();
+    mapping->index = static_cast<Index*>(map);
+    if (created) {
+        mapping->index->magic.store(index_magic);
+    } else {
+        const uint64_t magic = mapping->index->magic.load();
+        if (magic != 0 && magic != index_magic) return nullptr;  // Other format version
+    }
+    return mapping;
+}
+
+// Identity of the file contents as far as stat can tell, plus the parser
+// options; never 0 (the empty-slot key)
+bool grid_key(const std::string& path, bool filter_extreme, uint64_t& key) {
+    char resolved[PATH_MAX];
+    struct stat st;
+    if (!realpath(path.c_str(), resolved) || stat(resolved, &st) != 0) {
+        return false;
+    }
+    uint64_t h = hash::fnv1a(std::string(resolved));
+    for (uint64_t v : {static_cast<uint64_t>(st.st_dev), static_cast<uint64_t>(st.st_ino),
+                       static_cast<uint64_t>(st.st_size), static_cast<uint64_t>(st.st_mtim.tv_sec),
+                       static_cast<uint64_t>(st.st_mtim.tv_nsec), static_cast<uint64_t>(filter_extreme),
+                       grid_magic}) {
+        h = hash::combine(h, v);
+    }
+    key = h != 0 ? h : 1;
+    return true;
+}
+
+Slot* find(Index* index, uint64_t key, const Slot* except = nullptr) {
+    for (Slot& slot : index->slots) {
+        if (&slot != except && slot.key.load() == key) return &slot;
+    }
+    return nullptr;
+}
+
+void release(Slot* slot) {
+    slot->key.store(0);
+    slot->state.store(Empty);
+    slot->owner.store(0);
+}
+
+// Whether a live process maps the entry; holders that died without
+// unmapping are dropped on the way
+bool referenced(Slot& slot) {
+    bool live = false;
+    for (auto& holder : slot.holders) {
+        int32_t pid = holder.load();
+        if (pid == 0) continue;
+        if (process_alive(pid)) {
+            live = true;
+        } else {
+            holder.compare_exchange_strong(pid, 0);
+        }
+    }
+    return live;
+}
+
+// A claimed (Empty or Building) entry whose owner died before publishing
+// is taken over and freed. The owner CAS makes sure it is still the dead
+// process's claim; if the entry turned out Ready it is left alone.
+bool take_down_if_abandoned(Slot* slot, const std::string& prefix, uint32_t state) {
+    int32_t owner = slot->owner.load();
+    if (owner == 0 || process_alive(owner)) return false;
+    const uint64_t key = slot->key.load();
+    if (!slot->owner.compare_exchange_strong(owner, getpid())) return false;
+    if (!slot->state.compare_exchange_strong(state, Evicting)) return false;
+    if (key != 0) shm_unlink(segment_name(prefix, key).c_str());
+    release(slot);
+    return true;
+}
+
+// Take a slot for key: an empty one, else evict an unreferenced entry
+Slot* claim(Index* index, const std::string& prefix, uint64_t key) {
+    const int32_t self = getpid();
+    for (int pass = 0; pass < 2; ++pass) {
+        for (Slot& slot : index->slots) {
+            int32_t free = 0;
+            if (pass == 1) {
+                uint32_t state = slot.state.load();
+                if (state == Ready) {
+                    if (!slot.state.compare_exchange_strong(state, Evicting)) continue;
+                    if (referenced(slot)) {
+                        slot.state.store(Ready);
+                        continue;
+                    }
+                    shm_unlink(segment_name(prefix, slot.key.load()).c_str());
+                    release(&slot);
+                } else if (state != Evicting) {
+                    take_down_if_abandoned(&slot, prefix, state);
+                }
+            }
+            if (slot.owner.compare_exchange_strong(free, self)) {
+                slot.key.store(key);
+                return &slot;
+            }
+        }
+    }
+    return nullptr;
+}
+
+// Map a Ready entry; false when it went away or does not check out
+bool map_grid(const std::shared_ptr<IndexMapping>& index, Slot* slot, const std::string& prefix,
+              uint64_t key, ESPGrid& grid) {
+    auto mapping = std::make_shared<GridMapping>();
+    mapping->index = index;
+    const int32_t self = getpid();
+    for (auto& holder : slot->holders) {
+        int32_t free = 0;
+        if (holder.compare_exchange_strong(free, self)) {
+            mapping->holder = &holder;  // From here on the destructor drops the reference
+            break;
+        }
+    }
+    if (!mapping->holder || slot->state.load() != Ready || slot->key.load() != key) return false;
+    
+    const int fd = shm_open(segment_name(prefix, key).c_str(), O_RDONLY, 0600);
+    if (fd < 0) return false;
+    struct stat st;
+    if (!private_object(fd) || fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(GridHeader)) {
+        ::close(fd);
+        return false;
+    }
+    void* map = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (map == MAP_FAILED) return false;
+    mapping->map = map;
+    mapping->size = st.st_size;
+    
+    const GridHeader* header = static_cast<const GridHeader*>(map);
+    const size_t node_bytes = header->has_lattice ? header->count * sizeof(uint64_t) : 0;
+    if (header->magic != grid_magic || header->key != key
+        || sizeof(GridHeader) + header->count * sizeof(GridPoint) + node_bytes > mapping->size) {
+        return false;
+    }
+    
+    const char* base = static_cast<const char*>(map) + sizeof(GridHeader);
+    const GridPoint* points = reinterpret_cast<const GridPoint*>(base);
+    grid = ESPGrid::view(points, header->count, mapping);
+    if (header->has_lattice) {
+        GridLattice lattice;
+        lattice.origin = Eigen::Vector3d(header->origin);
+        lattice.axes = Eigen::Map<const Eigen::Matrix<double, 3, 3, Eigen::RowMajor>>(header->axes);
+        std::copy(header->dims, header->dims + 3, lattice.dims);
+        const uint64_t* node = reinterpret_cast<const uint64_t*>(base + header->count * sizeof(GridPoint));
+        lattice.node.assign(node, node + header->count);
+        grid.set_lattice(lattice);
+    }
+    return true;
+}
+
+// Write grid to the entry's segment; false if shared memory ran out
+bool write_segment(const std::string& name, uint64_t key, const ESPGrid& grid, size_t& bytes) {
+    const size_t count = grid.num_points();
+    const bool has_lattice = grid.has_lattice();
+    bytes = sizeof(GridHeader) + count * sizeof(GridPoint) + (has_lattice ? count * sizeof(uint64_t) : 0);
+    
+    // Always a new object: a leftover of a dead publisher is unlinked
+    // first, and one that cannot be unlinked is not ours to fill
+    int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0 && errno == EEXIST && shm_unlink(name.c_str()) == 0) {
+        fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    }
+    if (fd < 0) return false;
+    // tmpfs allocates pages on first touch, where a full /dev/shm would
+    // raise SIGBUS; reserve them up front instead
+    if (posix_fallocate(fd, 0, bytes) != 0) {
+        ::close(fd);
+        return false;
+    }
+    void* map = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (map == MAP_FAILED) return false;
+    
+    GridHeader header = {};
+    header.magic = grid_magic;
+    header.key = key;
+    header.count = count;
+    header.has_lattice = has_lattice;
+    if (has_lattice) {
+        const GridLattice& lattice = grid.lattice();
+        std::copy(lattice.dims, lattice.dims + 3, header.dims);
+        for (int a = 0; a < 3; ++a) {
+            header.origin[a] = lattice.origin(a);
+            for (int b = 0; b < 3; ++b) header.axes[3 * a + b] = lattice.axes(a, b);
+        }
+    }
+    char* out = static_cast<char*>(map);
+    std::memcpy(out, &header, sizeof(header));
+    std::memcpy(out + sizeof(header), grid.data(), count * sizeof(GridPoint));
+    if (has_lattice) {
+        uint64_t* node = reinterpret_cast<uint64_t*>(out + sizeof(header) + count * sizeof(GridPoint));
+        std::copy(grid.lattice().node.begin(), grid.lattice().node.end(), node);
+    }
+    munmap(map, bytes);
+    return true;
+}
+
+} // namespace
+
+std::string SharedGridCache::default_prefix() {
+    return "chargeopt." + std::to_string(getuid());
+}
+
+ESPGrid SharedGridCache::load(const std::string& cube_file, bool filter_extreme,
+                              std::ostream& log, const Config& config, Source* source) {
+    auto parse_locally = [&](const char* reason) {
+        log << "  Shared grid cache: " << reason << "; parsing locally" << std::endl;
+        if (source) *source = Source::Parsed;
+        return CubeParser::parse(cube_file, filter_extreme, log);
+    };
+    
+    uint64_t key;
+    if (!grid_key(cube_file, filter_extreme, key)) {
+        return CubeParser::parse(cube_file, filter_extreme, log);  // Reports the missing file
+    }
+    std::shared_ptr<IndexMapping> index = open_index(config.prefix);
+    if (!index) {
+        return parse_locally("no usable shared-memory index");
+    }
+    const std::string name = segment_name(config.prefix, key);
+    
+    std::mt19937 jitter(getpid());
+    const auto deadline = std::chrono::steady_clock::now()
+        + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+              std::chrono::duration<double>(config.wait_seconds));
+    for (;;) {
+        if (Slot* slot = find(index->index, key)) {
+            const uint32_t state = slot->state.load();
+            if (state == Ready) {
+                ESPGrid grid;
+                if (map_grid(index, slot, config.prefix, key, grid)) {
+                    log << "  Mapped shared grid " << name << " (" << grid.num_points() << " points)" << std::endl;
+                    if (source) *source = Source::Mapped;
+                    return grid;
+                }
+                if (slot->state.load() == Ready && slot->key.load() == key) {
+                    return parse_locally("cannot map the published grid");
+                }
+            } else if ((state == Empty || state == Building)
+                       && take_down_if_abandoned(slot, config.prefix, state)) {
+                // The claimer died before publishing
+                continue;
+            }
+            if (std::chrono::steady_clock::now() > deadline) {
+                return parse_locally("timed out waiting for another process");
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(state == Building ? 10 : 1));
+            continue;
+        }
+        
+        Slot* slot = claim(index->index, config.prefix, key);
+        if (!slot) {
+            return parse_locally("every entry is in use");
+        }
+        // Processes that miss at the same time may claim separate slots;
+        // whoever sees another claim backs off and waits on it instead
+        if (find(index->index, key, slot)) {
+            release(slot);
+            std::this_thread::sleep_for(std::chrono::microseconds(jitter() % 2000));
+            continue;
+        }
+        slot->state.store(Building);
+        
+        ESPGrid grid;
+        size_t bytes = 0;
+        try {
+            grid = CubeParser::parse(cube_file, filter_extreme, log);
+        } catch (...) {
+            release(slot);
+            throw;
+        }
+        if (!write_segment(name, key, grid, bytes)) {
+            shm_unlink(name.c_str());
+            release(slot);
+            log << "  Shared grid cache: cannot allocate " << bytes << " bytes; grid not shared" << std::endl;
+            if (source) *source = Source::Parsed;
+            return grid;
+        }
+        slot->bytes.store(bytes);
+        slot->state.store(Ready);
+        
+        // Continue on the shared copy so this process does not hold two
+        ESPGrid shared;
+        if (map_grid(index, slot, config.prefix, key, shared)) {
+            grid = std::move(shared);
+        }
+        log << "  Published grid to " << name << " (" << bytes / (1024 * 1024.0) << " MiB)" << std::endl;
+        if (source) *source = Source::Published;
+        return grid;
+    }
+}
+
+void SharedGridCache::clear(const std::string& prefix) {
+    std::shared_ptr<IndexMapping> index = open_index(prefix);
+    if (index) {
+        for (Slot& slot : index->index->slots) {
+            const uint64_t key = slot.key.load();
+            if (key != 0) shm_unlink(segment_name(prefix, key).c_str());
+        }
+    }
+    shm_unlink(("/" + prefix + ".index").c_str());
+}
+
+} // namespace chargeopt
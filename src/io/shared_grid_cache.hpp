@@ -0,0 +1,63 @@
+#pragma once
+
+#include "../core/esp_grid.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <string>
+
+namespace chargeopt {
+
+// Node-local cache of parsed cube grids in POSIX shared memory. Concurrent
+// processes fitting against the same cube (lambda or constraint sweeps)
+// parse it once; the others map the published points read-only, so the
+// node holds one copy instead of one per process.
+//
+// Shared objects (under /dev/shm on Linux), created mode 0600 and ignored
+// unless owned by this user with no group or other access:
+//   /<prefix>.index   fixed table of slots, changed only through atomics
+//                     Slot { key; state; owner pid; bytes; holder pids }
+//                     free -> claimed (owner set) -> Building -> Ready
+//                     Ready -> Evicting -> free (no live holders only)
+//   /<prefix>.<key>   Header, GridPoint x count, uint64 node x count
+// The key covers the file's path, inode, size and mtime and the parser
+// options, so an edited cube gets a fresh entry. Mapped grids register
+// their pid as a holder of the slot; unreferenced entries are evicted when
+// the table is full, and holders that died without unmapping do not count.
+// Likewise a claim whose owner died before publishing is freed by the next
+// process that waits on it. Entries outlive the processes, so later runs
+// on the node skip parsing too; clear() removes them. Lattice node indices
+// are copied out of the mapping (8 of the 40 bytes per point).
+class SharedGridCache {
+public:
+    enum class Source {
+        Mapped,     // Published earlier by this or another process
+        Published,  // Parsed here and published for others
+        Parsed      // Parsed here only (cache unavailable or full)
+    };
+    
+    struct Config {
+        std::string prefix = default_prefix();
+        double wait_seconds = 300.0;  // For another process's parse of the same cube
+        
+        Config() {}
+    };
+    
+    // As CubeParser::parse, through the cache. Never fails because of the
+    // cache itself: without usable shared memory the cube is parsed locally.
+    static ESPGrid load(const std::string& cube_file, bool filter_extreme,
+                        std::ostream& log = std::cout,
+                        const Config& config = Config(),
+                        Source* source = nullptr);
+    
+    // Unlink the index and every published grid under prefix. Processes
+    // that still map them keep their mappings.
+    static void clear(const std::string& prefix = default_prefix());
+    
+    // "chargeopt.<uid>": one cache per user
+    static std::string default_prefix();
+    
+    static constexpr size_t num_slots = 64;
+};
+
+} // namespace chargeopt
@@ -1,22 +1,57 @@
 #pragma once
 
 #include "../core/molecule.hpp"
+#include "memory_stream.hpp"
 #include <iostream>
 #include <string>
 #include <fstream>
 #include <sstream>
 #include <stdexcept>
+#include <vector>
 
 namespace chargeopt {
 
 class XYZParser {
 public:
-    static Molecule parse(const std::string& filename) {
+    static Molecule parse(const std::string& filename, std::ostream& log = std::cout) {
+        std::ifstream file(filename);
+        if (!file.is_open()) {
+            throw std::runtime_error("Cannot open file: " + filename);
+        }
+        return parse_stream(file, log);
+    }
+    
+    // File contents already in memory (e.g. from FilePrefetcher)
+    static Molecule parse_buffer(const std::string& data, std::ostream& log = std::cout) {
+        MemoryStreamBuf buffer(data);
+        std::istream in(&buffer);
+        return parse_stream(in, log);
+    }
+    
+    // Every frame of a multi-frame (trajectory / conformer ensemble) file;
+    // frames must follow each other directly, blank lines between them aside
+    static std::vector<Molecule> parse_frames(const std::string& filename, std::ostream& log = std::cout) {
         std::ifstream file(filename);
         if (!file.is_open()) {
             throw std::runtime_error("Cannot open file: " + filename);
         }
         
+        std::vector<Molecule> frames;
+        std::ostream quiet(nullptr);
+        while (file >> std::ws && file.peek() != EOF) {
+            try {
+                frames.push_back(parse_stream(file, frames.empty() ? log : quiet));
+            } catch (const std::runtime_error& e) {
+                throw std::runtime_error("Frame " + std::to_string(frames.size() + 1) + ": " + e.what());
+            }
+        }
+        if (frames.empty()) {
+            throw std::runtime_error("Empty XYZ file");
+        }
+        return frames;
+    }
+    
+    static Molecule parse_stream(std::istream& file, std::ostream& log = std::cout) {
         Molecule mol;
         std::string line;
         int num_atoms = 0;
@@ -43,7 +78,7 @@ public:
         
         // Read atoms
         int atoms_read = 0;
-        while (std::getline(file, line) && atoms_read < num_atoms) {
+        while (atoms_read < num_atoms && std::getline(file, line)) {
             line_num++;
             std::istringstream iss(line);
             
@@ -69,7 +104,7 @@ public:
         
         mol.set_total_charge(0.0);
         
-        std::cout << "  ✓ Coordinates converted: Angstrom → Bohr" << std::endl;
+        log << "  ✓ Coordinates converted: Angstrom → Bohr" << std::endl;
         
         return mol;
     }
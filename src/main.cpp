@@ -1,54 +1,169 @@
 #include "core/molecule.hpp"
 #include "core/esp_grid.hpp"
+#include "core/resource_limits.hpp"
 #include "io/xyz_parser.hpp"
-#include "io/cube_parser.hpp"
+#include "io/charges_writer.hpp"
+#include "io/charge_database.hpp"
 #include "solver/qp_solver.hpp"
 #include "solver/constraints.hpp"
+#include "solver/charge_derivatives.hpp"
+#include "solver/robust_fit.hpp"
+#include "solver/eem_solver.hpp"
 #include "analysis/validator.hpp"
-#include "analysis/symmetry.hpp"
+#include "analysis/topology.hpp"
+#include "analysis/conformer_clustering.hpp"
+#include "pipeline/fit_pipeline.hpp"
+#include "pipeline/batch_runner.hpp"
+#ifdef CHARGEOPT_USE_MPI
+#include "pipeline/mpi_batch.hpp"
+#endif
+#include "pipeline/manifest.hpp"
 
+#include <algorithm>
 #include <iostream>
 #include <fstream>
 #include <string>
 #include <iomanip>
+#include <vector>
 
 using namespace chargeopt;
 
 void print_usage(const char* prog_name) {
     std::cout << "\nCharge Optimizer - Atomic Partial Charge Fitting via QP\n" << std::endl;
-    std::cout << "Usage: " << prog_name << " <geometry.xyz> <esp.cube> [options]\n" << std::endl;
+    std::cout << "Usage: " << prog_name << " <geometry.xyz> <esp.cube> [options]" << std::endl;
+    std::cout << "       " << prog_name << " <geometry.xyz> <multipoles.punch> [options]" << std::endl;
+    std::cout << "       " << prog_name << " <geometry.xyz> --eem [options]" << std::endl;
+    std::cout << "       " << prog_name << " <ensemble.xyz> --cluster <rmsd> [-o representatives.xyz]" << std::endl;
+    std::cout << "       " << prog_name << " --batch <manifest> [options]\n" << std::endl;
     std::cout << "Options:" << std::endl;
     std::cout << "  -o, --output <file>    Output file for charges (default: charges.txt)" << std::endl;
     std::cout << "  -q, --total-charge <n> Total molecular charge (default: 0)" << std::endl;
     std::cout << "  -t, --tolerance <val>  Convergence tolerance (default: 1e-6)" << std::endl;
     std::cout << "  -l, --lambda <val>     Regularization parameter (default: 0.0005)" << std::endl;
     std::cout << "  -s, --symmetry <on|off> Auto-detect symmetry (default: on)" << std::endl;
+    std::cout << "  -r, --robust <loss>    Robust IRLS fit: none, huber, tukey (default: none)" << std::endl;
+    std::cout << "      --robust-k <val>   Robust threshold in units of sigma (default: 1.345 huber, 4.685 tukey)" << std::endl;
+    std::cout << "      --rhs <method>     Right-hand side A^T V: direct, fft (lattice convolution) (default: direct)" << std::endl;
+    std::cout << "      --hessian <method> Hessian A^T A: exact, quadrature (volume integral) (default: exact)" << std::endl;
+    std::cout << "      --grid-cache       Share parsed cubes between processes via shared memory" << std::endl;
+    std::cout << "      --eem              EEM/QEq charges only (no cube needed)" << std::endl;
+    std::cout << "      --eem-prior        Restrain the ESP fit toward EEM charges (strength: -l)" << std::endl;
+    std::cout << "      --eem-kernel <k>   EEM Coulomb kernel: screened, coulomb (default: screened)" << std::endl;
+    std::cout << "      --from-db <file>   Assign charges of known fragments from a charge database;" << std::endl;
+    std::cout << "                         fit only unmatched atoms (no cube needed if all match)" << std::endl;
+    std::cout << "      --db-update <file> Merge fitted charges into a charge database" << std::endl;
+    std::cout << "  -d, --derivatives <file> Write analytic dq/dR Jacobian (3N x N) to file (plain fits only)" << std::endl;
+    std::cout << "      --cluster <rmsd>   Pick representative conformers of a multi-frame XYZ (cutoff in Angstrom)" << std::endl;
+    std::cout << "  -b, --batch <manifest> Fit every job in a manifest (lines: xyz cube [charge] [output])" << std::endl;
+    std::cout << "      --result-store <file> Reuse/record batch results across runs" << std::endl;
+    std::cout << "      --journal <file>   Checkpoint batch progress; rerun to resume after a crash" << std::endl;
+    std::cout << "      --prefetch <n>     Read batch inputs n jobs ahead (default: 8, 0 = off)" << std::endl;
+    std::cout << "      --ndjson <file|->  Stream batch results as NDJSON (- = stdout, progress goes to stderr)" << std::endl;
+    std::cout << "      --binary <file>    Stream batch results in binary columnar format" << std::endl;
+    std::cout << "      --threads <n>      Worker threads (default: CPUs allowed by affinity and cgroup quota)" << std::endl;
     std::cout << "  -v, --verbose          Verbose output" << std::endl;
     std::cout << "  -h, --help             Show this help message" << std::endl;
     std::cout << "\nExamples:" << std::endl;
     std::cout << "  " << prog_name << " water.xyz water_esp.cube" << std::endl;
     std::cout << "  " << prog_name << " molecule.xyz molecule.cube -q -1 -o my_charges.txt" << std::endl;
-    std::cout << "  " << prog_name << " complex.xyz complex.cube -l 0.001 -v\n" << std::endl;
+    std::cout << "  " << prog_name << " complex.xyz complex.cube -l 0.001 -v" << std::endl;
+    std::cout << "  " << prog_name << " ligand.xyz --eem -o eem_charges.txt" << std::endl;
+    std::cout << "  " << prog_name << " ligand.xyz ligand_gdma.punch -o mk_charges.txt" << std::endl;
+    std::cout << "  " << prog_name << " md_frames.xyz --cluster 0.5 -o conformers.xyz" << std::endl;
+    std::cout << "  " << prog_name << " --batch library.txt --result-store results.db\n" << std::endl;
+}
+
+void print_charges(const Molecule& mol, const std::string& title) {
+    std::cout << "=== " << title << " ===" << std::endl;
+    std::cout << std::fixed << std::setprecision(4);
+    double charge_sum = 0.0;
+    for (size_t i = 0; i < mol.num_atoms(); ++i) {
+        const auto& atom = mol.atom(i);
+        std::cout << "  " << std::setw(3) << atom.element << std::setw(2) << (i + 1) 
+                  << ":  " << std::setw(8) << std::showpos << atom.charge << std::noshowpos << " e" << std::endl;
+        charge_sum += atom.charge;
+    }
+    std::cout << "  Sum:  " << std::showpos << charge_sum << std::noshowpos << " e\n" << std::endl;
+}
+
+void write_derivatives(const std::string& path, const std::string& xyz_file,
+                       const Molecule& mol, const Eigen::MatrixXd& J) {
+    std::ofstream dout(path);
+    if (!dout.is_open()) {
+        throw std::runtime_error("Cannot open output file: " + path);
+    }
+    
+    const char axes[3] = {'x', 'y', 'z'};
+    dout << "# Analytic charge derivatives dq_j/dR_a (e/Bohr)" << std::endl;
+    dout << "# Molecule: " << xyz_file << std::endl;
+    dout << "# Rows: atom, coordinate; columns: q_1 .. q_" << mol.num_atoms() << std::endl;
+    dout << std::scientific << std::setprecision(8);
+    for (size_t a = 0; a < mol.num_atoms(); ++a) {
+        for (int c = 0; c < 3; ++c) {
+            dout << std::setw(5) << (a + 1) << "  "
+                 << std::setw(3) << mol.atom(a).element << "  " << axes[c];
+            for (Eigen::Index j = 0; j < J.cols(); ++j) {
+                dout << "  " << std::setw(16) << J(3 * a + c, j);
+            }
+            dout << std::endl;
+        }
+    }
+}
+
+void write_representatives(const std::string& path, const std::string& xyz_file,
+                           const std::vector<Molecule>& frames,
+                           const ConformerClustering::Result& clusters) {
+    std::ofstream out(path);
+    if (!out.is_open()) {
+        throw std::runtime_error("Cannot open output file: " + path);
+    }
+    
+    // Back to Angstrom, as read
+    constexpr double bohr_to_angstrom = 1.0 / 1.889726125;
+    out << std::fixed;
+    for (const auto& rep : clusters.representatives) {
+        const Molecule& mol = frames[rep.frame];
+        out << mol.num_atoms() << std::endl;
+        out << std::setprecision(6) << xyz_file << " frame " << (rep.frame + 1)
+            << " population " << rep.population << " weight " << rep.weight << std::endl;
+        out << std::setprecision(8);
+        for (size_t i = 0; i < mol.num_atoms(); ++i) {
+            const Eigen::Vector3d p = mol.atom(i).position * bohr_to_angstrom;
+            out << std::setw(3) << mol.atom(i).element
+                << std::setw(16) << p.x() << std::setw(16) << p.y() << std::setw(16) << p.z() << std::endl;
+        }
+    }
 }
 
 int main(int argc, char** argv) {
+#ifdef CHARGEOPT_USE_MPI
+    // Only rank 0 talks to the user
+    MpiSession mpi(argc, argv);
+    if (!mpi.is_root()) {
+        std::cout.rdbuf(nullptr);
+    }
+#endif
+    
     // Parse command-line arguments
-    if (argc < 3) {
+    if (argc < 2) {
         print_usage(argv[0]);
         return 1;
     }
     
-    std::string xyz_file = argv[1];
-    std::string cube_file = argv[2];
-    std::string output_file = "charges.txt";
-    double total_charge = 0.0;
-    double tolerance = 1e-6;
-    double lambda = 0.0005;
-    bool use_symmetry = true;
-    bool verbose = false;
+    FitJob job;
+    FitOptions options;
+    std::vector<std::string> positional;
+    std::string derivatives_file;
+    double cluster_rmsd = 0.0;
+    bool output_given = false;
+    bool eem_only = false;
+    std::string db_file;
+    std::string db_update_file;
+    std::string batch_file;
+    BatchRunner::Config batch_config;
     
     // Parse options
-    for (int i = 3; i < argc; ++i) {
+    for (int i = 1; i < argc; ++i) {
         std::string arg = argv[i];
         
         if (arg == "-h" || arg == "--help") {
@@ -56,23 +171,88 @@ int main(int argc, char** argv) {
             return 0;
         }
         else if ((arg == "-o" || arg == "--output") && i + 1 < argc) {
-            output_file = argv[++i];
+            job.output_file = argv[++i];
+            output_given = true;
         }
         else if ((arg == "-q" || arg == "--total-charge") && i + 1 < argc) {
-            total_charge = std::stod(argv[++i]);
+            job.total_charge = std::stod(argv[++i]);
         }
         else if ((arg == "-t" || arg == "--tolerance") && i + 1 < argc) {
-            tolerance = std::stod(argv[++i]);
+            options.tolerance = std::stod(argv[++i]);
         }
         else if ((arg == "-l" || arg == "--lambda") && i + 1 < argc) {
-            lambda = std::stod(argv[++i]);
+            options.lambda = std::stod(argv[++i]);
         }
         else if ((arg == "-s" || arg == "--symmetry") && i + 1 < argc) {
             std::string val = argv[++i];
-            use_symmetry = (val == "on" || val == "true" || val == "1");
+            options.use_symmetry = (val == "on" || val == "true" || val == "1");
+        }
+        else if ((arg == "-r" || arg == "--robust") && i + 1 < argc) {
+            options.robust.loss = RobustFitter::parse_loss(argv[++i]);
+        }
+        else if (arg == "--robust-k" && i + 1 < argc) {
+            options.robust.tuning = std::stod(argv[++i]);
+        }
+        else if (arg == "--rhs" && i + 1 < argc) {
+            options.rhs = QPSolver::parse_rhs_method(argv[++i]);
+        }
+        else if (arg == "--hessian" && i + 1 < argc) {
+            options.hessian = QPSolver::parse_hessian_method(argv[++i]);
+        }
+        else if (arg == "--grid-cache") {
+            options.shared_grid_cache = true;
+        }
+        else if (arg == "--eem") {
+            eem_only = true;
+        }
+        else if (arg == "--eem-prior") {
+            options.eem_prior = true;
+        }
+        else if (arg == "--eem-kernel" && i + 1 < argc) {
+            options.eem.kernel = EEMSolver::parse_kernel(argv[++i]);
+        }
+        else if (arg == "--from-db" && i + 1 < argc) {
+            db_file = argv[++i];
+        }
+        else if (arg == "--db-update" && i + 1 < argc) {
+            db_update_file = argv[++i];
+        }
+        else if ((arg == "-d" || arg == "--derivatives") && i + 1 < argc) {
+            derivatives_file = argv[++i];
+        }
+        else if (arg == "--cluster" && i + 1 < argc) {
+            cluster_rmsd = std::stod(argv[++i]);
+            if (cluster_rmsd <= 0.0) {
+                std::cerr << "--cluster needs a positive RMSD cutoff" << std::endl;
+                return 1;
+            }
+        }
+        else if ((arg == "-b" || arg == "--batch") && i + 1 < argc) {
+            batch_file = argv[++i];
+        }
+        else if (arg == "--result-store" && i + 1 < argc) {
+            batch_config.result_store = argv[++i];
+        }
+        else if (arg == "--journal" && i + 1 < argc) {
+            batch_config.journal = argv[++i];
+        }
+        else if (arg == "--prefetch" && i + 1 < argc) {
+            batch_config.prefetch = std::stoul(argv[++i]);
+        }
+        else if (arg == "--ndjson" && i + 1 < argc) {
+            batch_config.ndjson = argv[++i];
+        }
+        else if (arg == "--binary" && i + 1 < argc) {
+            batch_config.binary = argv[++i];
+        }
+        else if (arg == "--threads" && i + 1 < argc) {
+            ResourceLimits::set_threads(std::stoul(argv[++i]));
         }
         else if (arg == "-v" || arg == "--verbose") {
-            verbose = true;
+            options.verbose = true;
+        }
+        else if (!arg.empty() && arg[0] != '-' && positional.size() < 2) {
+            positional.push_back(arg);
         }
         else {
             std::cerr << "Unknown option: " << arg << std::endl;
@@ -81,170 +261,220 @@ int main(int argc, char** argv) {
         }
     }
     
+    if (positional.size() > 0) job.xyz_file = positional[0];
+    if (positional.size() > 1) job.cube_file = positional[1];
+    options.eem.verbose = options.verbose;
+    batch_config.verbose = options.verbose;
+    
+    if (batch_file.empty() && job.xyz_file.empty()) {
+        std::cerr << "Missing geometry file" << std::endl;
+        print_usage(argv[0]);
+        return 1;
+    }
+    
+    if (batch_file.empty() && !(batch_config.ndjson.empty() && batch_config.binary.empty())) {
+        std::cerr << "--ndjson and --binary require --batch" << std::endl;
+        return 1;
+    }
+    
+    // NDJSON on stdout keeps stdout machine-readable
+    if (batch_config.ndjson == "-") {
+        batch_config.out = &std::cerr;
+    }
+    std::ostream& ui = *batch_config.out;
+    
+    if (batch_file.empty() && job.cube_file.empty() && !eem_only && db_file.empty() && cluster_rmsd == 0.0) {
+        std::cerr << "Missing ESP cube file (or use --eem / --from-db / --cluster)" << std::endl;
+        print_usage(argv[0]);
+        return 1;
+    }
+    
+    // dq/dR differentiates the plain least-squares fit; IRLS weights and the
+    // approximate A^T V and A^T A are not part of it
+    if (!derivatives_file.empty() && (options.robust_enabled()
+                                      || options.rhs != QPSolver::RhsMethod::Direct
+                                      || options.hessian != QPSolver::HessianMethod::Exact)) {
+        std::cerr << "--derivatives requires a plain least-squares fit "
+                  << "(not --robust, --rhs fft or --hessian quadrature)" << std::endl;
+        return 1;
+    }
+    
     try {
         // Banner
-        std::cout << "\n╔════════════════════════════════════════════╗" << std::endl;
-        std::cout << "║  Charge Optimizer v1.0                     ║" << std::endl;
-        std::cout << "║  QP-based Atomic Charge Fitting            ║" << std::endl;
-        std::cout << "╚════════════════════════════════════════════╝\n" << std::endl;
-        
-        // Load molecule
-        std::cout << "Loading molecule from: " << xyz_file << std::endl;
-        Molecule mol = XYZParser::parse(xyz_file);
-        mol.set_total_charge(total_charge);
-	for (size_t i = 0; i < mol.num_atoms(); ++i) {
-		    mol.atom(i).charge *= -1.0;
-	}
-        std::cout << "  Atoms: " << mol.num_atoms() << std::endl;
-        std::cout << "  Total charge: " << total_charge << " e\n" << std::endl;
-        
-        // Load ESP grid
-        std::cout << "Loading ESP grid from: " << cube_file << std::endl;
-        ESPGrid grid = CubeParser::parse(cube_file);
-        std::cout << "  Grid points: " << grid.num_points() << std::endl;
-        
-        // DEBUG: Check ESP range immediately after loading
-        std::cout << "\n  DEBUG MAIN: Verifying ESP range after loading..." << std::endl;
-        double debug_min = grid.min_potential();
-        double debug_max = grid.max_potential();
-        std::cout << "  DEBUG MAIN: min_potential() = " << std::scientific << debug_min << std::endl;
-        std::cout << "  DEBUG MAIN: max_potential() = " << std::scientific << debug_max << std::endl;
-        
-        // DEBUG: Manually check first/last points
-        if (grid.num_points() > 0) {
-            std::cout << "  DEBUG MAIN: First point ESP = " << grid.point(0).potential << std::endl;
-            std::cout << "  DEBUG MAIN: Last point ESP = " << grid.point(grid.num_points()-1).potential << std::endl;
-            
-            // Manually scan for actual min/max
-            double manual_min = grid.point(0).potential;
-            double manual_max = grid.point(0).potential;
-            size_t max_idx = 0;
-            
-            for (size_t i = 0; i < grid.num_points(); i++) {
-                double val = grid.point(i).potential;
-                if (val < manual_min) manual_min = val;
-                if (val > manual_max) {
-                    manual_max = val;
-                    max_idx = i;
-                }
+        ui << "\n╔════════════════════════════════════════════╗" << std::endl;
+        ui << "║  Charge Optimizer v1.0                     ║" << std::endl;
+        ui << "║  QP-based Atomic Charge Fitting            ║" << std::endl;
+        ui << "╚════════════════════════════════════════════╝\n" << std::endl;
+        
+        if (options.verbose) {
+            ui << "Resources: " << ResourceLimits::detect().describe()
+               << ", " << ResourceLimits::threads() << " worker threads\n" << std::endl;
+        }
+        
+        ChargeDatabase database;
+        if (!db_file.empty()) {
+            database = ChargeDatabase::open(db_file);
+            options.database = &database;
+            ui << "Charge database: " << db_file << " (" << database.size() << " environments)\n" << std::endl;
+        }
+        
+        // Batch mode: many jobs, deduplicated, one summary line each
+        if (!batch_file.empty()) {
+            std::vector<FitJob> jobs = Manifest::parse(batch_file);
+            ui << "Batch manifest: " << batch_file << " (" << jobs.size() << " jobs)\n" << std::endl;
+#ifdef CHARGEOPT_USE_MPI
+            return MpiBatchRunner::run(jobs, options, batch_config) == 0 ? 0 : 1;
+#else
+            BatchRunner runner(options, batch_config);
+            return runner.run(jobs) == 0 ? 0 : 1;
+#endif
+        }
+        
+#ifdef CHARGEOPT_USE_MPI
+        // One fit on several ranks: split the H, f assembly; rank 0 reports
+        options.distributed = mpi.size() > 1;
+        if (!mpi.is_root()) {
+            if (!eem_only && cluster_rmsd == 0.0) {
+                std::ostream quiet(nullptr);
+                FitPipeline::run(job, options, quiet);
             }
+            return 0;
+        }
+#endif
+        
+        // Pre-stage for ensemble fits: cubes are only needed for the
+        // representatives, weighted by the share of frames each stands for
+        if (cluster_rmsd > 0.0) {
+            std::cout << "Reading ensemble: " << job.xyz_file << std::endl;
+            std::vector<Molecule> frames = XYZParser::parse_frames(job.xyz_file, std::cout);
+            std::cout << "  Frames: " << frames.size() << ", atoms: " << frames[0].num_atoms() << std::endl;
             
-            std::cout << "  DEBUG MAIN: Manual scan - min = " << manual_min << ", max = " << manual_max << std::endl;
-            std::cout << "  DEBUG MAIN: Max value found at grid point index " << max_idx << std::endl;
-            std::cout << "  DEBUG MAIN: That point's position = (" 
-                      << grid.point(max_idx).position(0) << ", "
-                      << grid.point(max_idx).position(1) << ", "
-                      << grid.point(max_idx).position(2) << ")" << std::endl;
-        }
-        std::cout << std::defaultfloat << std::endl;
-        
-        std::cout << "  ESP range: [" << grid.min_potential() << ", " 
-                  << grid.max_potential() << "] V\n" << std::endl;
-        
-        // Build QP matrices
-        std::cout << "Building QP problem..." << std::endl;
-        Eigen::MatrixXd H;
-        Eigen::VectorXd f;
-        QPSolver::build_esp_matrices(mol, grid, H, f);
-        
-        // Setup constraints
-        Constraints constraints;
-        
-        // Total charge constraint
-        constraints.add_charge_constraint(mol.num_atoms(), total_charge);
-        std::cout << "  Added total charge constraint\n" << std::endl;
-        
-        // Symmetry constraints
-        if (use_symmetry) {
-            auto equiv_groups = SymmetryDetector::detect_equivalent_atoms(mol);
+            ConformerClustering::Config cluster_config;
+            cluster_config.rmsd_cutoff = cluster_rmsd * 1.889726125;
+            ThreadPool pool;
+            ConformerClustering::Result clusters = ConformerClustering::cluster(frames, cluster_config, &pool);
             
-            if (!equiv_groups.empty()) {
-                std::cout << "Detected symmetry:" << std::endl;
-                for (const auto& group : equiv_groups) {
-                    std::cout << "  Equivalent atoms: ";
-                    for (int idx : group) {
-                        std::cout << mol.atom(idx).element << (idx + 1) << " ";
-                    }
-                    std::cout << std::endl;
-                    
-                    // Add constraints: all atoms in group have same charge
-                    auto it = group.begin();
-                    int first = *it;
-                    ++it;
-                    for (; it != group.end(); ++it) {
-                        constraints.add_symmetry_constraint(first, *it, mol.num_atoms());
-                    }
-                }
-                std::cout << std::endl;
+            std::cout << "\n=== Representative Conformers (RMSD cutoff " << cluster_rmsd << " A) ===" << std::endl;
+            for (const auto& rep : clusters.representatives) {
+                std::cout << "  Frame " << std::setw(6) << (rep.frame + 1)
+                          << "  population " << std::setw(6) << rep.population
+                          << "  weight " << std::fixed << std::setprecision(4) << rep.weight << std::endl;
+            }
+            if (options.verbose) {
+                std::cout << "  Pairs aligned: " << clusters.pairs_aligned << " of "
+                          << frames.size() * (frames.size() - 1) / 2 << std::endl;
             }
+            
+            const std::string path = output_given ? job.output_file : "representatives.xyz";
+            std::cout << "\nWriting " << clusters.representatives.size() << " representatives to: " << path << std::endl;
+            write_representatives(path, job.xyz_file, frames, clusters);
+            return 0;
         }
         
-        // Solve QP
-        std::cout << "Solving QP..." << std::endl;
-        QPSolver::Config config;
-        config.tolerance = tolerance;
-        config.regularization = lambda;
-        config.verbose = verbose;
-        
-        QPSolver solver(config);
-        QPSolution solution = solver.solve(H, f, constraints);
-        
-        if (!solution.converged) {
-            std::cerr << "\nWarning: Optimization did not fully converge!" << std::endl;
+        // Fast path: electronegativity equalization, no ESP grid
+        if (eem_only) {
+            Molecule mol = FitPipeline::load_molecule(job, std::cout);
+            Constraints eem_constraints;
+            eem_constraints.add_charge_constraint(mol.num_atoms(), job.total_charge);
+            
+            std::cout << "Solving EEM/QEq charges..." << std::endl;
+            QPSolution eem = EEMSolver(options.eem).solve(mol, eem_constraints);
+            mol.set_charges(eem.charges);
+            
+            std::cout << std::endl;
+            print_charges(mol, "EEM Atomic Charges");
+            
+            // Dipole in atomic units (charges x Bohr) converted to Debye
+            double dipole = (mol.positions().transpose() * mol.charges()).norm() * 2.5417464;
+            std::cout << "  Dipole moment:  " << dipole << " D\n" << std::endl;
+            
+            std::cout << "Writing charges to: " << job.output_file << std::endl;
+            ChargesWriter::write(job.output_file, {
+                "Atomic partial charges from EEM/QEq (no ESP fit)",
+                "Molecule: " + job.xyz_file,
+                "Total charge: " + ChargesWriter::to_text(job.total_charge)
+            }, mol);
+            
+            std::cout << "\n✓ EEM charges complete!\n" << std::endl;
+            return 0;
         }
         
-        std::cout << "  Converged: " << (solution.converged ? "Yes" : "No") << std::endl;
-        std::cout << "  Iterations: " << solution.iterations << std::endl;
-        std::cout << "  Objective value: " << std::scientific << solution.objective_value << std::defaultfloat << "\n" << std::endl;
+        // Independent stages of the fit overlap; the charge derivatives
+        // need only the charges, so they run alongside validation
+        ThreadPool pool(std::min(FitPipeline::max_parallel_stages, ResourceLimits::threads()));
+        Eigen::MatrixXd J;
+        std::function<void(const FitResult&)> after_solve;
+        if (!derivatives_file.empty()) {
+            after_solve = [&J](const FitResult& fit) {
+                J = ChargeDerivatives(fit.solver_config).compute(fit.mol, fit.grid, fit.constraints);
+            };
+        }
+        FitResult result = FitPipeline::run(job, options, std::cout, &pool, after_solve);
+        Molecule& mol = result.mol;
         
-        // Update molecule with fitted charges
-        mol.set_charges(solution.charges);
+        if (!result.fitted) {
+            // Every environment was in the database
+            print_charges(mol, "Database Atomic Charges");
+            
+            std::cout << "Writing charges to: " << job.output_file << std::endl;
+            ChargesWriter::write(job.output_file, {
+                "Atomic partial charges from charge database (no ESP fit)",
+                "Molecule: " + job.xyz_file,
+                "Database: " + db_file,
+                "Total charge: " + ChargesWriter::to_text(job.total_charge)
+            }, mol);
+            
+            std::cout << "\n✓ Database charges complete!\n" << std::endl;
+            return 0;
+        }
         
         // Print charges
-        std::cout << "=== Fitted Atomic Charges ===" << std::endl;
-        std::cout << std::fixed << std::setprecision(4);
-        double charge_sum = 0.0;
-        for (size_t i = 0; i < mol.num_atoms(); ++i) {
-            const auto& atom = mol.atom(i);
-            std::cout << "  " << std::setw(3) << atom.element << std::setw(2) << (i + 1) 
-                      << ":  " << std::setw(8) << std::showpos << atom.charge << std::noshowpos << " e" << std::endl;
-            charge_sum += atom.charge;
-        }
-        std::cout << "  Sum:  " << std::showpos << charge_sum << std::noshowpos << " e\n" << std::endl;
+        print_charges(mol, "Fitted Atomic Charges");
         
         // Validate
-        auto validation = Validator::validate(mol, grid);
-        Validator::print_results(validation, verbose);
+        Validator::print_results(result.validation, options.verbose);
         
         // Write output
-        std::cout << "\nWriting charges to: " << output_file << std::endl;
-        std::ofstream out(output_file);
-        if (!out.is_open()) {
-            throw std::runtime_error("Cannot open output file: " + output_file);
-        }
-        
-        out << "# Atomic partial charges fitted using QP optimization" << std::endl;
-        out << "# Molecule: " << xyz_file << std::endl;
-        out << "# Total charge: " << total_charge << std::endl;
-        out << "# ESP RMSE: " << validation.esp_rmse << " V" << std::endl;
-        out << "# Dipole moment: " << validation.dipole_moment << " D" << std::endl;
-        out << "#" << std::endl;
-        out << "# Atom  Element  Charge(e)" << std::endl;
+        std::cout << "\nWriting charges to: " << job.output_file << std::endl;
+        ChargesWriter::write(job.output_file, {
+            "Atomic partial charges fitted using QP optimization",
+            "Molecule: " + job.xyz_file,
+            "Total charge: " + ChargesWriter::to_text(job.total_charge),
+            "ESP RMSE: " + ChargesWriter::to_text(result.validation.esp_rmse) + " V",
+            "Dipole moment: " + ChargesWriter::to_text(result.validation.dipole_moment) + " D"
+        }, mol);
         
-        out << std::fixed << std::setprecision(6);
-        for (size_t i = 0; i < mol.num_atoms(); ++i) {
-            const auto& atom = mol.atom(i);
-            out << std::setw(5) << (i + 1) << "  "
-                << std::setw(7) << std::left << atom.element << std::right << "  "
-                << std::setw(12) << atom.charge << std::endl;
+        if (!db_update_file.empty()) {
+            // Only atoms fitted here: charges taken from the database
+            // would otherwise be averaged in again
+            int depth = ChargeDatabase::open(db_update_file).depth();
+            const std::vector<uint64_t> hashes = Topology::environment_hashes(mol, depth);
+            std::vector<bool> from_db(mol.num_atoms(), false);
+            for (int i : result.db_matched) from_db[i] = true;
+            std::vector<uint64_t> keys;
+            std::vector<double> fitted;
+            for (size_t i = 0; i < mol.num_atoms(); ++i) {
+                if (from_db[i]) continue;
+                keys.push_back(hashes[i]);
+                fitted.push_back(mol.charges()(i));
+            }
+            ChargeDatabase::update(db_update_file, keys,
+                                   Eigen::Map<const Eigen::VectorXd>(fitted.data(), fitted.size()), depth);
+            std::cout << "Updated charge database: " << db_update_file
+                      << " (" << keys.size() << " fitted atoms)" << std::endl;
         }
         
-        out.close();
+        // Charge derivatives with respect to nuclear coordinates
+        if (!derivatives_file.empty()) {
+            std::cout << "\nAnalytic charge derivatives: " << J.rows() << " x " << J.cols() << std::endl;
+            std::cout << "Writing dq/dR to: " << derivatives_file << std::endl;
+            write_derivatives(derivatives_file, job.xyz_file, mol, J);
+        }
         
         std::cout << "\n✓ Optimization complete!\n" << std::endl;
         
         return 0;
-        
+    
     } catch (const std::exception& e) {
         std::cerr << "\nError: " << e.what() << std::endl;
         return 1;
@@ -0,0 +1,132 @@
+#include "batch_journal.hpp"
+#include "../core/hash.hpp"
+#include <cctype>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <cstdio>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace chargeopt {
+
+uint64_t BatchJournal::job_id(const FitJob& job) {
+    uint64_t h = hash::fnv1a(job.xyz_file);
+    h = hash::combine(h, hash::fnv1a(job.cube_file));
+    h = hash::combine(h, hash::fnv1a(job.output_file));
+    h = hash::combine(h, hash::fnv1a(&job.total_charge, sizeof(job.total_charge)));
+    return h;
+}
+
+BatchJournal::BatchJournal(const std::string& path, const Config& config)
+    : path_(path), config_(config), last_sync_(std::chrono::steady_clock::now()) {
+    
+    // Replay: the last word on each job index wins
+    std::unordered_map<size_t, uint64_t> started;
+    {
+        std::ifstream in(path);
+        std::string line;
+        while (std::getline(in, line)) {
+            std::istringstream iss(line);
+            std::string kind, id_hex;
+            size_t index;
+            if (!(iss >> kind >> index >> id_hex) || id_hex.size() != 16) {
+                continue;  // Torn or foreign line
+            }
+            uint64_t id;
+            try {
+                size_t used = 0;
+                id = std::stoull(id_hex, &used, 16);
+                if (used != id_hex.size() || !std::isxdigit(static_cast<unsigned char>(id_hex[0]))) {
+                    continue;
+                }
+            } catch (const std::exception&) {
+                continue;  // Not hex: malformed
+            }
+            if (kind == "start") {
+                started[index] = id;
+            } else if (kind == "done") {
+                done_[index] = id;
+            }
+        }
+    }
+    for (const auto& kv : started) {
+        auto it = done_.find(kv.first);
+        if (it == done_.end() || it->second != kv.second) {
+            in_flight_++;
+        }
+    }
+    
+    // A crash mid-append can leave the last line unterminated; end it so
+    // the next record starts on a line of its own
+    bool torn = false;
+    {
+        std::ifstream tail(path, std::ios::binary);
+        char last;
+        torn = tail.seekg(-1, std::ios::end) && tail.get(last) && last != '\n';
+    }
+    
+    fd_ = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd_ < 0) {
+        throw std::runtime_error("Cannot open batch journal: " + path);
+    }
+    if (torn && ::write(fd_, "\n", 1) != 1) {
+        ::close(fd_);
+        throw std::runtime_error("Cannot write batch journal: " + path);
+    }
+}
+
+BatchJournal::~BatchJournal() {
+    if (fd_ >= 0) {
+        sync();
+        ::close(fd_);
+    }
+}
+
+bool BatchJournal::is_done(size_t index, const FitJob& job) const {
+    auto it = done_.find(index);
+    return it != done_.end() && it->second == job_id(job);
+}
+
+void BatchJournal::mark_started(size_t index, const FitJob& job) {
+    // Start records are advisory (in-flight jobs are re-run either way),
+    // so they never force a sync
+    append("start", index, job, false);
+}
+
+void BatchJournal::mark_done(size_t index, const FitJob& job) {
+    done_[index] = job_id(job);
+    append("done", index, job, true);
+}
+
+void BatchJournal::append(const char* kind, size_t index, const FitJob& job, bool durable) {
+    char line[96];
+    int len = std::snprintf(line, sizeof(line), "%s %zu %016llx\n", kind, index,
+                            static_cast<unsigned long long>(job_id(job)));
+    
+    // O_APPEND + one write() per record: records never interleave
+    if (::write(fd_, line, len) != len) {
+        throw std::runtime_error("Cannot write batch journal: " + path_);
+    }
+    
+    if (!durable) {
+        return;
+    }
+    
+    unsynced_++;
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - last_sync_).count();
+    if (unsynced_ >= config_.sync_every || elapsed >= config_.sync_interval) {
+        sync();
+    }
+}
+
+void BatchJournal::sync() {
+    if (fd_ >= 0 && unsynced_ > 0) {
+        ::fsync(fd_);
+    }
+    unsynced_ = 0;
+    last_sync_ = std::chrono::steady_clock::now();
+}
+
+} // namespace chargeopt
@@ -0,0 +1,66 @@
+#pragma once
+
+#include "fit_pipeline.hpp"
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+
+namespace chargeopt {
+
+// Append-only checkpoint log for batch runs.
+//
+// One record per line:
+//   start <job index> <job id hex>
+//   done <job index> <job id hex>
+// The job id hashes the manifest entry (files, charge, output), so an edited
+// manifest does not resume into the wrong job. Records are appended with a
+// single write() each; fsync is batched every sync_every records or
+// sync_interval seconds, whichever comes first, and on close. After a crash
+// a job is skipped only if its "done" record reached the disk: jobs that
+// were started but not finished are re-queued, and a torn final line is
+// ignored.
+class BatchJournal {
+public:
+    struct Config {
+        int sync_every = 32;
+        double sync_interval = 5.0;  // Seconds
+        
+        Config() {}
+    };
+    
+    // Opens (creating if needed) the journal and replays existing records
+    explicit BatchJournal(const std::string& path, const Config& config = Config());
+    ~BatchJournal();
+    
+    BatchJournal(const BatchJournal&) = delete;
+    BatchJournal& operator=(const BatchJournal&) = delete;
+    
+    // True if a previous run finished this job
+    bool is_done(size_t index, const FitJob& job) const;
+    
+    // Jobs that were started but never finished in previous runs
+    size_t in_flight() const { return in_flight_; }
+    size_t completed() const { return done_.size(); }
+    
+    void mark_started(size_t index, const FitJob& job);
+    void mark_done(size_t index, const FitJob& job);
+    
+    // Flush pending records to stable storage
+    void sync();
+    
+    static uint64_t job_id(const FitJob& job);
+
+private:
+    std::string path_;
+    Config config_;
+    int fd_ = -1;
+    int unsynced_ = 0;
+    std::chrono::steady_clock::time_point last_sync_;
+    std::unordered_map<size_t, uint64_t> done_;
+    size_t in_flight_ = 0;
+    
+    void append(const char* kind, size_t index, const FitJob& job, bool durable);
+};
+
+} // namespace chargeopt
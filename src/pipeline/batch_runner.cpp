@@ -0,0 +1,444 @@
+#include "batch_runner.hpp"
+#include "job_key.hpp"
+#include "batch_journal.hpp"
+#include "../io/xyz_parser.hpp"
+#include "../io/charges_writer.hpp"
+#include "../io/result_sink.hpp"
+#include "../io/file_prefetcher.hpp"
+#include <iostream>
+#include <iomanip>
+#include <memory>
+#include <sstream>
+#include <algorithm>
+#include <cstdlib>
+#include <limits>
+#include <stdexcept>
+#include <unordered_map>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace chargeopt {
+
+namespace {
+
+struct PreparedJob {
+    Molecule mol;
+    std::shared_ptr<const std::string> xyz_data;  // Kept for the fit (small)
+    JobKey key;
+    bool ok = false;
+    bool resumed = false;
+    std::string error;
+    
+    // Output of a resumed job, read back to re-emit its sink record
+    std::vector<std::string> header;
+    std::vector<std::string> elements;
+    std::vector<double> charges;
+};
+
+// Value of a "Name: value" header line, empty if there is none
+std::string header_value(const std::vector<std::string>& header, const std::string& name) {
+    for (const auto& line : header) {
+        if (line.compare(0, name.size() + 2, name + ": ") == 0) {
+            return line.substr(name.size() + 2);
+        }
+    }
+    return "";
+}
+
+// fsync through a read-only descriptor (works for directories too)
+void sync_path(const std::string& target, const std::string& output) {
+    const int fd = ::open(target.c_str(), O_RDONLY);
+    const bool synced = fd >= 0 && ::fsync(fd) == 0;
+    if (fd >= 0) {
+        ::close(fd);
+    }
+    if (!synced) {
+        throw std::runtime_error("Cannot sync output file: " + output);
+    }
+}
+
+// Flushes a written file, and the directory entry of a new one, to stable
+// storage
+void sync_output(const std::string& path, bool created) {
+    sync_path(path, path);
+    if (created) {
+        const size_t slash = path.find_last_of('/');
+        sync_path(slash == std::string::npos ? "." : path.substr(0, slash + 1), path);
+    }
+}
+
+// Charges of the canonical entry in this job's own atom order
+Eigen::VectorXd charges_for(const ResultStore::Entry& entry, const JobKey& key) {
+    Eigen::VectorXd q(entry.charges.size());
+    for (size_t k = 0; k < entry.charges.size(); ++k) {
+        q(key.order[k]) = entry.charges[k];
+    }
+    return q;
+}
+
+} // namespace
+
+void LocalFitExecutor::submit(size_t index, const FitJob& job) {
+    pending_ = true;
+    index_ = index;
+    job_ = &job;
+}
+
+bool LocalFitExecutor::wait(Outcome& outcome) {
+    if (!pending_) {
+        return false;
+    }
+    pending_ = false;
+    outcome = fit(index_, *job_, options_, log_);
+    return true;
+}
+
+FitExecutor::Outcome LocalFitExecutor::fit(size_t index, const FitJob& job,
+                                           const FitOptions& options, std::ostream& log) {
+    Outcome outcome;
+    outcome.job = index;
+    try {
+        FitResult result = FitPipeline::run(job, options, log);
+        for (size_t i = 0; i < result.mol.num_atoms(); ++i) {
+            outcome.charges.push_back(result.mol.atom(i).charge);
+        }
+        if (result.fitted) {
+            outcome.esp_rmse = result.validation.esp_rmse;
+            outcome.esp_max_error = result.validation.esp_max_error;
+        }
+        outcome.timings = result.timings;
+    } catch (const std::exception& e) {
+        outcome.error = e.what();
+    }
+    return outcome;
+}
+
+size_t BatchRunner::run(const std::vector<FitJob>& jobs) {
+    std::ostream quiet(nullptr);
+    LocalFitExecutor executor(options_, config_.verbose ? *config_.out : quiet);
+    return run(jobs, executor);
+}
+
+size_t BatchRunner::run(const std::vector<FitJob>& jobs, FitExecutor& executor) {
+    stats_ = Stats();
+    stats_.jobs = jobs.size();
+    
+    std::ostream& out = *config_.out;
+    std::ostream quiet(nullptr);
+    
+    AsyncResultWriter writer;
+    if (!config_.ndjson.empty()) {
+        writer.add_sink(std::unique_ptr<ResultSink>(new NdjsonSink(config_.ndjson)));
+    }
+    if (!config_.binary.empty()) {
+        writer.add_sink(std::unique_ptr<ResultSink>(new BinarySink(config_.binary)));
+    }
+    
+    ResultStore store;
+    if (!config_.result_store.empty()) {
+        store = ResultStore(config_.result_store);
+        out << "Result store: " << config_.result_store
+            << " (" << store.size() << " stored fits)" << std::endl;
+    }
+    
+    std::unique_ptr<BatchJournal> journal;
+    if (!config_.journal.empty()) {
+        journal.reset(new BatchJournal(config_.journal));
+        if (journal->completed() > 0 || journal->in_flight() > 0) {
+            out << "Resuming from journal: " << config_.journal << " ("
+                << journal->completed() << " finished, "
+                << journal->in_flight() << " interrupted jobs re-queued)" << std::endl;
+        }
+    }
+    
+    // Input files are read config_.prefetch jobs ahead of use
+    std::unique_ptr<FilePrefetcher> prefetcher;
+    if (config_.prefetch > 0) {
+        prefetcher.reset(new FilePrefetcher());
+        if (config_.verbose) {
+            out << "Prefetching " << config_.prefetch << " jobs ahead ("
+                << FilePrefetcher::backend_name(prefetcher->backend()) << ")" << std::endl;
+        }
+    }
+    
+    // Jobs are keyed as the loop reaches them: geometry is cheap to parse;
+    // cube content is hashed once per distinct path, from the prefetched
+    // buffer, which then goes to the fit as well
+    std::vector<PreparedJob> prepared(jobs.size());
+    std::unordered_map<std::string, JobKey::Source> sources;
+    
+    // A job the journal has as done is skipped only if its output file is
+    // complete; the sinks are rewritten, so its record is re-emitted from it
+    for (size_t i = 0; i < jobs.size(); ++i) {
+        PreparedJob& prep = prepared[i];
+        prep.resumed = journal && journal->is_done(i, jobs[i])
+                    && ChargesWriter::read(jobs[i].output_file, prep.header,
+                                           prep.elements, prep.charges);
+    }
+    auto prefetch_for_key = [&](size_t i) {
+        if (i < jobs.size() && !prepared[i].resumed) {
+            prefetcher->request(jobs[i].xyz_file);
+            if (!sources.count(jobs[i].cube_file)) {
+                prefetcher->request(jobs[i].cube_file);
+            }
+        }
+    };
+    if (prefetcher) {
+        for (size_t i = 0; i < config_.prefetch; ++i) {
+            prefetch_for_key(i);
+        }
+    }
+    
+    auto prepare = [&](size_t i, FilePrefetcher::Buffer& cube) {
+        try {
+            FilePrefetcher::Buffer xyz = prefetcher ? prefetcher->take(jobs[i].xyz_file) : nullptr;
+            if (xyz) {
+                prepared[i].mol = XYZParser::parse_buffer(*xyz, quiet);
+                prepared[i].xyz_data = xyz;
+            } else {
+                prepared[i].mol = XYZParser::parse(jobs[i].xyz_file, quiet);
+            }
+            if (prefetcher && prefetcher->pending(jobs[i].cube_file)) {
+                cube = prefetcher->take(jobs[i].cube_file);
+            }
+            auto it = sources.find(jobs[i].cube_file);
+            if (it == sources.end()) {
+                JobKey::Source source = cube ? JobKey::Source::from_buffer(*cube)
+                                             : JobKey::Source::from_file(jobs[i].cube_file);
+                it = sources.emplace(jobs[i].cube_file, source).first;
+            }
+            prepared[i].key = JobKey::compute(prepared[i].mol, it->second,
+                                              jobs[i].total_charge, options_);
+            prepared[i].ok = true;
+        } catch (const std::exception& e) {
+            prepared[i].error = e.what();
+        }
+    };
+    
+    auto report = [&](size_t i, const std::string& message) {
+        out << "[" << (i + 1) << "/" << jobs.size() << "] " << jobs[i].xyz_file
+            << ": " << message << std::endl;
+    };
+    
+    auto record_for = [&](size_t i) {
+        JobRecord record;
+        record.job = i;
+        record.xyz_file = jobs[i].xyz_file;
+        record.cube_file = jobs[i].cube_file;
+        record.output_file = jobs[i].output_file;
+        record.total_charge = jobs[i].total_charge;
+        return record;
+    };
+    
+    // Values as written to the output file; the max error is not in it
+    auto resumed_record = [&](size_t i) {
+        const PreparedJob& prep = prepared[i];
+        JobRecord record = record_for(i);
+        const std::string source = header_value(prep.header, "Source");
+        const std::string rmse = header_value(prep.header, "ESP RMSE");
+        record.source = source.empty() ? "fitted" : source;
+        record.elements = prep.elements;
+        record.charges = prep.charges;
+        if (!rmse.empty() && rmse.compare(0, 3, "n/a") != 0) {
+            record.esp_rmse = std::strtod(rmse.c_str(), nullptr);
+            record.esp_max_error = std::numeric_limits<double>::quiet_NaN();
+        }
+        record.dipole = std::strtod(header_value(prep.header, "Dipole moment").c_str(), nullptr);
+        return record;
+    };
+    
+    auto fail = [&](size_t i, const std::string& error) {
+        report(i, "FAILED (" + error + ")");
+        stats_.failed++;
+        if (!writer.empty()) {
+            JobRecord record = record_for(i);
+            record.status = "failed";
+            record.error = error;
+            writer.submit(std::move(record));
+        }
+    };
+    
+    // Write one job's output from the stored (canonical) entry
+    auto finish = [&](size_t i, const std::string& source, const StageTimings& timings) {
+        const FitJob& job = jobs[i];
+        const PreparedJob& prep = prepared[i];
+        const ResultStore::Entry* entry = store.find(prep.key.key);
+        
+        // Fan out: this job's atom order, own coordinates for the dipole
+        Molecule mol = prep.mol;
+        mol.set_charges(charges_for(*entry, prep.key));
+        const double dipole = (mol.positions().transpose() * mol.charges()).norm() * 2.5417464;
+        
+        std::vector<std::string> header = {
+            "Atomic partial charges fitted using QP optimization",
+            "Molecule: " + job.xyz_file,
+            "Total charge: " + ChargesWriter::to_text(job.total_charge),
+            entry->esp_rmse >= 0.0 ? "ESP RMSE: " + ChargesWriter::to_text(entry->esp_rmse) + " V"
+                                   : "ESP RMSE: n/a (charge database)",
+            "Dipole moment: " + ChargesWriter::to_text(dipole) + " D"
+        };
+        if (source != "fitted") {
+            header.push_back("Source: " + source);
+        }
+        
+        // With a journal the output must reach the disk before its done
+        // record can: a resumed run trusts the record
+        try {
+            const bool created = journal && ::access(job.output_file.c_str(), F_OK) != 0;
+            ChargesWriter::write(job.output_file, header, mol);
+            if (journal) {
+                sync_output(job.output_file, created);
+            }
+        } catch (const std::exception& e) {
+            fail(i, e.what());
+            return;
+        }
+        
+        if (journal) {
+            journal->mark_done(i, job);
+        }
+        
+        std::ostringstream message;
+        message << source;
+        if (entry->esp_rmse >= 0.0) {
+            message << ", RMSE " << entry->esp_rmse << " a.u.";
+        }
+        message << " -> " << job.output_file;
+        report(i, message.str());
+        
+        if (!writer.empty()) {
+            JobRecord record = record_for(i);
+            record.source = source;
+            for (size_t k = 0; k < mol.num_atoms(); ++k) {
+                record.elements.push_back(mol.atom(k).element);
+                record.charges.push_back(mol.atom(k).charge);
+            }
+            record.esp_rmse = entry->esp_rmse;
+            record.esp_max_error = entry->esp_max_error;
+            record.dipole = dipole;
+            record.t_parse_xyz = timings.parse_xyz;
+            record.t_parse_cube = timings.parse_cube;
+            record.t_assemble = timings.assemble;
+            record.t_solve = timings.solve;
+            record.t_validate = timings.validate;
+            record.t_total = timings.total();
+            writer.submit(std::move(record));
+        }
+    };
+    
+    // First job of each key is the representative that gets fitted; jobs
+    // sharing the key of a fit still in progress wait for it
+    std::unordered_map<uint64_t, size_t> representative;
+    std::unordered_map<size_t, std::vector<size_t>> waiting;
+    
+    // Jobs handed to the executor, with their preloaded inputs
+    std::unordered_map<size_t, FitJob> submitted;
+    
+    auto complete = [&](const FitExecutor::Outcome& outcome) {
+        const size_t rep = outcome.job;
+        submitted.erase(rep);
+        std::vector<size_t> members = std::move(waiting[rep]);
+        waiting.erase(rep);
+        
+        if (!outcome.error.empty()) {
+            // Later jobs with this key get a fresh attempt
+            representative.erase(prepared[rep].key.key);
+            for (size_t i : members) {
+                fail(i, outcome.error);
+            }
+            return;
+        }
+        
+        const JobKey& key = prepared[rep].key;
+        ResultStore::Entry fresh;
+        for (int idx : key.order) {
+            fresh.charges.push_back(outcome.charges[idx]);
+        }
+        fresh.esp_rmse = outcome.esp_rmse;
+        fresh.esp_max_error = outcome.esp_max_error;
+        store.insert(key.key, fresh);
+        stats_.fitted++;
+        
+        finish(rep, outcome.esp_rmse >= 0.0 ? "fitted" : "charge database", outcome.timings);
+        for (size_t i : members) {
+            if (i != rep) {
+                stats_.duplicates++;
+                finish(i, "duplicate of " + jobs[rep].xyz_file, StageTimings());
+            }
+        }
+    };
+    
+    FitExecutor::Outcome outcome;
+    for (size_t i = 0; i < jobs.size(); ++i) {
+        if (prefetcher) {
+            prefetch_for_key(i + config_.prefetch);
+        }
+        const PreparedJob& prep = prepared[i];
+        
+        if (prep.resumed) {
+            report(i, "finished in previous run -> " + jobs[i].output_file);
+            stats_.resumed++;
+            if (!writer.empty()) {
+                writer.submit(resumed_record(i));
+            }
+            continue;
+        }
+        
+        FilePrefetcher::Buffer cube;
+        prepare(i, cube);
+        
+        if (!prep.ok) {
+            fail(i, prep.error);
+            continue;
+        }
+        
+        auto rep = representative.find(prep.key.key);
+        if (rep != representative.end()) {
+            auto pending = waiting.find(rep->second);
+            if (pending != waiting.end()) {
+                pending->second.push_back(i);
+            } else {
+                stats_.duplicates++;
+                finish(i, "duplicate of " + jobs[rep->second].xyz_file, StageTimings());
+            }
+        } else if (store.find(prep.key.key)) {
+            representative.emplace(prep.key.key, i);
+            stats_.cached++;
+            finish(i, "stored result", StageTimings());
+        } else {
+            representative.emplace(prep.key.key, i);
+            waiting[i].push_back(i);
+            if (journal) {
+                journal->mark_started(i, jobs[i]);
+            }
+            // Remote executors read their own inputs; buffers are not sent
+            FitJob& fit_job = submitted.emplace(i, jobs[i]).first->second;
+            if (!executor.remote()) {
+                fit_job.xyz_data = prep.xyz_data;
+                fit_job.cube_data = cube;
+            }
+            executor.submit(i, fit_job);
+            while (!executor.has_capacity() && executor.wait(outcome)) {
+                complete(outcome);
+            }
+        }
+    }
+    
+    while (executor.wait(outcome)) {
+        complete(outcome);
+    }
+    
+    writer.close();
+    
+    out << "\nBatch summary: " << stats_.jobs << " jobs, "
+        << stats_.fitted << " fitted, "
+        << stats_.duplicates << " duplicates, "
+        << stats_.cached << " from result store, "
+        << stats_.resumed << " resumed, "
+        << stats_.failed << " failed" << std::endl;
+    
+    return stats_.failed;
+}
+
+} // namespace chargeopt
@@ -0,0 +1,114 @@
+#pragma once
+
+#include "fit_pipeline.hpp"
+#include "result_store.hpp"
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace chargeopt {
+
+// Where the fits of a batch run. The runner decides which jobs need a fit;
+// an executor runs them, possibly several at once and finishing in any
+// order.
+class FitExecutor {
+public:
+    struct Outcome {
+        size_t job = 0;
+        std::string error;              // Non-empty if the fit failed
+        std::vector<double> charges;    // In the job's own atom order
+        double esp_rmse = -1.0;         // Negative when no ESP fit was run
+        double esp_max_error = -1.0;
+        StageTimings timings;
+    };
+    
+    virtual ~FitExecutor() = default;
+    
+    // True if another job can be submitted without waiting for a result
+    virtual bool has_capacity() const = 0;
+    
+    // True if fits run in other processes that read their own input files,
+    // so preloaded FitJob contents would be wasted
+    virtual bool remote() const { return false; }
+    
+    virtual void submit(size_t index, const FitJob& job) = 0;
+    
+    // Blocks for the next finished fit; false when none is outstanding
+    virtual bool wait(Outcome& outcome) = 0;
+};
+
+// Runs one fit at a time in the calling thread
+class LocalFitExecutor : public FitExecutor {
+public:
+    LocalFitExecutor(const FitOptions& options, std::ostream& log)
+        : options_(options), log_(log) {}
+    
+    bool has_capacity() const override { return !pending_; }
+    void submit(size_t index, const FitJob& job) override;
+    bool wait(Outcome& outcome) override;
+    
+    // Runs the pipeline for one job; failures are reported in the outcome
+    static Outcome fit(size_t index, const FitJob& job, const FitOptions& options,
+                       std::ostream& log);
+
+private:
+    const FitOptions& options_;
+    std::ostream& log_;
+    bool pending_ = false;
+    size_t index_ = 0;
+    const FitJob* job_ = nullptr;
+};
+
+// Runs a manifest of fit jobs in-process.
+//
+// Jobs are keyed by JobKey (canonical geometry + cube content + settings).
+// Each distinct key is fitted once; duplicates receive the same charges,
+// mapped back to their own atom order, and their own output file. With a
+// result store, keys fitted by earlier runs are not fitted again. With a
+// journal (BatchJournal), jobs finished before a crash or preemption are
+// skipped on restart and unfinished ones are run again. Per-job records
+// can also be streamed to NDJSON / binary sinks (see result_sink.hpp);
+// sinks are rewritten on restart, with records of skipped jobs read back
+// from their output files.
+class BatchRunner {
+public:
+    struct Config {
+        std::string result_store;   // Empty = no persistence across runs
+        std::string journal;        // Checkpoint log; resumes from it if it exists
+        std::string ndjson;         // NDJSON sink path, "-" = stdout
+        std::string binary;         // Binary columnar sink path
+        size_t prefetch = 8;        // Jobs whose input files are read ahead (0 = off)
+        bool verbose = false;       // Show per-job pipeline output
+        std::ostream* out = &std::cout;  // Progress and summary lines
+        
+        Config() {}
+    };
+    
+    struct Stats {
+        size_t jobs = 0;
+        size_t fitted = 0;          // Distinct fits actually run
+        size_t duplicates = 0;      // Jobs served by another job in this batch
+        size_t cached = 0;          // Jobs served by the result store
+        size_t resumed = 0;         // Jobs finished by a previous (interrupted) run
+        size_t failed = 0;
+    };
+    
+    BatchRunner(const FitOptions& options, const Config& config = Config())
+        : options_(options), config_(config) {}
+    
+    // Returns the number of failed jobs
+    size_t run(const std::vector<FitJob>& jobs);
+    
+    // Same, with fits run by the given executor. All outputs, the result
+    // store, journal and sinks are still written by the calling process.
+    size_t run(const std::vector<FitJob>& jobs, FitExecutor& executor);
+    
+    const Stats& stats() const { return stats_; }
+
+private:
+    FitOptions options_;
+    Config config_;
+    Stats stats_;
+};
+
+} // namespace chargeopt
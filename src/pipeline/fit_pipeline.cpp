@@ -0,0 +1,411 @@
+#include "fit_pipeline.hpp"
+#include "../io/xyz_parser.hpp"
+#include "../io/cube_parser.hpp"
+#include "../io/shared_grid_cache.hpp"
+#include "../io/multipole_parser.hpp"
+#include "../core/shell_grid.hpp"
+#include "../analysis/symmetry.hpp"
+#include "../analysis/topology.hpp"
+#include "../core/task_graph.hpp"
+#include "../solver/gram_quadrature.hpp"
+#include <stdexcept>
+#include <chrono>
+#include <cmath>
+#include <mutex>
+#include <sstream>
+
+#ifdef CHARGEOPT_USE_MPI
+#include "../solver/distributed_assembly.hpp"
+#endif
+
+namespace chargeopt {
+
+Molecule FitPipeline::load_molecule(const FitJob& job, std::ostream& log) {
+    log << "Loading molecule from: " << job.xyz_file << std::endl;
+    Molecule mol = job.xyz_data ? XYZParser::parse_buffer(*job.xyz_data, log)
+                                : XYZParser::parse(job.xyz_file, log);
+    mol.set_total_charge(job.total_charge);
+    for (size_t i = 0; i < mol.num_atoms(); ++i) {
+        mol.atom(i).charge *= -1.0;
+    }
+    log << "  Atoms: " << mol.num_atoms() << std::endl;
+    log << "  Total charge: " << job.total_charge << " e\n" << std::endl;
+    return mol;
+}
+
+ESPGrid FitPipeline::load_grid(const FitJob& job, const FitOptions& options, std::ostream& log) {
+    log << "Loading ESP grid from: " << job.cube_file << std::endl;
+    // Robust fitting replaces the hand-tuned extreme-ESP filter
+    const bool filter_extreme = !options.robust_enabled();
+    ESPGrid grid;
+    if (options.shared_grid_cache) {
+        grid = SharedGridCache::load(job.cube_file, filter_extreme, log);
+    } else if (job.cube_data) {
+        grid = CubeParser::parse_buffer(*job.cube_data, filter_extreme, log);
+    } else {
+        grid = CubeParser::parse(job.cube_file, filter_extreme, log);
+    }
+    log << "  Grid points: " << grid.num_points() << std::endl;
+    
+    // DEBUG: Check ESP range immediately after loading
+    log << "\n  DEBUG MAIN: Verifying ESP range after loading..." << std::endl;
+    double debug_min = grid.min_potential();
+    double debug_max = grid.max_potential();
+    log << "  DEBUG MAIN: min_potential() = " << std::scientific << debug_min << std::endl;
+    log << "  DEBUG MAIN: max_potential() = " << std::scientific << debug_max << std::endl;
+    
+    // DEBUG: Manually check first/last points
+    if (grid.num_points() > 0) {
+        log << "  DEBUG MAIN: First point ESP = " << grid.point(0).potential << std::endl;
+        log << "  DEBUG MAIN: Last point ESP = " << grid.point(grid.num_points()-1).potential << std::endl;
+        
+        // Manually scan for actual min/max
+        double manual_min = grid.point(0).potential;
+        double manual_max = grid.point(0).potential;
+        size_t max_idx = 0;
+        
+        for (size_t i = 0; i < grid.num_points(); i++) {
+            double val = grid.point(i).potential;
+            if (val < manual_min) manual_min = val;
+            if (val > manual_max) {
+                manual_max = val;
+                max_idx = i;
+            }
+        }
+        
+        log << "  DEBUG MAIN: Manual scan - min = " << manual_min << ", max = " << manual_max << std::endl;
+        log << "  DEBUG MAIN: Max value found at grid point index " << max_idx << std::endl;
+        log << "  DEBUG MAIN: That point's position = (" 
+            << grid.point(max_idx).position(0) << ", "
+            << grid.point(max_idx).position(1) << ", "
+            << grid.point(max_idx).position(2) << ")" << std::endl;
+    }
+    log << std::defaultfloat << std::endl;
+    
+    log << "  ESP range: [" << grid.min_potential() << ", " 
+        << grid.max_potential() << "] V\n" << std::endl;
+    
+    return grid;
+}
+
+ESPGrid FitPipeline::load_multipole_grid(const FitJob& job, const Molecule& mol, std::ostream& log) {
+    log << "Loading distributed multipoles from: " << job.cube_file << std::endl;
+    const std::vector<MultipoleSite> sites = job.cube_data ? MultipoleParser::parse_buffer(*job.cube_data, log)
+                                                           : MultipoleParser::parse(job.cube_file, log);
+    
+    const Eigen::MatrixXd points = ShellGrid::positions(mol);
+    const Eigen::VectorXd potentials = MultipoleParser::potential(sites, points);
+    ESPGrid grid;
+    for (Eigen::Index i = 0; i < points.rows(); ++i) {
+        grid.add_point(points.row(i).transpose(), potentials(i));
+    }
+    log << "  Grid points: " << grid.num_points() << " (Merz-Kollman shells)" << std::endl;
+    log << "  ESP range: [" << grid.min_potential() << ", "
+        << grid.max_potential() << "] V\n" << std::endl;
+    return grid;
+}
+
+std::vector<int> FitPipeline::match_database(const Molecule& mol,
+                                             const ChargeDatabase& db,
+                                             Eigen::VectorXd& charges) {
+    std::vector<int> matched;
+    auto keys = Topology::environment_hashes(mol, db.depth());
+    charges = Eigen::VectorXd::Zero(mol.num_atoms());
+    for (size_t i = 0; i < mol.num_atoms(); ++i) {
+        if (db.lookup(keys[i], charges(i))) {
+            matched.push_back(i);
+        }
+    }
+    return matched;
+}
+
+void FitPipeline::assemble(const Molecule& mol, const ESPGrid& grid, const FitOptions& options,
+                           Eigen::MatrixXd& H, Eigen::VectorXd& f, std::ostream& log) {
+    log << "Building QP problem..." << std::endl;
+    if (options.robust_enabled()) {
+        return;
+    }
+#ifdef CHARGEOPT_USE_MPI
+    if (options.distributed) {
+        DistributedAssembly::build_esp_matrices(mol, grid, H, f);
+        return;
+    }
+#endif
+    if (options.rhs == QPSolver::RhsMethod::FFT && !grid.has_lattice()) {
+        log << "  FFT right-hand side needs a cube lattice; using direct summation" << std::endl;
+    }
+    if (options.hessian == QPSolver::HessianMethod::Quadrature && !grid.has_lattice()) {
+        log << "  Quadrature Hessian needs a cube lattice; using the exact sum" << std::endl;
+    }
+    const QPSolver::Assembly used = QPSolver::build_esp_matrices(mol, grid, H, f, options.rhs,
+                                                                 options.hessian);
+    if (options.rhs == QPSolver::RhsMethod::FFT && grid.has_lattice() && used.rhs != options.rhs) {
+        log << "  FFT right-hand side needs " << (used.fft_workspace >> 20) << " MiB, over half the "
+            << (used.memory_budget >> 20) << " MiB memory budget; using direct summation" << std::endl;
+    }
+    if (options.hessian == QPSolver::HessianMethod::Quadrature && grid.has_lattice()
+        && used.hessian != options.hessian) {
+        log << "  Quadrature Hessian rejected: " << grid.num_points() << " grid points, "
+            << std::llround(used.estimated_points) << " estimated from the lattice volume (tolerance "
+            << 100.0 * GramQuadrature::Config().max_count_error << "%); using the exact sum" << std::endl;
+    }
+}
+
+Constraints FitPipeline::build_constraints(const Molecule& mol, double total_charge,
+                                           const FitOptions& options,
+                                           const std::vector<int>& fixed,
+                                           const Eigen::VectorXd& fixed_charges,
+                                           std::ostream& log) {
+    Constraints constraints;
+    
+    // Total charge constraint
+    constraints.add_charge_constraint(mol.num_atoms(), total_charge);
+    log << "  Added total charge constraint\n" << std::endl;
+    
+    // Symmetry constraints
+    if (options.use_symmetry) {
+        auto equiv_groups = SymmetryDetector::detect_equivalent_atoms(mol);
+        
+        if (!equiv_groups.empty()) {
+            log << "Detected symmetry:" << std::endl;
+            for (const auto& group : equiv_groups) {
+                log << "  Equivalent atoms: ";
+                for (int idx : group) {
+                    log << mol.atom(idx).element << (idx + 1) << " ";
+                }
+                log << std::endl;
+                
+                // Add constraints: all atoms in group have same charge
+                auto it = group.begin();
+                int first = *it;
+                ++it;
+                for (; it != group.end(); ++it) {
+                    constraints.add_symmetry_constraint(first, *it, mol.num_atoms());
+                }
+            }
+            log << std::endl;
+        }
+    }
+    
+    // Database charges are held fixed; only the remainder is fitted
+    for (int idx : fixed) {
+        constraints.add_fixed_charge_constraint(idx, fixed_charges(idx), mol.num_atoms());
+    }
+    if (!fixed.empty()) {
+        log << "Fixed " << fixed.size() << " database charges\n" << std::endl;
+    }
+    
+    return constraints;
+}
+
+QPSolver::Config FitPipeline::solver_config(const FitOptions& options, const Molecule& mol,
+                                            double total_charge, std::ostream& log) {
+    QPSolver::Config config;
+    config.tolerance = options.tolerance;
+    config.regularization = options.lambda;
+    config.verbose = options.verbose;
+    
+    if (options.eem_prior) {
+        Constraints eem_constraints;
+        eem_constraints.add_charge_constraint(mol.num_atoms(), total_charge);
+        config.reference_charges = EEMSolver(options.eem).solve(mol, eem_constraints).charges;
+        log << "  Using EEM charges as prior (lambda = " << options.lambda << ")" << std::endl;
+    }
+    
+    return config;
+}
+
+QPSolution FitPipeline::solve(const Molecule& mol, const ESPGrid& grid,
+                              const Eigen::MatrixXd& H, const Eigen::VectorXd& f,
+                              const Constraints& constraints,
+                              const QPSolver::Config& config,
+                              const FitOptions& options, std::ostream& log) {
+    QPSolution solution;
+    if (options.robust_enabled()) {
+        RobustFitter::Config robust_config = options.robust;
+        robust_config.tolerance = options.tolerance;
+        RobustFitter fitter(config, robust_config);
+        solution = fitter.fit(mol, grid, constraints);
+    } else {
+        QPSolver solver(config);
+        solution = solver.solve(H, f, constraints);
+    }
+    
+    if (!solution.converged) {
+        std::cerr << "\nWarning: Optimization did not fully converge!" << std::endl;
+    }
+    
+    log << "  Converged: " << (solution.converged ? "Yes" : "No") << std::endl;
+    log << "  Iterations: " << solution.iterations << std::endl;
+    log << "  Objective value: " << std::scientific << solution.objective_value << std::defaultfloat << "\n" << std::endl;
+    
+    return solution;
+}
+
+namespace {
+
+// Stages of one fit, in the order of a serial run
+enum Stage {
+    LoadXyz,
+    LoadCube,
+    Assemble,
+    BuildConstraints,
+    ConfigureSolver,
+    Solve,
+    Validate,
+    AfterSolve,
+    NumStages
+};
+
+// Each stage logs into its own buffer. A buffer is released to the real
+// log once every earlier stage has finished, so the output reads as it
+// would from a serial run even when stages overlap.
+class StageLogs {
+public:
+    StageLogs(std::ostream& log) : log_(log), done_(NumStages, false) {}
+    
+    std::ostream& operator[](Stage stage) { return buffers_[stage]; }
+    
+    void finish(Stage stage) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        done_[stage] = true;
+        while (next_ < NumStages && done_[next_]) {
+            log_ << buffers_[next_++].str();
+        }
+        log_.flush();
+    }
+    
+    // After a failure: whatever did finish, in stage order
+    void drain() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (; next_ < NumStages; ++next_) {
+            if (done_[next_]) log_ << buffers_[next_].str();
+        }
+        log_.flush();
+    }
+
+private:
+    std::ostream& log_;
+    std::ostringstream buffers_[NumStages];
+    std::vector<bool> done_;
+    int next_ = 0;
+    std::mutex mutex_;
+};
+
+double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+} // namespace
+
+FitResult FitPipeline::run(const FitJob& job, const FitOptions& options, std::ostream& log,
+                           ThreadPool* pool,
+                           const std::function<void(const FitResult&)>& after_solve) {
+    const auto start = std::chrono::steady_clock::now();
+    FitResult result;
+    Molecule& mol = result.mol;
+    Eigen::VectorXd db_charges;
+    Eigen::MatrixXd H;
+    Eigen::VectorXd f;
+    
+    StageLogs logs(log);
+    double seconds[NumStages] = {};
+    TaskGraph graph;
+    auto stage = [&](Stage s, const std::vector<size_t>& deps, std::function<void(std::ostream&)> body) {
+        return graph.add([&, s, body] {
+            const auto begin = std::chrono::steady_clock::now();
+            body(logs[s]);
+            seconds[s] = seconds_since(begin);
+            logs.finish(s);
+        }, deps);
+    };
+    
+    const size_t xyz = stage(LoadXyz, {}, [&](std::ostream& out) {
+        mol = load_molecule(job, out);
+        if (!options.database) return;
+        
+        // Known fragments from the charge database
+        result.db_matched = match_database(mol, *options.database, db_charges);
+        out << "Charge database: " << options.database->size() << " environments" << std::endl;
+        out << "  Matched atoms: " << result.db_matched.size() << " / " << mol.num_atoms() << "\n" << std::endl;
+        
+        if (result.db_matched.size() == mol.num_atoms()) {
+            // Every environment is known: spread any residual charge evenly
+            db_charges.array() += (job.total_charge - db_charges.sum()) / mol.num_atoms();
+            mol.set_charges(db_charges);
+            result.solution.charges = db_charges;
+            result.solution.converged = true;
+            result.fitted = false;
+            return;
+        }
+        
+        if (job.cube_file.empty()) {
+            throw std::runtime_error("Unmatched atoms need an ESP cube file to fit");
+        }
+    });
+    
+    // The cube is independent of the geometry unless a full database
+    // match makes it unnecessary; multipole targets are evaluated on
+    // shells around the atoms
+    const bool multipoles = MultipoleParser::is_multipole_file(job.cube_file);
+    const size_t cube = stage(LoadCube, options.database || multipoles ? std::vector<size_t>{xyz} : std::vector<size_t>{},
+                              [&](std::ostream& out) {
+        if (!result.fitted) return;
+        result.grid = multipoles ? load_multipole_grid(job, mol, out) : load_grid(job, options, out);
+    });
+    
+    const size_t assembled = stage(Assemble, {xyz, cube}, [&](std::ostream& out) {
+        if (!result.fitted) return;
+        assemble(mol, result.grid, options, H, f, out);
+    });
+    
+    const size_t constrained = stage(BuildConstraints, {xyz}, [&](std::ostream& out) {
+        if (!result.fitted) return;
+        result.constraints = build_constraints(mol, job.total_charge, options,
+                                               result.db_matched, db_charges, out);
+    });
+    
+    const size_t configured = stage(ConfigureSolver, {xyz}, [&](std::ostream& out) {
+        if (!result.fitted) return;
+        out << "Solving QP..." << std::endl;
+        result.solver_config = solver_config(options, mol, job.total_charge, out);
+    });
+    
+    const size_t solved = stage(Solve, {assembled, constrained, configured}, [&](std::ostream& out) {
+        if (!result.fitted) return;
+        result.solution = solve(mol, result.grid, H, f, result.constraints,
+                                result.solver_config, options, out);
+        
+        // Update molecule with fitted charges
+        mol.set_charges(result.solution.charges);
+    });
+    
+    stage(Validate, {solved}, [&](std::ostream&) {
+        if (!result.fitted) return;
+        result.validation = Validator::validate(mol, result.grid);
+    });
+    
+    stage(AfterSolve, {solved}, [&](std::ostream&) {
+        if (!result.fitted || !after_solve) return;
+        after_solve(result);
+    });
+    
+    // MPI assembly must stay on the calling thread
+    try {
+        graph.run(options.distributed ? nullptr : pool);
+    } catch (...) {
+        logs.drain();
+        throw;
+    }
+    
+    result.timings.parse_xyz = seconds[LoadXyz];
+    result.timings.parse_cube = seconds[LoadCube];
+    result.timings.assemble = seconds[Assemble];
+    result.timings.solve = seconds[BuildConstraints] + seconds[ConfigureSolver] + seconds[Solve];
+    result.timings.validate = seconds[Validate];
+    result.timings.wall = seconds_since(start);
+    
+    return result;
+}
+
+} // namespace chargeopt
@@ -0,0 +1,132 @@
+#pragma once
+
+#include "../core/molecule.hpp"
+#include "../core/esp_grid.hpp"
+#include "../solver/constraints.hpp"
+#include "../solver/qp_solver.hpp"
+#include "../solver/robust_fit.hpp"
+#include "../solver/eem_solver.hpp"
+#include "../analysis/validator.hpp"
+#include "../io/charge_database.hpp"
+#include "../core/thread_pool.hpp"
+#include <Eigen/Dense>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace chargeopt {
+
+// Settings shared by every fit in a run
+struct FitOptions {
+    double tolerance = 1e-6;
+    double lambda = 0.0005;
+    bool use_symmetry = true;
+    bool verbose = false;
+    RobustFitter::Config robust;
+    bool eem_prior = false;
+    EEMSolver::Config eem;
+    const ChargeDatabase* database = nullptr;  // Optional; read-only, shareable
+    bool distributed = false;       // Assemble H, f across MPI ranks (MPI builds only)
+    QPSolver::RhsMethod rhs = QPSolver::RhsMethod::Direct;  // How g = A^T V is computed
+    QPSolver::HessianMethod hessian = QPSolver::HessianMethod::Exact;  // How G = A^T A is computed
+    bool shared_grid_cache = false;  // Load cubes through SharedGridCache
+    
+    FitOptions() { robust.loss = RobustFitter::Loss::None; }
+    
+    bool robust_enabled() const { return robust.loss != RobustFitter::Loss::None; }
+};
+
+// One molecule to fit
+struct FitJob {
+    std::string xyz_file;
+    std::string cube_file;
+    std::string output_file = "charges.txt";
+    double total_charge = 0.0;
+    
+    // Preloaded file contents (FilePrefetcher); read from disk when null
+    std::shared_ptr<const std::string> xyz_data;
+    std::shared_ptr<const std::string> cube_data;
+};
+
+// Wall-clock seconds spent in each pipeline stage
+struct StageTimings {
+    double parse_xyz = 0.0;
+    double parse_cube = 0.0;
+    double assemble = 0.0;
+    double solve = 0.0;         // Incl. constraints and solver setup
+    double validate = 0.0;
+    double wall = 0.0;          // Whole fit; below total() when stages overlap
+    
+    double total() const { return parse_xyz + parse_cube + assemble + solve + validate; }
+};
+
+struct FitResult {
+    Molecule mol;                   // Carries the fitted charges
+    ESPGrid grid;                   // Empty when no ESP fit was needed
+    Constraints constraints;
+    QPSolution solution;
+    QPSolver::Config solver_config;  // As used for the fit (incl. any EEM prior)
+    Validator::ValidationResults validation;
+    std::vector<int> db_matched;    // Atoms whose charge came from the database
+    bool fitted = true;             // False when every charge came from the database
+    StageTimings timings;
+};
+
+// The single-molecule fitting pipeline:
+//   load XYZ -> (database match) -> load cube -> assemble H, f
+//   -> constraints -> solve -> validate
+// Each stage is exposed so batch drivers can reuse or reorder them.
+// Progress messages go to log.
+class FitPipeline {
+public:
+    // Stages form a task graph: the cube is read while the geometry is
+    // parsed and symmetry detected, and validation overlaps after_solve.
+    // With a pool, independent stages run concurrently (at most
+    // max_parallel_stages at once); without, they run in order. The log
+    // reads the same either way. after_solve sees the fitted charges but
+    // not yet the validation results.
+    static FitResult run(const FitJob& job, const FitOptions& options,
+                         std::ostream& log = std::cout,
+                         ThreadPool* pool = nullptr,
+                         const std::function<void(const FitResult&)>& after_solve = nullptr);
+    
+    static constexpr size_t max_parallel_stages = 3;
+    
+    static Molecule load_molecule(const FitJob& job, std::ostream& log);
+    
+    static ESPGrid load_grid(const FitJob& job, const FitOptions& options, std::ostream& log);
+    
+    // Target ESP from a distributed multipole (GDMA punch) file instead of
+    // a cube: evaluated analytically on Merz-Kollman shells around mol
+    static ESPGrid load_multipole_grid(const FitJob& job, const Molecule& mol, std::ostream& log);
+    
+    // Atoms found in the database; fills charges (size N) for matched atoms
+    static std::vector<int> match_database(const Molecule& mol,
+                                           const ChargeDatabase& db,
+                                           Eigen::VectorXd& charges);
+    
+    // Normalized H, f (skipped for robust fits, which assemble their own)
+    static void assemble(const Molecule& mol, const ESPGrid& grid, const FitOptions& options,
+                         Eigen::MatrixXd& H, Eigen::VectorXd& f, std::ostream& log);
+    
+    // Total charge, symmetry and fixed (database) charge constraints
+    static Constraints build_constraints(const Molecule& mol, double total_charge,
+                                         const FitOptions& options,
+                                         const std::vector<int>& fixed,
+                                         const Eigen::VectorXd& fixed_charges,
+                                         std::ostream& log);
+    
+    static QPSolution solve(const Molecule& mol, const ESPGrid& grid,
+                            const Eigen::MatrixXd& H, const Eigen::VectorXd& f,
+                            const Constraints& constraints,
+                            const QPSolver::Config& config,
+                            const FitOptions& options, std::ostream& log);
+    
+    // Solver settings, with EEM prior charges when options.eem_prior is set
+    static QPSolver::Config solver_config(const FitOptions& options, const Molecule& mol,
+                                          double total_charge, std::ostream& log);
+};
+
+} // namespace chargeopt
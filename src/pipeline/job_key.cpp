@@ -0,0 +1,237 @@
+#include "job_key.hpp"
+#include "../core/hash.hpp"
+#include <Eigen/Dense>
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <tuple>
+
+namespace chargeopt {
+
+namespace {
+
+uint64_t hash_double(uint64_t seed, double value) {
+    return hash::combine(seed, hash::fnv1a(&value, sizeof(value)));
+}
+
+uint64_t hash_int(uint64_t seed, long long value) {
+    return hash::combine(seed, hash::fnv1a(&value, sizeof(value)));
+}
+
+uint64_t hash_vector(uint64_t seed, const Eigen::Vector3d& v) {
+    for (int c = 0; c < 3; ++c) {
+        seed = hash_int(seed, std::llround(v(c) / JobKey::geometry_resolution));
+    }
+    return seed;
+}
+
+// Hash of what is left in the stream, read in chunks
+uint64_t hash_rest(std::istream& in) {
+    uint64_t h = hash::fnv_offset;
+    char buffer[1 << 16];
+    while (in.read(buffer, sizeof(buffer)) || in.gcount() > 0) {
+        h = hash::fnv1a(buffer, in.gcount(), h);
+    }
+    return h;
+}
+
+// Reads a cube header (two comment lines, the atom count and origin, three
+// "count step" lines, then the atom lines) through next_line. False if the
+// lines are not laid out like one.
+template <typename NextLine>
+bool read_cube_header(NextLine next_line, JobKey::Source& source) {
+    std::string line;
+    if (!next_line(line) || !next_line(line) || !next_line(line)) {
+        return false;
+    }
+    int num_atoms = 0;
+    std::istringstream origin(line);
+    if (!(origin >> num_atoms >> source.origin(0) >> source.origin(1) >> source.origin(2))) {
+        return false;
+    }
+    for (int k = 0; k < 3; ++k) {
+        if (!next_line(line)) {
+            return false;
+        }
+        std::istringstream step(line);
+        if (!(step >> source.counts(k) >> source.steps(0, k) >> source.steps(1, k) >> source.steps(2, k))) {
+            return false;
+        }
+    }
+    for (int i = 0; i < std::abs(num_atoms); ++i) {
+        if (!next_line(line)) {
+            return false;
+        }
+    }
+    source.lattice = true;
+    return true;
+}
+
+// Canonical geometry hash and order, with the frame it was taken in
+JobKey canonicalize(const Molecule& mol, Eigen::RowVector3d& centroid, Eigen::Matrix3d& axes) {
+    const int n = mol.num_atoms();
+    Eigen::MatrixXd pos = mol.positions();
+    
+    // Center on the centroid
+    centroid = pos.colwise().mean();
+    pos.rowwise() -= centroid;
+    
+    // Principal axes of the gyration tensor (eigenvalues ascending)
+    Eigen::Matrix3d gyration = pos.transpose() * pos;
+    Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d> eig(gyration);
+    Eigen::Vector3d moments = eig.eigenvalues();
+    axes = eig.eigenvectors();
+    
+    const double scale = std::max(moments.maxCoeff(), 1e-12);
+    const bool degenerate = (moments(1) - moments(0)) < 1e-3 * scale ||
+                            (moments(2) - moments(1)) < 1e-3 * scale;
+    
+    if (degenerate) {
+        axes.setIdentity();
+    } else {
+        // Fix each axis sign so the third moment along it is positive
+        for (int c = 0; c < 2; ++c) {
+            Eigen::VectorXd proj = pos * axes.col(c);
+            if (proj.array().cube().sum() < 0.0) {
+                axes.col(c) *= -1.0;
+            }
+        }
+        // Right-handed frame: a reflection would merge enantiomers
+        axes.col(2) = axes.col(0).cross(axes.col(1));
+    }
+    
+    Eigen::MatrixXd canon = pos * axes;
+    
+    // Quantize and sort atoms into a canonical order
+    std::vector<std::tuple<std::string, long long, long long, long long, int>> atoms;
+    atoms.reserve(n);
+    for (int i = 0; i < n; ++i) {
+        atoms.emplace_back(mol.atom(i).element,
+                           std::llround(canon(i, 0) / JobKey::geometry_resolution),
+                           std::llround(canon(i, 1) / JobKey::geometry_resolution),
+                           std::llround(canon(i, 2) / JobKey::geometry_resolution),
+                           i);
+    }
+    std::sort(atoms.begin(), atoms.end());
+    
+    JobKey result;
+    uint64_t h = hash_int(hash::fnv_offset, n);
+    for (const auto& a : atoms) {
+        h = hash::combine(h, hash::fnv1a(std::get<0>(a)));
+        h = hash_int(h, std::get<1>(a));
+        h = hash_int(h, std::get<2>(a));
+        h = hash_int(h, std::get<3>(a));
+        result.order.push_back(std::get<4>(a));
+    }
+    result.key = h;
+    
+    return result;
+}
+
+} // namespace
+
+JobKey JobKey::canonical_geometry(const Molecule& mol) {
+    Eigen::RowVector3d centroid;
+    Eigen::Matrix3d axes;
+    return canonicalize(mol, centroid, axes);
+}
+
+JobKey::Source JobKey::Source::from_buffer(const std::string& contents) {
+    Source source;
+    size_t pos = 0;
+    auto next_line = [&](std::string& line) {
+        if (pos >= contents.size()) {
+            return false;
+        }
+        const size_t end = std::min(contents.find('\n', pos), contents.size());
+        line.assign(contents, pos, end - pos);
+        pos = std::min(end + 1, contents.size());
+        return true;
+    };
+    if (!read_cube_header(next_line, source)) {
+        source = Source();
+        pos = 0;
+    }
+    source.data = hash::fnv1a(contents.data() + pos, contents.size() - pos);
+    return source;
+}
+
+JobKey::Source JobKey::Source::from_file(const std::string& path) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file.is_open()) {
+        throw std::runtime_error("Cannot open file: " + path);
+    }
+    
+    Source source;
+    auto next_line = [&](std::string& line) { return bool(std::getline(file, line)); };
+    if (!read_cube_header(next_line, source)) {
+        source = Source();
+        file.clear();
+        file.seekg(0);
+    }
+    
+    source.data = hash_rest(file);
+    return source;
+}
+
+uint64_t JobKey::file_hash(const std::string& path) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file.is_open()) {
+        throw std::runtime_error("Cannot open file: " + path);
+    }
+    
+    return hash_rest(file);
+}
+
+uint64_t JobKey::options_hash(const FitOptions& options) {
+    uint64_t h = hash::fnv_offset;
+    h = hash_double(h, options.tolerance);
+    h = hash_double(h, options.lambda);
+    h = hash_int(h, options.use_symmetry);
+    h = hash_int(h, static_cast<int>(options.robust.loss));
+    h = hash_double(h, options.robust.tuning);
+    h = hash_int(h, options.robust.max_iterations);
+    h = hash_int(h, options.eem_prior);
+    h = hash_int(h, static_cast<int>(options.eem.kernel));
+    if (options.database) {
+        h = hash::combine(h, options.database->content_hash());
+    }
+    // Only hashed when non-default so existing result stores stay valid
+    if (options.rhs != QPSolver::RhsMethod::Direct) {
+        h = hash_int(h, static_cast<int>(options.rhs));
+    }
+    if (options.hessian != QPSolver::HessianMethod::Exact) {
+        h = hash_int(h, 100 + static_cast<int>(options.hessian));
+    }
+    return h;
+}
+
+JobKey JobKey::compute(const Molecule& mol, const Source& source,
+                       double total_charge, const FitOptions& options) {
+    Eigen::RowVector3d centroid;
+    Eigen::Matrix3d axes;
+    JobKey result = canonicalize(mol, centroid, axes);
+    
+    if (source.lattice) {
+        // The lattice in the geometry's canonical frame
+        result.key = hash_vector(result.key, axes.transpose() * (source.origin - centroid.transpose()));
+        for (int k = 0; k < 3; ++k) {
+            result.key = hash_int(result.key, source.counts(k));
+            result.key = hash_vector(result.key, axes.transpose() * source.steps.col(k));
+        }
+    } else {
+        // No frame to move with the geometry: the raw coordinates, in
+        // canonical atom order so reordered atom lists still match
+        for (int i : result.order) {
+            result.key = hash_vector(result.key, mol.atom(i).position);
+        }
+    }
+    result.key = hash::combine(result.key, source.data);
+    result.key = hash_double(result.key, total_charge);
+    result.key = hash::combine(result.key, options_hash(options));
+    return result;
+}
+
+} // namespace chargeopt
@@ -0,0 +1,63 @@
+#pragma once
+
+#include "fit_pipeline.hpp"
+#include "../core/molecule.hpp"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace chargeopt {
+
+// Identity of a fit for deduplication and memoization.
+//
+// The geometry is canonicalized before hashing: centered on its centroid,
+// rotated into its principal axes (axis signs fixed by the third moment,
+// kept right-handed so mirror images stay distinct), rounded to
+// geometry_resolution Bohr and sorted by (element, x, y, z). Translated or
+// rotated copies of a molecule, listed in any atom order, hash the same.
+// Near-degenerate principal moments (symmetric tops) leave the frame
+// unrotated, so rotated copies of such molecules are conservatively treated
+// as distinct rather than risking a false match.
+//
+// A fit's key (compute) takes the ESP cube in the same canonical frame: its
+// lattice origin and steps are moved by the geometry's centroid shift and
+// rotation, and its voxel data is hashed as is. A rigidly moved molecule
+// sent with its equally moved cube matches; a moved molecule sent with the
+// old cube does not. ESP sources that are not cubes are hashed as raw bytes
+// together with the raw coordinates, so only reordered atom lists match.
+struct JobKey {
+    uint64_t key = 0;
+    std::vector<int> order;  // order[k] = original index of canonical atom k
+    
+    static constexpr double geometry_resolution = 1e-3;  // Bohr
+    
+    // ESP source content, with a cube's lattice kept apart from its data
+    struct Source {
+        uint64_t data = 0;              // Voxel data, or the whole file
+        bool lattice = false;           // False if not a cube
+        Eigen::Vector3d origin = Eigen::Vector3d::Zero();  // Bohr
+        Eigen::Matrix3d steps = Eigen::Matrix3d::Zero();   // Column k: step along axis k
+        Eigen::Vector3i counts = Eigen::Vector3i::Zero();
+        
+        // File contents already in memory (e.g. from FilePrefetcher)
+        static Source from_buffer(const std::string& contents);
+        
+        // Streamed in chunks
+        static Source from_file(const std::string& path);
+    };
+    
+    // Key of a fit: geometry + ESP source content + fit settings
+    static JobKey compute(const Molecule& mol, const Source& source,
+                          double total_charge, const FitOptions& options);
+    
+    // Canonical geometry hash and atom order
+    static JobKey canonical_geometry(const Molecule& mol);
+    
+    // Content hash of a file (e.g. the cube), streamed in chunks
+    static uint64_t file_hash(const std::string& path);
+    
+    // Hash of every option that changes the fitted charges
+    static uint64_t options_hash(const FitOptions& options);
+};
+
+} // namespace chargeopt
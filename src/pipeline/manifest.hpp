@@ -0,0 +1,64 @@
+#pragma once
+
+#include "fit_pipeline.hpp"
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+namespace chargeopt {
+
+// Batch manifest: one job per line
+//   <geometry.xyz> <esp.cube> [total_charge] [output_file]
+// Blank lines and lines starting with '#' are ignored. The default output
+// file is the XYZ path with its extension replaced by "_charges.txt".
+class Manifest {
+public:
+    static std::vector<FitJob> parse(const std::string& filename) {
+        std::ifstream file(filename);
+        if (!file.is_open()) {
+            throw std::runtime_error("Cannot open manifest: " + filename);
+        }
+        
+        std::vector<FitJob> jobs;
+        std::string line;
+        int line_num = 0;
+        
+        while (std::getline(file, line)) {
+            line_num++;
+            std::istringstream iss(line);
+            FitJob job;
+            if (!(iss >> job.xyz_file) || job.xyz_file[0] == '#') {
+                continue;
+            }
+            if (!(iss >> job.cube_file)) {
+                throw std::runtime_error("Manifest line " + std::to_string(line_num) +
+                                         ": expected <xyz> <cube> [charge] [output]");
+            }
+            
+            std::string token;
+            if (iss >> token) {
+                job.total_charge = std::stod(token);
+            }
+            if (!(iss >> job.output_file)) {
+                job.output_file = default_output(job.xyz_file);
+            }
+            
+            jobs.push_back(job);
+        }
+        
+        return jobs;
+    }
+    
+    static std::string default_output(const std::string& xyz_file) {
+        size_t slash = xyz_file.find_last_of('/');
+        size_t dot = xyz_file.find_last_of('.');
+        if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) {
+            return xyz_file + "_charges.txt";
+        }
+        return xyz_file.substr(0, dot) + "_charges.txt";
+    }
+};
+
+} // namespace chargeopt
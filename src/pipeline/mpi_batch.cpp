@@ -0,0 +1,196 @@
+#include "mpi_batch.hpp"
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+namespace chargeopt {
+
+namespace {
+
+constexpr int tag_job = 1;
+constexpr int tag_result = 2;
+constexpr int tag_stop = 3;
+
+template <typename T>
+void put(std::string& out, T value) {
+    char bytes[sizeof(T)];
+    std::memcpy(bytes, &value, sizeof(T));
+    out.append(bytes, sizeof(T));
+}
+
+template <typename T>
+T take(const std::string& in, size_t& pos) {
+    if (pos + sizeof(T) > in.size()) {
+        throw std::runtime_error("Truncated MPI result message");
+    }
+    T value;
+    std::memcpy(&value, in.data() + pos, sizeof(T));
+    pos += sizeof(T);
+    return value;
+}
+
+std::string encode(const FitExecutor::Outcome& o) {
+    std::string msg;
+    put<uint64_t>(msg, o.job);
+    put<double>(msg, o.esp_rmse);
+    put<double>(msg, o.esp_max_error);
+    put<double>(msg, o.timings.parse_xyz);
+    put<double>(msg, o.timings.parse_cube);
+    put<double>(msg, o.timings.assemble);
+    put<double>(msg, o.timings.solve);
+    put<double>(msg, o.timings.validate);
+    put<uint64_t>(msg, o.charges.size());
+    for (double q : o.charges) {
+        put<double>(msg, q);
+    }
+    put<uint64_t>(msg, o.error.size());
+    msg += o.error;
+    return msg;
+}
+
+FitExecutor::Outcome decode(const std::string& msg) {
+    FitExecutor::Outcome o;
+    size_t pos = 0;
+    o.job = take<uint64_t>(msg, pos);
+    o.esp_rmse = take<double>(msg, pos);
+    o.esp_max_error = take<double>(msg, pos);
+    o.timings.parse_xyz = take<double>(msg, pos);
+    o.timings.parse_cube = take<double>(msg, pos);
+    o.timings.assemble = take<double>(msg, pos);
+    o.timings.solve = take<double>(msg, pos);
+    o.timings.validate = take<double>(msg, pos);
+    o.charges.resize(take<uint64_t>(msg, pos));
+    for (double& q : o.charges) {
+        q = take<double>(msg, pos);
+    }
+    const size_t length = take<uint64_t>(msg, pos);
+    o.error = msg.substr(pos, length);
+    return o;
+}
+
+} // namespace
+
+MpiSession::MpiSession(int& argc, char**& argv) {
+    MPI_Init(&argc, &argv);
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank_);
+    MPI_Comm_size(MPI_COMM_WORLD, &size_);
+}
+
+MpiSession::~MpiSession() {
+    MPI_Finalize();
+}
+
+MpiFitExecutor::MpiFitExecutor(MPI_Comm comm) : comm_(comm) {
+    int size = 1;
+    MPI_Comm_size(comm_, &size);
+    for (int r = size - 1; r >= 1; --r) {
+        idle_.push_back(r);
+    }
+}
+
+MpiFitExecutor::~MpiFitExecutor() {
+    shutdown();
+}
+
+void MpiFitExecutor::submit(size_t index, const FitJob&) {
+    if (idle_.empty()) {
+        throw std::runtime_error("MpiFitExecutor: no idle worker");
+    }
+    const int worker = idle_.back();
+    idle_.pop_back();
+    uint64_t job = index;
+    MPI_Send(&job, 1, MPI_UINT64_T, worker, tag_job, comm_);
+    outstanding_++;
+}
+
+bool MpiFitExecutor::wait(Outcome& outcome) {
+    if (outstanding_ == 0) {
+        return false;
+    }
+    MPI_Status status;
+    MPI_Probe(MPI_ANY_SOURCE, tag_result, comm_, &status);
+    int bytes = 0;
+    MPI_Get_count(&status, MPI_BYTE, &bytes);
+    std::string msg(bytes, '\0');
+    MPI_Recv(&msg[0], bytes, MPI_BYTE, status.MPI_SOURCE, tag_result, comm_, MPI_STATUS_IGNORE);
+    
+    outstanding_--;
+    idle_.push_back(status.MPI_SOURCE);
+    outcome = decode(msg);
+    return true;
+}
+
+void MpiFitExecutor::shutdown() {
+    if (stopped_) return;
+    stopped_ = true;
+    
+    // Drain fits still in flight (only after an error on rank 0)
+    Outcome ignored;
+    while (wait(ignored)) {
+    }
+    int size = 1;
+    MPI_Comm_size(comm_, &size);
+    uint64_t none = 0;
+    for (int r = 1; r < size; ++r) {
+        MPI_Send(&none, 1, MPI_UINT64_T, r, tag_stop, comm_);
+    }
+}
+
+void MpiBatchRunner::serve(const std::vector<FitJob>& jobs, const FitOptions& options,
+                           MPI_Comm comm) {
+    std::ostream quiet(nullptr);
+    for (;;) {
+        uint64_t index = 0;
+        MPI_Status status;
+        MPI_Recv(&index, 1, MPI_UINT64_T, 0, MPI_ANY_TAG, comm, &status);
+        if (status.MPI_TAG == tag_stop) {
+            break;
+        }
+        
+        FitExecutor::Outcome outcome;
+        if (index < jobs.size()) {
+            outcome = LocalFitExecutor::fit(index, jobs[index], options, quiet);
+        } else {
+            outcome.job = index;
+            outcome.error = "job index out of range on worker";
+        }
+        std::string msg = encode(outcome);
+        MPI_Send(msg.data(), static_cast<int>(msg.size()), MPI_BYTE, 0, tag_result, comm);
+    }
+}
+
+size_t MpiBatchRunner::run(const std::vector<FitJob>& jobs, const FitOptions& options,
+                           const BatchRunner::Config& config, MPI_Comm comm) {
+    int rank = 0, size = 1;
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &size);
+    
+    if (size == 1) {
+        return BatchRunner(options, config).run(jobs);
+    }
+    
+    uint64_t failed = 0;
+    std::string error;
+    if (rank == 0) {
+        MpiFitExecutor executor(comm);
+        try {
+            BatchRunner runner(options, config);
+            failed = runner.run(jobs, executor);
+        } catch (const std::exception& e) {
+            // Workers must still be released and join the final broadcast
+            error = e.what();
+            failed = jobs.size();
+        }
+        executor.shutdown();
+    } else {
+        serve(jobs, options, comm);
+    }
+    
+    MPI_Bcast(&failed, 1, MPI_UINT64_T, 0, comm);
+    if (!error.empty()) {
+        throw std::runtime_error(error);
+    }
+    return failed;
+}
+
+} // namespace chargeopt
@@ -0,0 +1,63 @@
+#pragma once
+
+#include "batch_runner.hpp"
+#include <mpi.h>
+#include <vector>
+
+namespace chargeopt {
+
+// MPI_Init / MPI_Finalize for the lifetime of main() (CHARGEOPT_USE_MPI)
+class MpiSession {
+public:
+    MpiSession(int& argc, char**& argv);
+    ~MpiSession();
+    
+    MpiSession(const MpiSession&) = delete;
+    MpiSession& operator=(const MpiSession&) = delete;
+    
+    int rank() const { return rank_; }
+    int size() const { return size_; }
+    bool is_root() const { return rank_ == 0; }
+
+private:
+    int rank_ = 0;
+    int size_ = 1;
+};
+
+// Hands fits to idle worker ranks, one job at a time, so faster workers
+// simply take more jobs. Lives on rank 0.
+class MpiFitExecutor : public FitExecutor {
+public:
+    explicit MpiFitExecutor(MPI_Comm comm = MPI_COMM_WORLD);
+    ~MpiFitExecutor() override;
+    
+    bool has_capacity() const override { return !idle_.empty(); }
+    bool remote() const override { return true; }
+    void submit(size_t index, const FitJob& job) override;
+    bool wait(Outcome& outcome) override;
+    
+    // Releases the workers from MpiBatchRunner::serve; idempotent
+    void shutdown();
+
+private:
+    MPI_Comm comm_;
+    std::vector<int> idle_;
+    size_t outstanding_ = 0;
+    bool stopped_ = false;
+};
+
+// Batch mode across the ranks of comm. Rank 0 keys and deduplicates the
+// jobs, shards the distinct fits dynamically and writes every output,
+// the result store, journal and sinks; the other ranks only fit. Every
+// rank must pass the same job list. Returns the failed count on all ranks.
+class MpiBatchRunner {
+public:
+    static size_t run(const std::vector<FitJob>& jobs, const FitOptions& options,
+                      const BatchRunner::Config& config, MPI_Comm comm = MPI_COMM_WORLD);
+    
+    // Worker loop for ranks > 0
+    static void serve(const std::vector<FitJob>& jobs, const FitOptions& options,
+                      MPI_Comm comm = MPI_COMM_WORLD);
+};
+
+} // namespace chargeopt
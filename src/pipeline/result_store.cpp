@@ -0,0 +1,61 @@
+#include "result_store.hpp"
+#include <iomanip>
+#include <sstream>
+#include <stdexcept>
+
+namespace chargeopt {
+
+ResultStore::ResultStore(const std::string& path) : path_(path) {
+    std::ifstream in(path);
+    std::string line;
+    while (std::getline(in, line)) {
+        std::istringstream iss(line);
+        std::string key_hex;
+        size_t n = 0;
+        Entry entry;
+        if (!(iss >> key_hex >> n >> entry.esp_rmse >> entry.esp_max_error)) {
+            continue;
+        }
+        entry.charges.resize(n);
+        bool ok = true;
+        for (size_t i = 0; i < n && ok; ++i) {
+            ok = static_cast<bool>(iss >> entry.charges[i]);
+        }
+        if (ok) {
+            entries_[std::stoull(key_hex, nullptr, 16)] = entry;
+        }
+    }
+    
+    out_.open(path, std::ios::app);
+    if (!out_.is_open()) {
+        throw std::runtime_error("Cannot open result store: " + path);
+    }
+}
+
+const ResultStore::Entry* ResultStore::find(uint64_t key) const {
+    auto it = entries_.find(key);
+    return it == entries_.end() ? nullptr : &it->second;
+}
+
+void ResultStore::insert(uint64_t key, const Entry& entry) {
+    entries_[key] = entry;
+    
+    if (!out_.is_open()) {
+        return;
+    }
+    
+    std::ostringstream line;
+    line << std::hex << std::setw(16) << std::setfill('0') << key << std::dec << std::setfill(' ')
+         << " " << entry.charges.size()
+         << std::setprecision(17)
+         << " " << entry.esp_rmse << " " << entry.esp_max_error;
+    for (double q : entry.charges) {
+        line << " " << q;
+    }
+    line << "\n";
+    
+    // One write per line keeps records whole on a crash
+    out_ << line.str() << std::flush;
+}
+
+} // namespace chargeopt
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <fstream>
+
+namespace chargeopt {
+
+// Persistent memo of finished fits, keyed by JobKey.
+//
+// Append-only text file, one fit per line:
+//   <key hex> <n_atoms> <esp_rmse> <esp_max_error> <q_0> ... <q_n-1>
+// Charges are stored in the canonical atom order of the key so any
+// duplicate (reordered, translated, rotated) can be mapped back.
+// Lines that fail to parse (e.g. a torn final write) are skipped.
+class ResultStore {
+public:
+    struct Entry {
+        std::vector<double> charges;  // Canonical atom order
+        double esp_rmse = 0.0;
+        double esp_max_error = 0.0;
+    };
+    
+    ResultStore() {}
+    
+    // Load existing results; later appends go to the same file
+    explicit ResultStore(const std::string& path);
+    
+    const Entry* find(uint64_t key) const;
+    
+    // Record a result in memory and, if backed by a file, append it
+    void insert(uint64_t key, const Entry& entry);
+    
+    size_t size() const { return entries_.size(); }
+
+private:
+    std::string path_;
+    std::ofstream out_;
+    std::unordered_map<uint64_t, Entry> entries_;
+};
+
+} // namespace chargeopt
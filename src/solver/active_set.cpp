@@ -16,6 +16,26 @@ Eigen::VectorXd ActiveSetSolver::solve_unconstrained(const Eigen::MatrixXd& H,
     return llt.solve(-f);
 }
 
+Eigen::MatrixXd ActiveSetSolver::build_kkt_matrix(const Eigen::MatrixXd& H,
+                                                  const Constraints& constraints) {
+    const Eigen::MatrixXd& A = constraints.A_eq();
+    const int n = H.rows();
+    const int m = A.rows();
+    
+    if (m == 0) {
+        return H;
+    }
+    
+    Eigen::MatrixXd KKT(n + m, n + m);
+    KKT.setZero();
+    
+    KKT.topLeftCorner(n, n) = H;
+    KKT.topRightCorner(n, m) = A.transpose();
+    KKT.bottomLeftCorner(m, n) = A;
+    
+    return KKT;
+}
+
 Eigen::VectorXd ActiveSetSolver::solve_equality_constrained(const Eigen::MatrixXd& H,
                                                             const Eigen::VectorXd& f,
                                                             const Constraints& constraints) {
@@ -37,12 +57,7 @@ Eigen::VectorXd ActiveSetSolver::solve_equality_constrained(const Eigen::MatrixX
     }
     
     // Build KKT system
-    Eigen::MatrixXd KKT(n + m, n + m);
-    KKT.setZero();
-    
-    KKT.topLeftCorner(n, n) = H;
-    KKT.topRightCorner(n, m) = A.transpose();
-    KKT.bottomLeftCorner(m, n) = A;
+    Eigen::MatrixXd KKT = build_kkt_matrix(H, constraints);
     
     Eigen::VectorXd rhs(n + m);
     rhs.head(n) = -f;
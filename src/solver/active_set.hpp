@@ -14,6 +14,11 @@ public:
     QPSolution solve(const Eigen::MatrixXd& H,
                     const Eigen::VectorXd& f,
                     const Constraints& constraints);
+    
+    // KKT matrix [H A^T; A 0] for the equality-constrained problem
+    // (just H when there are no constraints)
+    static Eigen::MatrixXd build_kkt_matrix(const Eigen::MatrixXd& H,
+                                            const Constraints& constraints);
 
 private:
     double tol_;
@@ -0,0 +1,92 @@
+#include "charge_derivatives.hpp"
+#include "active_set.hpp"
+#include "../core/coulomb_kernel.hpp"
+#include <iostream>
+
+namespace chargeopt {
+
+Eigen::MatrixXd ChargeDerivatives::compute(const Molecule& mol,
+                                           const ESPGrid& grid,
+                                           const Constraints& constraints,
+                                           QPSolution* solution) const {
+    const int n_atoms = mol.num_atoms();
+    const int m = constraints.num_constraints();
+    
+    // Same formulation as QPSolver::build_esp_matrices:
+    //   A_n = A D^-1 (column-normalized), s_j = ||A_j||
+    //   H = 2 A_n^T A_n,  f_j = -2 (A_j . V) / s_j^2
+    const Eigen::MatrixXd points = grid.positions();
+    Eigen::MatrixXd A = QPSolver::build_design_matrix(mol, grid);
+    const Eigen::VectorXd V = grid.potentials();
+    
+    Eigen::VectorXd scale = A.colwise().norm().transpose();
+    Eigen::VectorXd AtV = A.transpose() * V;
+    for (int j = 0; j < n_atoms; ++j) {
+        A.col(j) /= scale(j);
+    }
+    
+    Eigen::MatrixXd H = 2.0 * (A.transpose() * A);
+    Eigen::VectorXd f(n_atoms);
+    for (int j = 0; j < n_atoms; ++j) {
+        f(j) = -2.0 * AtV(j) / (scale(j) * scale(j));
+    }
+    
+    // Prior charges (held fixed) only shift f
+    if (config_.reference_charges.size() == n_atoms) {
+        f -= 2.0 * config_.regularization * config_.reference_charges;
+    }
+    
+    QPSolver qp(config_);
+    Eigen::MatrixXd KKT = ActiveSetSolver::build_kkt_matrix(qp.regularized_hessian(H), constraints);
+    Eigen::FullPivLU<Eigen::MatrixXd> lu(KKT);
+    
+    Eigen::VectorXd rhs(n_atoms + m);
+    rhs.head(n_atoms) = -f;
+    if (m > 0) rhs.tail(m) = constraints.b_eq();
+    Eigen::VectorXd q = lu.solve(rhs).head(n_atoms);
+    
+    if (solution) {
+        solution->charges = q;
+        solution->converged = constraints.is_satisfied(q, config_.tolerance);
+        solution->iterations = 1;
+        solution->objective_value = 0.5 * q.dot(qp.regularized_hessian(H) * q) + f.dot(q);
+    }
+    
+    // Fitted ESP at the grid in the normalized basis
+    const Eigen::VectorXd y = A * q;
+    
+    // Right-hand sides -(dH q + df), one column per coordinate.
+    // Moving atom a only changes column a of A.
+    Eigen::MatrixXd rhs_d = Eigen::MatrixXd::Zero(n_atoms + m, 3 * n_atoms);
+    
+    for (int a = 0; a < n_atoms; ++a) {
+        const double s = scale(a);
+        const Eigen::MatrixXd dA = CoulombKernel::site_gradient(points, mol.atom(a).position);
+        
+        // ds = A_n(:,a)^T dA ;  dA_n = (dA - A_n(:,a) ds^T) / s
+        const Eigen::Vector3d ds = dA.transpose() * A.col(a);
+        const Eigen::MatrixXd dAn = (dA - A.col(a) * ds.transpose()) / s;
+        
+        // dH q = 2 e_a (dA_n^T A_n q) + 2 A_n^T dA_n q_a
+        Eigen::MatrixXd dHq = (2.0 * q(a)) * (A.transpose() * dAn);
+        dHq.row(a) += 2.0 * (dAn.transpose() * y).transpose();
+        
+        // df_a = -2 (dA . V) / s^2 + 4 (A_a . V) ds / s^3
+        const Eigen::Vector3d df = -2.0 * (dA.transpose() * V) / (s * s)
+                                 + 4.0 * AtV(a) * ds / (s * s * s);
+        dHq.row(a) += df.transpose();
+        
+        rhs_d.block(0, 3 * a, n_atoms, 3) = -dHq;
+    }
+    
+    Eigen::MatrixXd dx = lu.solve(rhs_d);
+    
+    if (config_.verbose) {
+        std::cout << "  Charge derivatives: " << 3 * n_atoms << " x " << n_atoms
+                  << " Jacobian from one KKT factorization" << std::endl;
+    }
+    
+    return dx.topRows(n_atoms).transpose();
+}
+
+} // namespace chargeopt
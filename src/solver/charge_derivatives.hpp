@@ -0,0 +1,40 @@
+#pragma once
+
+#include "../core/molecule.hpp"
+#include "../core/esp_grid.hpp"
+#include "constraints.hpp"
+#include "qp_solver.hpp"
+#include <Eigen/Dense>
+
+namespace chargeopt {
+
+// Analytic derivatives of fitted charges with respect to nuclear coordinates.
+//
+// Differentiates the KKT system solved by ActiveSetSolver,
+//   [H  A^T] [q]   [-f]
+//   [A   0 ] [λ] = [ b]
+// with the grid and constraints held fixed:
+//   K d[q;λ] = [-(dH q + df); 0]
+// The KKT matrix is factorized once and all 3N right-hand sides are
+// solved in a single call. H and f are the exact least-squares ones, so
+// this is the Jacobian of a plain fit only, not of a robust (IRLS) fit or
+// one assembled with the FFT right-hand side or quadrature Hessian.
+class ChargeDerivatives {
+public:
+    ChargeDerivatives(const QPSolver::Config& config = QPSolver::Config())
+        : config_(config) {}
+    
+    // Returns the 3N x N Jacobian dq/dR (e/Bohr).
+    // Row 3*a + c is the derivative of all charges with respect to
+    // coordinate c (x, y, z) of atom a.
+    // If solution is non-null it receives the fitted charges.
+    Eigen::MatrixXd compute(const Molecule& mol,
+                            const ESPGrid& grid,
+                            const Constraints& constraints,
+                            QPSolution* solution = nullptr) const;
+
+private:
+    QPSolver::Config config_;
+};
+
+} // namespace chargeopt
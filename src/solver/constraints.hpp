@@ -33,6 +33,18 @@ public:
         b_eq_(b_eq_.size() - 1) = 0.0;
     }
     
+    // Add equality constraint: charge[i] = value (e.g. from a charge database)
+    void add_fixed_charge_constraint(int i, double value, int num_atoms) {
+        Eigen::VectorXd a = Eigen::VectorXd::Zero(num_atoms);
+        a(i) = 1.0;
+        
+        A_eq_.conservativeResize(A_eq_.rows() + 1, num_atoms);
+        A_eq_.row(A_eq_.rows() - 1) = a;
+        
+        b_eq_.conservativeResize(b_eq_.size() + 1);
+        b_eq_(b_eq_.size() - 1) = value;
+    }
+    
     const Eigen::MatrixXd& A_eq() const { return A_eq_; }
     const Eigen::VectorXd& b_eq() const { return b_eq_; }
     
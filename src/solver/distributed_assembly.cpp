@@ -0,0 +1,44 @@
+#include "distributed_assembly.hpp"
+#include "qp_solver.hpp"
+#include <stdexcept>
+
+namespace chargeopt {
+
+void DistributedAssembly::slice(size_t num_points, int rank, int size,
+                                size_t& begin, size_t& end) {
+    begin = num_points * rank / size;
+    end = num_points * (rank + 1) / size;
+}
+
+void DistributedAssembly::build_esp_matrices(const Molecule& mol,
+                                             const ESPGrid& grid,
+                                             Eigen::MatrixXd& H,
+                                             Eigen::VectorXd& f,
+                                             MPI_Comm comm) {
+    int rank = 0, size = 1;
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &size);
+    
+    const int n_atoms = mol.num_atoms();
+    size_t begin, end;
+    slice(grid.num_points(), rank, size, begin, end);
+    
+    Eigen::MatrixXd G = Eigen::MatrixXd::Zero(n_atoms, n_atoms);
+    Eigen::VectorXd g = Eigen::VectorXd::Zero(n_atoms);
+    QPSolver::accumulate_normal_equations(mol, grid, begin, end, G, g);
+    
+    // G and g travel together so one collective suffices
+    Eigen::VectorXd packed(G.size() + g.size());
+    packed.head(G.size()) = Eigen::Map<const Eigen::VectorXd>(G.data(), G.size());
+    packed.tail(g.size()) = g;
+    if (MPI_Allreduce(MPI_IN_PLACE, packed.data(), static_cast<int>(packed.size()),
+                      MPI_DOUBLE, MPI_SUM, comm) != MPI_SUCCESS) {
+        throw std::runtime_error("MPI_Allreduce failed during ESP assembly");
+    }
+    G = Eigen::Map<const Eigen::MatrixXd>(packed.data(), n_atoms, n_atoms);
+    g = packed.tail(n_atoms);
+    
+    QPSolver::finalize_esp_matrices(G, g, H, f);
+}
+
+} // namespace chargeopt
@@ -0,0 +1,26 @@
+#pragma once
+
+#include "../core/molecule.hpp"
+#include "../core/esp_grid.hpp"
+#include <Eigen/Dense>
+#include <mpi.h>
+
+namespace chargeopt {
+
+// ESP normal equations assembled across MPI ranks (CHARGEOPT_USE_MPI).
+// Every rank holds the full grid and streams its contiguous slice of
+// points; the partial A^T A and A^T V are summed with one allreduce and
+// every rank finalizes the same H, f. All ranks of comm must call it.
+class DistributedAssembly {
+public:
+    static void build_esp_matrices(const Molecule& mol,
+                                   const ESPGrid& grid,
+                                   Eigen::MatrixXd& H,
+                                   Eigen::VectorXd& f,
+                                   MPI_Comm comm = MPI_COMM_WORLD);
+    
+    // Grid points [begin, end) handled by rank of size ranks
+    static void slice(size_t num_points, int rank, int size, size_t& begin, size_t& end);
+};
+
+} // namespace chargeopt
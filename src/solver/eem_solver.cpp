@@ -0,0 +1,80 @@
+#include "eem_solver.hpp"
+#include "active_set.hpp"
+#include "../core/coulomb_kernel.hpp"
+#include <iostream>
+#include <stdexcept>
+
+namespace chargeopt {
+
+EEMSolver::Parameters EEMSolver::parameters(const std::string& element) {
+    constexpr double ev_to_hartree = 1.0 / 27.211386;
+    
+    // QEq electronegativity and idempotential (eV)
+    double chi, hardness;
+    if (element == "H")       { chi = 4.528;  hardness = 13.890; }
+    else if (element == "C")  { chi = 5.343;  hardness = 10.126; }
+    else if (element == "N")  { chi = 6.899;  hardness = 11.760; }
+    else if (element == "O")  { chi = 8.741;  hardness = 13.364; }
+    else if (element == "F")  { chi = 10.874; hardness = 14.948; }
+    else if (element == "P")  { chi = 5.463;  hardness = 8.000;  }
+    else if (element == "S")  { chi = 6.928;  hardness = 8.972;  }
+    else if (element == "Cl") { chi = 8.564;  hardness = 9.892;  }
+    else {
+        throw std::runtime_error("No EEM parameters for element: " + element);
+    }
+    
+    return {chi * ev_to_hartree, hardness * ev_to_hartree};
+}
+
+EEMSolver::Kernel EEMSolver::parse_kernel(const std::string& name) {
+    if (name == "coulomb" || name == "dense") return Kernel::Coulomb;
+    if (name == "screened") return Kernel::Screened;
+    throw std::runtime_error("Unknown EEM kernel: " + name);
+}
+
+Eigen::VectorXd EEMSolver::electronegativities(const Molecule& mol) {
+    Eigen::VectorXd chi(mol.num_atoms());
+    for (size_t i = 0; i < mol.num_atoms(); ++i) {
+        chi(i) = parameters(mol.atom(i).element).chi;
+    }
+    return chi;
+}
+
+Eigen::MatrixXd EEMSolver::hardness_matrix(const Molecule& mol) const {
+    const int n = mol.num_atoms();
+    const Eigen::MatrixXd sites = mol.positions();
+    
+    Eigen::ArrayXd J(n);
+    for (int i = 0; i < n; ++i) {
+        J(i) = parameters(mol.atom(i).element).hardness;
+    }
+    
+    Eigen::MatrixXd H(n, n);
+    for (int j = 0; j < n; ++j) {
+        if (config_.kernel == Kernel::Screened) {
+            // Ohno screening length a_ij = 2 / (J_i + J_j)
+            Eigen::ArrayXd a = 2.0 / (J + J(j));
+            H.col(j) = CoulombKernel::screened_column(sites, sites.row(j).transpose(), a);
+        } else {
+            H.col(j) = CoulombKernel::potential_column(sites, sites.row(j).transpose());
+        }
+    }
+    H.diagonal() = J.matrix();
+    
+    return H;
+}
+
+QPSolution EEMSolver::solve(const Molecule& mol, const Constraints& constraints) const {
+    Eigen::MatrixXd H = hardness_matrix(mol);
+    Eigen::VectorXd chi = electronegativities(mol);
+    
+    if (config_.verbose) {
+        std::cout << "EEM/QEq charge model" << std::endl;
+        std::cout << "  Kernel: " << (config_.kernel == Kernel::Screened ? "screened (Ohno)" : "Coulomb") << std::endl;
+    }
+    
+    ActiveSetSolver solver(1e-6, 1, config_.verbose);
+    return solver.solve(H, chi, constraints);
+}
+
+} // namespace chargeopt
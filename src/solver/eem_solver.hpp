@@ -0,0 +1,59 @@
+#pragma once
+
+#include "../core/molecule.hpp"
+#include "constraints.hpp"
+#include "qp_solver.hpp"
+#include <Eigen/Dense>
+#include <string>
+
+namespace chargeopt {
+
+// Electronegativity equalization (EEM / QEq) charge model.
+//
+// Minimizes the charge-dependent energy
+//   E(q) = sum_i (chi_i q_i + 1/2 J_i q_i^2) + sum_{i<j} J_ij q_i q_j
+// subject to the same Constraints used by the ESP fit (total charge,
+// optional symmetry). This is an equality-constrained QP with H = J and
+// f = chi, so it is solved with one (N+m) KKT system by ActiveSetSolver.
+// No ESP grid is needed.
+//
+// Parameters are the QEq set of Rappe & Goddard (J. Phys. Chem. 1991),
+// converted from eV to atomic units.
+class EEMSolver {
+public:
+    enum class Kernel {
+        Coulomb,   // Bare 1/r between sites (classical EEM; needs well-separated atoms)
+        Screened   // Ohno: 1/sqrt(r^2 + a_ij^2), a_ij = 2/(J_i + J_j)
+    };
+    
+    struct Config {
+        Kernel kernel = Kernel::Screened;
+        bool verbose = false;
+        
+        Config() {}
+    };
+    
+    struct Parameters {
+        double chi;       // Electronegativity (Hartree/e)
+        double hardness;  // Idempotential J (Hartree/e^2)
+    };
+    
+    EEMSolver(const Config& config = Config()) : config_(config) {}
+    
+    // Charges for the molecule under the given constraints
+    QPSolution solve(const Molecule& mol, const Constraints& constraints) const;
+    
+    // Hardness matrix J (diagonal J_i, off-diagonal shielded Coulomb)
+    Eigen::MatrixXd hardness_matrix(const Molecule& mol) const;
+    
+    // Electronegativity vector chi
+    static Eigen::VectorXd electronegativities(const Molecule& mol);
+    
+    static Parameters parameters(const std::string& element);
+    static Kernel parse_kernel(const std::string& name);
+
+private:
+    Config config_;
+};
+
+} // namespace chargeopt
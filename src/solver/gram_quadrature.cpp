@@ -0,0 +1,198 @@
+#include "gram_quadrature.hpp"
+#include "qp_solver.hpp"
+#include "../core/coulomb_kernel.hpp"
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <vector>
+
+namespace chargeopt {
+
+namespace {
+
+// Gauss-Legendre nodes and weights on [-1, 1]
+void gauss_legendre(int order, double* x, double* w) {
+    switch (order) {
+        case 1:
+            x[0] = 0.0; w[0] = 2.0;
+            break;
+        case 2:
+            x[0] = -1.0 / std::sqrt(3.0); x[1] = -x[0];
+            w[0] = w[1] = 1.0;
+            break;
+        case 3:
+            x[0] = -std::sqrt(0.6); x[1] = 0.0; x[2] = -x[0];
+            w[0] = w[2] = 5.0 / 9.0; w[1] = 8.0 / 9.0;
+            break;
+        case 4:
+            x[0] = -0.8611363115940526; x[1] = -0.3399810435848563;
+            x[2] = -x[1]; x[3] = -x[0];
+            w[0] = w[3] = 0.3478548451374538;
+            w[1] = w[2] = 0.6521451548625461;
+            break;
+        default:
+            throw std::runtime_error("Gram quadrature: order must be 1-4");
+    }
+}
+
+// Octree cell in lattice-index coordinates
+struct Cell {
+    Eigen::Vector3d center;
+    Eigen::Vector3d half;
+};
+
+} // namespace
+
+bool GramQuadrature::accumulate(const Molecule& mol,
+                                const ESPGrid& grid,
+                                Eigen::MatrixXd& G_lower,
+                                const Config& config,
+                                Stats* stats) {
+    if (!supported(grid)) {
+        throw std::runtime_error("Gram quadrature needs a grid read from a cube file");
+    }
+    double gx[4], gw[4];
+    gauss_legendre(config.order, gx, gw);
+    
+    const GridLattice& lattice = grid.lattice();
+    const Eigen::Matrix3d to_x = lattice.axes.transpose();   // x = origin + to_x u
+    const Eigen::Vector3d step = lattice.axes.rowwise().norm();
+    const Eigen::MatrixXd sites = mol.positions();
+    const double R = config.exclusion_radius;
+    const int m = std::max(1, config.indicator_samples);
+    
+    Stats local;
+    std::vector<Eigen::Vector3d> points;
+    std::vector<double> weights;
+    
+    // Root cells about 2 Bohr across covering the midpoint cells of all
+    // nodes, u in [-1/2, n - 1/2]
+    std::vector<Cell> stack;
+    int roots[3];
+    Eigen::Vector3d root_half;
+    for (int a = 0; a < 3; ++a) {
+        roots[a] = std::max(1, static_cast<int>(std::ceil(lattice.dims[a] * step(a) / 2.0)));
+        root_half(a) = 0.5 * lattice.dims[a] / roots[a];
+    }
+    for (int i = 0; i < roots[0]; ++i) {
+        for (int j = 0; j < roots[1]; ++j) {
+            for (int k = 0; k < roots[2]; ++k) {
+                Eigen::Vector3d corner(i, j, k);
+                stack.push_back({(2.0 * corner.array() + 1.0).matrix().cwiseProduct(root_half)
+                                 - Eigen::Vector3d::Constant(0.5), root_half});
+            }
+        }
+    }
+    
+    std::vector<int> near;
+    while (!stack.empty()) {
+        const Cell cell = stack.back();
+        stack.pop_back();
+        
+        // rho: distance from the center to the farthest corner (the cell
+        // is a parallelepiped in x); size: longest edge
+        const Eigen::Vector3d xc = lattice.origin + to_x * cell.center;
+        double rho = 0.0;
+        for (int c = 0; c < 4; ++c) {
+            Eigen::Vector3d corner(cell.half(0), (c & 1) ? cell.half(1) : -cell.half(1),
+                                   (c & 2) ? cell.half(2) : -cell.half(2));
+            rho = std::max(rho, (to_x * corner).norm());
+        }
+        const double size = 2.0 * cell.half.cwiseProduct(step).maxCoeff();
+        const Eigen::ArrayXd d = (sites.rowwise() - xc.transpose()).rowwise().norm().array();
+        
+        if ((d + rho < R).any()) continue;     // Entirely inside an exclusion sphere
+        const bool cut = (d - rho < R).any();
+        
+        if (cut ? size > config.min_cell : size > config.eta * d.minCoeff()) {
+            const Eigen::Vector3d half = 0.5 * cell.half;
+            for (int c = 0; c < 8; ++c) {
+                Eigen::Vector3d sign((c & 1) ? 1.0 : -1.0, (c & 2) ? 1.0 : -1.0, (c & 4) ? 1.0 : -1.0);
+                stack.push_back({cell.center + sign.cwiseProduct(half), half});
+            }
+            continue;
+        }
+        
+        const double volume = 8.0 * cell.half.prod();
+        local.cells++;
+        
+        if (cut) {
+            // Volume and centroid of the part outside every sphere
+            near.clear();
+            for (Eigen::Index j = 0; j < d.size(); ++j) {
+                if (d(j) - rho < R) near.push_back(j);
+            }
+            int outside = 0;
+            Eigen::Vector3d centroid = Eigen::Vector3d::Zero();
+            for (int i = 0; i < m; ++i) {
+                for (int j = 0; j < m; ++j) {
+                    for (int k = 0; k < m; ++k) {
+                        const Eigen::Vector3d t((2.0 * i + 1.0) / m - 1.0,
+                                                (2.0 * j + 1.0) / m - 1.0,
+                                                (2.0 * k + 1.0) / m - 1.0);
+                        const Eigen::Vector3d x = lattice.origin
+                            + to_x * (cell.center + cell.half.cwiseProduct(t));
+                        bool excluded = false;
+                        for (int a : near) {
+                            if ((x - sites.row(a).transpose()).norm() < R) {
+                                excluded = true;
+                                break;
+                            }
+                        }
+                        if (!excluded) {
+                            outside++;
+                            centroid += x;
+                        }
+                    }
+                }
+            }
+            local.cut_cells++;
+            if (outside == 0) continue;
+            points.push_back(centroid / outside);
+            weights.push_back(volume * outside / (m * m * m));
+            continue;
+        }
+        
+        for (int i = 0; i < config.order; ++i) {
+            for (int j = 0; j < config.order; ++j) {
+                for (int k = 0; k < config.order; ++k) {
+                    const Eigen::Vector3d t(gx[i], gx[j], gx[k]);
+                    points.push_back(lattice.origin + to_x * (cell.center + cell.half.cwiseProduct(t)));
+                    weights.push_back(volume / 8.0 * gw[i] * gw[j] * gw[k]);
+                }
+            }
+        }
+    }
+    
+    for (double w : weights) local.estimated_points += w;
+    local.quadrature_points = points.size();
+    if (stats) *stats = local;
+    
+    const double n_points = static_cast<double>(grid.num_points());
+    if (std::abs(local.estimated_points - n_points) > config.max_count_error * n_points) {
+        return false;
+    }
+    
+    // G += U^T U with U(i, j) = sqrt(w_i) / |x_i - s_j|, streamed in blocks
+    const int n_atoms = mol.num_atoms();
+    const size_t block_rows = QPSolver::default_block_rows;
+    Eigen::MatrixXd P, U;
+    for (size_t b = 0; b < points.size(); b += block_rows) {
+        const size_t rows = std::min(block_rows, points.size() - b);
+        P.resize(rows, 3);
+        Eigen::VectorXd sqrt_w(rows);
+        for (size_t i = 0; i < rows; ++i) {
+            P.row(i) = points[b + i];
+            sqrt_w(i) = std::sqrt(weights[b + i]);
+        }
+        U.resize(rows, n_atoms);
+        for (int j = 0; j < n_atoms; ++j) {
+            U.col(j) = CoulombKernel::potential_column(P, sites.row(j).transpose()).cwiseProduct(sqrt_w);
+        }
+        G_lower.selfadjointView<Eigen::Lower>().rankUpdate(U.transpose());
+    }
+    
+    return true;
+}
+
+} // namespace chargeopt
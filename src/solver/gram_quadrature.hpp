@@ -0,0 +1,63 @@
+#pragma once
+
+#include "../core/molecule.hpp"
+#include "../core/esp_grid.hpp"
+#include <Eigen/Dense>
+
+namespace chargeopt {
+
+// G_jk = sum_i 1/(r_ij r_ik) over the accepted points of a cube lattice,
+// approximated by the volume integral the lattice sum discretizes:
+//
+//   G_jk ~ integral over Omega of du / (|x(u) - s_j| |x(u) - s_k|)
+//
+// in lattice-index coordinates u (one unit volume per node), where Omega is
+// the box of midpoint cells around the nodes minus the exclusion spheres
+// CubeParser applies around each nucleus. The integral is evaluated on an
+// adaptive octree whose cells shrink with the distance to the nearest atom,
+// so the cost depends on the molecule and the box size, not on the cube
+// resolution:
+//   - cells clear of every sphere: tensor Gauss-Legendre rule
+//   - cells cut by a sphere surface: refined down to min_cell, then one
+//     point at the centroid of the outside part, weighted by its sampled
+//     volume
+//   - cells inside a sphere: skipped
+//
+// The lattice sum itself resolves the sphere surfaces only to one lattice
+// step, so agreement improves as the cube gets finer.
+class GramQuadrature {
+public:
+    struct Config {
+        double exclusion_radius = 1.5;  // Bohr; as CubeParser
+        double eta = 0.8;               // Max cell size relative to distance from nearest atom
+        double min_cell = 0.25;         // Bohr; smallest cell across a sphere surface
+        int order = 2;                  // Gauss-Legendre points per axis (1-4)
+        int indicator_samples = 6;      // Per axis, for the volume of cut cells
+        double max_count_error = 0.02;  // Tolerated |volume - point count| / point count
+        
+        Config() {}
+    };
+    
+    struct Stats {
+        size_t cells = 0;               // Leaf cells used
+        size_t cut_cells = 0;
+        size_t quadrature_points = 0;
+        double estimated_points = 0.0;  // Volume of Omega in lattice nodes
+    };
+    
+    // The grid must carry its lattice (CubeParser sets it)
+    static bool supported(const ESPGrid& grid) { return grid.has_lattice(); }
+    
+    // Adds the quadrature G to G_lower (lower triangle, as
+    // QPSolver::accumulate_gram_matrix). Returns false, leaving G_lower
+    // untouched, when the grid's point count differs from the volume of
+    // Omega by more than max_count_error (e.g. truncated cubes or many
+    // points dropped by the extreme-ESP filter).
+    static bool accumulate(const Molecule& mol,
+                           const ESPGrid& grid,
+                           Eigen::MatrixXd& G_lower,
+                           const Config& config = Config(),
+                           Stats* stats = nullptr);
+};
+
+} // namespace chargeopt
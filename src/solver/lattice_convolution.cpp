@@ -0,0 +1,244 @@
+#include "lattice_convolution.hpp"
+#include "../core/coulomb_kernel.hpp"
+#include <unsupported/Eigen/FFT>
+#include <algorithm>
+#include <cmath>
+#include <complex>
+#include <stdexcept>
+#include <vector>
+
+namespace chargeopt {
+
+namespace {
+
+using Complex = std::complex<double>;
+
+// In-place 3D transform of a P[0] x P[1] x P[2] array (last index fastest);
+// the inverse includes the 1/N scaling. Axes are transformed in order 0, 1,
+// 2; with keep, lines whose index on an already transformed axis is not
+// kept are skipped, so only the kept sub-block of the output is valid.
+void fft3(std::vector<Complex>& data, const int P[3], bool inverse,
+          const std::vector<char>* keep = nullptr) {
+    Eigen::FFT<double> fft;
+    const size_t stride[3] = {static_cast<size_t>(P[1]) * P[2], static_cast<size_t>(P[2]), 1};
+    for (int axis = 0; axis < 3; ++axis) {
+        const int a = (axis + 1) % 3, b = (axis + 2) % 3;
+        std::vector<Complex> line(P[axis]), out(P[axis]);
+        for (int x = 0; x < P[a]; ++x) {
+            if (keep && a < axis && !keep[a][x]) continue;
+            for (int y = 0; y < P[b]; ++y) {
+                if (keep && b < axis && !keep[b][y]) continue;
+                const size_t base = x * stride[a] + y * stride[b];
+                for (int t = 0; t < P[axis]; ++t) line[t] = data[base + t * stride[axis]];
+                if (inverse) {
+                    fft.inv(out, line);
+                } else {
+                    fft.fwd(out, line);
+                }
+                for (int t = 0; t < P[axis]; ++t) data[base + t * stride[axis]] = out[t];
+            }
+        }
+    }
+}
+
+// Lagrange weights on the integer nodes base .. base + order - 1 at x
+void lagrange_weights(double x, int base, int order, double* w) {
+    for (int m = 0; m < order; ++m) {
+        double num = 1.0, den = 1.0;
+        for (int l = 0; l < order; ++l) {
+            if (l == m) continue;
+            num *= x - (base + l);
+            den *= m - l;
+        }
+        w[m] = num / den;
+    }
+}
+
+// Targets span nodes [-ext, n - 1 + ext], so offsets between a target
+// and a data node span 2 (n - 1 + ext) + 1 values; padding to at least
+// that keeps the circular convolution from wrapping
+void padded_dims(const GridLattice& lattice, int ext, int P[3]) {
+    for (int a = 0; a < 3; ++a) {
+        P[a] = LatticeConvolution::fft_size(2 * (lattice.dims[a] - 1 + ext) + 1);
+    }
+}
+
+} // namespace
+
+size_t LatticeConvolution::workspace_bytes(const ESPGrid& grid, const Config& config) {
+    if (!supported(grid)) return 0;
+    int P[3];
+    padded_dims(grid.lattice(), config.order / 2, P);
+    return static_cast<size_t>(P[0]) * P[1] * P[2] * sizeof(Complex)
+        + grid.lattice().num_nodes() * sizeof(long);
+}
+
+int LatticeConvolution::fft_size(int n) {
+    for (int m = std::max(n, 1);; ++m) {
+        int r = m;
+        for (int f : {2, 3, 5}) {
+            while (r % f == 0) r /= f;
+        }
+        if (r == 1) return m;
+    }
+}
+
+Eigen::VectorXd LatticeConvolution::apply(const Molecule& mol,
+                                          const ESPGrid& grid,
+                                          const Eigen::VectorXd& values,
+                                          const Config& config) {
+    if (!supported(grid)) {
+        throw std::runtime_error("Lattice convolution needs a grid read from a cube file");
+    }
+    if (values.size() != static_cast<Eigen::Index>(grid.num_points())) {
+        throw std::runtime_error("Lattice convolution: one value per grid point expected");
+    }
+    if (config.order < 2 || config.order % 2 != 0) {
+        throw std::runtime_error("Lattice convolution: interpolation order must be even");
+    }
+    
+    const GridLattice& lattice = grid.lattice();
+    const int n[3] = {lattice.dims[0], lattice.dims[1], lattice.dims[2]};
+    const double sigma = config.sigma * lattice.axes.rowwise().norm().minCoeff();
+    const double cutoff = config.cutoff * sigma;
+    const double far_at_zero = 2.0 / (sigma * std::sqrt(M_PI));  // lim erf(r/sigma)/r
+    const Eigen::Matrix3d to_index = lattice.axes.transpose().inverse();
+    const int ext = config.order / 2;
+    
+    int P[3];
+    padded_dims(lattice, ext, P);
+    auto flat = [&P](int i, int j, int k) {
+        i += i < 0 ? P[0] : 0;
+        j += j < 0 ? P[1] : 0;
+        k += k < 0 ? P[2] : 0;
+        return (static_cast<size_t>(i) * P[1] + j) * P[2] + k;
+    };
+    
+    // Both inputs are real, so the data (real part) and the far kernel
+    // (imaginary part) share one forward transform
+    std::vector<Complex> z(static_cast<size_t>(P[0]) * P[1] * P[2]);
+    std::vector<long> point_of(lattice.num_nodes(), -1);
+    for (size_t q = 0; q < grid.num_points(); ++q) {
+        const size_t node = lattice.node[q];
+        const int k = node % n[2];
+        const int j = (node / n[2]) % n[1];
+        const int i = node / (static_cast<size_t>(n[1]) * n[2]);
+        z[flat(i, j, k)] = values(q);
+        point_of[node] = q;
+    }
+    for (int a = -(n[0] - 1 + ext); a <= n[0] - 1 + ext; ++a) {
+        for (int b = -(n[1] - 1 + ext); b <= n[1] - 1 + ext; ++b) {
+            const Eigen::Vector3d ab = a * lattice.axes.row(0) + b * lattice.axes.row(1);
+            for (int c = -(n[2] - 1 + ext); c <= n[2] - 1 + ext; ++c) {
+                const double r = (ab + c * lattice.axes.row(2).transpose()).norm();
+                const double kernel = r > 0.0 ? std::erf(r / sigma) / r : far_at_zero;
+                z[flat(a, b, c)] += Complex(0.0, kernel);
+            }
+        }
+    }
+    
+    fft3(z, P, false);
+    
+    // Split the spectra, D(k) = (Z(k) + conj Z(-k)) / 2 and
+    // K(k) = (Z(k) - conj Z(-k)) / 2i, and multiply; each (k, -k) pair is
+    // handled once since the product of real signals is Hermitian
+    for (int a = 0; a < P[0]; ++a) {
+        for (int b = 0; b < P[1]; ++b) {
+            for (int c = 0; c < P[2]; ++c) {
+                const size_t k = flat(a, b, c);
+                const size_t mk = flat((P[0] - a) % P[0], (P[1] - b) % P[1], (P[2] - c) % P[2]);
+                if (mk < k) continue;
+                const Complex zk = z[k], zmk = std::conj(z[mk]);
+                const Complex product = 0.5 * (zk + zmk) * (zk - zmk) / Complex(0.0, 2.0);
+                z[k] = product;
+                z[mk] = std::conj(product);
+            }
+        }
+    }
+    
+    // Only target nodes [-ext, n - 1 + ext] are read back
+    std::vector<char> keep[3];
+    for (int a = 0; a < 3; ++a) {
+        keep[a].assign(P[a], 0);
+        for (int t = -ext; t <= n[a] - 1 + ext; ++t) {
+            keep[a][t < 0 ? t + P[a] : t] = 1;
+        }
+    }
+    fft3(z, P, true, keep);
+    
+    Eigen::VectorXd g(mol.num_atoms());
+    Eigen::MatrixXd positions;  // Direct fallback only
+    std::vector<double> weights(3 * config.order);
+    
+    for (size_t s = 0; s < mol.num_atoms(); ++s) {
+        const Eigen::Vector3d site = mol.atom(s).position;
+        const Eigen::Vector3d x = to_index * (site - lattice.origin);
+        
+        int base[3];
+        bool inside = true;
+        for (int a = 0; a < 3; ++a) {
+            base[a] = static_cast<int>(std::floor(x(a))) - (ext - 1);
+            inside = inside && base[a] >= -ext && base[a] + config.order - 1 <= n[a] - 1 + ext;
+        }
+        if (!inside) {
+            if (positions.rows() == 0) positions = grid.positions();
+            g(s) = CoulombKernel::potential_column(positions, site).dot(values);
+            continue;
+        }
+        
+        // Far field: interpolate the convolved lattice
+        double* w[3] = {&weights[0], &weights[config.order], &weights[2 * config.order]};
+        for (int a = 0; a < 3; ++a) {
+            lagrange_weights(x(a), base[a], config.order, w[a]);
+        }
+        double far = 0.0;
+        for (int i = 0; i < config.order; ++i) {
+            for (int j = 0; j < config.order; ++j) {
+                double line = 0.0;
+                for (int k = 0; k < config.order; ++k) {
+                    line += w[2][k] * z[flat(base[0] + i, base[1] + j, base[2] + k)].real();
+                }
+                far += w[0][i] * w[1][j] * line;
+            }
+        }
+        
+        // Near field: direct erfc sum over the points inside the cutoff;
+        // along each lattice line the sphere is an interval in k
+        int lo[2], hi[2];
+        for (int a = 0; a < 2; ++a) {
+            const double reach = cutoff * to_index.row(a).norm();
+            lo[a] = std::max(0, static_cast<int>(std::ceil(x(a) - reach)));
+            hi[a] = std::min(n[a] - 1, static_cast<int>(std::floor(x(a) + reach)));
+        }
+        const Eigen::Vector3d v = lattice.axes.row(2);
+        const double vv = v.squaredNorm();
+        double near = 0.0;
+        for (int i = lo[0]; i <= hi[0]; ++i) {
+            for (int j = lo[1]; j <= hi[1]; ++j) {
+                // |d + k v| < cutoff, d = node (i, j, 0) - site
+                const Eigen::Vector3d d = lattice.origin + i * lattice.axes.row(0).transpose()
+                                        + j * lattice.axes.row(1).transpose() - site;
+                const double dv = d.dot(v);
+                const double disc = dv * dv - vv * (d.squaredNorm() - cutoff * cutoff);
+                if (disc <= 0.0) continue;
+                const int k_lo = std::max(0, static_cast<int>(std::ceil((-dv - std::sqrt(disc)) / vv)));
+                const int k_hi = std::min(n[2] - 1, static_cast<int>(std::floor((-dv + std::sqrt(disc)) / vv)));
+                const size_t row = (static_cast<size_t>(i) * n[1] + j) * n[2];
+                for (int k = k_lo; k <= k_hi; ++k) {
+                    const long q = point_of[row + k];
+                    if (q < 0) continue;
+                    const double r = (grid.point(q).position - site).norm();
+                    near += values(q) * (r > CoulombKernel::min_distance
+                        ? std::erfc(r / sigma) / r
+                        : 1.0 / CoulombKernel::min_distance - far_at_zero);
+                }
+            }
+        }
+        
+        g(s) = far + near;
+    }
+    
+    return g;
+}
+
+} // namespace chargeopt
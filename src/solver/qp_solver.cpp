@@ -1,58 +1,200 @@
 #include "qp_solver.hpp"
 #include "active_set.hpp"
+#include "lattice_convolution.hpp"
+#include "gram_quadrature.hpp"
+#include "../core/coulomb_kernel.hpp"
+#include "../core/resource_limits.hpp"
 #include <iostream>
 #include <cmath>
+#include <algorithm>
+#include <stdexcept>
 
 namespace chargeopt {
 
-void QPSolver::build_esp_matrices(const Molecule& mol,
-                                  const ESPGrid& grid,
-                                  Eigen::MatrixXd& H,
-                                  Eigen::VectorXd& f) {
-    const int n_atoms = mol.num_atoms();
-    const int n_points = grid.num_points();
-    
-    // Build matrix A: ESP contribution matrix
+Eigen::MatrixXd QPSolver::build_design_matrix(const Molecule& mol, const ESPGrid& grid) {
     // A(i,j) = 1/r_ij where r_ij is distance from atom j to grid point i
-    Eigen::MatrixXd A(n_points, n_atoms);
+    // Coulomb potential: V = q/r (in atomic units)
+    return CoulombKernel::potential_matrix(grid.positions(), mol.positions());
+}
+
+QPSolver::RhsMethod QPSolver::parse_rhs_method(const std::string& name) {
+    if (name == "direct") return RhsMethod::Direct;
+    if (name == "fft") return RhsMethod::FFT;
+    throw std::runtime_error("Unknown right-hand side method: " + name);
+}
+
+QPSolver::HessianMethod QPSolver::parse_hessian_method(const std::string& name) {
+    if (name == "exact") return HessianMethod::Exact;
+    if (name == "quadrature") return HessianMethod::Quadrature;
+    throw std::runtime_error("Unknown Hessian method: " + name);
+}
+
+void QPSolver::for_each_design_block(const Molecule& mol, const ESPGrid& grid,
+                                     size_t begin, size_t end,
+                                     const BlockVisitor& visit, int block_rows) {
+    const Eigen::MatrixXd sites = mol.positions();
+    const int n_atoms = mol.num_atoms();
     
-    for (int i = 0; i < n_points; ++i) {
-        const auto& grid_point = grid.point(i);
+    // Stream the grid in row blocks: only a block_rows x n_atoms slice of
+    // the design matrix is ever held in memory. Blocks are also capped at
+    // 1/32 of the memory budget, for large molecules in small containers.
+    block_rows = std::max(1, block_rows);
+    const uint64_t budget = ResourceLimits::detect().memory_budget();
+    if (budget > 0) {
+        const uint64_t fit = budget / 32 / (sizeof(double) * std::max(n_atoms, 1));
+        block_rows = static_cast<int>(std::min<uint64_t>(block_rows, std::max<uint64_t>(fit, 64)));
+    }
+    Eigen::MatrixXd points;
+    Eigen::VectorXd V;
+    Eigen::MatrixXd A_blk;
+    for (size_t b = begin; b < end; b += block_rows) {
+        const size_t rows = std::min<size_t>(block_rows, end - b);
+        points.resize(rows, 3);
+        V.resize(rows);
+        for (size_t i = 0; i < rows; ++i) {
+            const auto& p = grid.point(b + i);
+            points.row(i) = p.position;
+            V(i) = p.potential;
+        }
         
+        A_blk.resize(rows, n_atoms);
         for (int j = 0; j < n_atoms; ++j) {
-            const auto& atom = mol.atom(j);
-            double r = (grid_point.position - atom.position).norm();
-            
-            // Coulomb potential: V = q/r (in atomic units)
-            // Avoid division by zero
-            if (r < 1e-10) r = 1e-10;
-            
-            A(i, j) = 1.0 / r;
+            A_blk.col(j) = CoulombKernel::potential_column(points, sites.row(j).transpose());
         }
+        visit(b, A_blk, V);
     }
+}
+
+namespace {
+
+// Shared block loop; G or g is skipped when null
+void accumulate_blocks(const Molecule& mol, const ESPGrid& grid,
+                       size_t begin, size_t end,
+                       Eigen::MatrixXd* G, Eigen::VectorXd* g, int block_rows) {
+    QPSolver::for_each_design_block(mol, grid, begin, end,
+        [G, g](size_t, const Eigen::MatrixXd& A_blk, const Eigen::VectorXd& V) {
+            if (G) {
+                G->selfadjointView<Eigen::Lower>().rankUpdate(A_blk.transpose());
+            }
+            if (g) {
+                g->noalias() += A_blk.transpose() * V;
+            }
+        }, block_rows);
+}
+
+} // namespace
+
+void QPSolver::accumulate_normal_equations(const Molecule& mol,
+                                           const ESPGrid& grid,
+                                           size_t begin, size_t end,
+                                           Eigen::MatrixXd& G,
+                                           Eigen::VectorXd& g,
+                                           int block_rows) {
+    accumulate_blocks(mol, grid, begin, end, &G, &g, block_rows);
+}
+
+void QPSolver::accumulate_gram_matrix(const Molecule& mol,
+                                      const ESPGrid& grid,
+                                      size_t begin, size_t end,
+                                      Eigen::MatrixXd& G,
+                                      int block_rows) {
+    accumulate_blocks(mol, grid, begin, end, &G, nullptr, block_rows);
+}
+
+void QPSolver::accumulate_rhs(const Molecule& mol,
+                              const ESPGrid& grid,
+                              size_t begin, size_t end,
+                              Eigen::VectorXd& g,
+                              int block_rows) {
+    accumulate_blocks(mol, grid, begin, end, nullptr, &g, block_rows);
+}
+
+void QPSolver::finalize_esp_matrices(const Eigen::MatrixXd& G_lower,
+                                     const Eigen::VectorXd& g,
+                                     Eigen::MatrixXd& H,
+                                     Eigen::VectorXd& f) {
+    const int n_atoms = g.size();
     
-    // Get target ESP values
-    Eigen::VectorXd V_target = grid.potentials();
-    
-    // NORMALIZE A for better conditioning
+    // NORMALIZE A for better conditioning: column norms of A are sqrt(diag(A^T A))
     Eigen::VectorXd scale(n_atoms);
     for (int j = 0; j < n_atoms; ++j) {
-        scale(j) = A.col(j).norm();
-        if (scale(j) > 1e-10) {
-            A.col(j) /= scale(j);
-        }
+        scale(j) = std::sqrt(G_lower(j, j));
+        if (scale(j) <= 1e-10) scale(j) = 1.0;
     }
     
-    // QP formulation with normalized A
-    H = 2.0 * (A.transpose() * A);
-    f = -2.0 * A.transpose() * V_target;
+    // QP formulation with normalized A: H = 2 D^-1 A^T A D^-1
+    H = G_lower.selfadjointView<Eigen::Lower>();
+    H = 2.0 * scale.cwiseInverse().asDiagonal() * H * scale.cwiseInverse().asDiagonal();
     
-    // Scale f back to account for normalization
-    for (int j = 0; j < n_atoms; ++j) {
-        if (scale(j) > 1e-10) {
-            f(j) /= scale(j);
-        }
+    // f = -2 D^-1 (A D^-1)^T V, i.e. scaled back once more for the normalization
+    f = -2.0 * g.cwiseQuotient(scale.cwiseProduct(scale));
+}
+
+void QPSolver::build_esp_matrices(const Molecule& mol,
+                                  const ESPGrid& grid,
+                                  Eigen::MatrixXd& H,
+                                  Eigen::VectorXd& f,
+                                  int block_rows) {
+    const int n_atoms = mol.num_atoms();
+    
+    // Normal equations G = A^T A, g = A^T V of the ESP design matrix
+    // A(i,j) = 1/r_ij, accumulated block by block over the grid
+    Eigen::MatrixXd G = Eigen::MatrixXd::Zero(n_atoms, n_atoms);
+    Eigen::VectorXd g = Eigen::VectorXd::Zero(n_atoms);
+    accumulate_normal_equations(mol, grid, 0, grid.num_points(), G, g, block_rows);
+    
+    finalize_esp_matrices(G, g, H, f);
+}
+
+QPSolver::Assembly QPSolver::build_esp_matrices(const Molecule& mol,
+                                                const ESPGrid& grid,
+                                                Eigen::MatrixXd& H,
+                                                Eigen::VectorXd& f,
+                                                RhsMethod rhs,
+                                                HessianMethod hessian,
+                                                int block_rows) {
+    Assembly used;
+    
+    // The padded FFT lattice grows as 8x the cube; fall back to the
+    // streamed sum rather than risk the memory limit
+    used.memory_budget = ResourceLimits::detect().memory_budget();
+    bool fft = false;
+    if (rhs == RhsMethod::FFT && LatticeConvolution::supported(grid)) {
+        used.fft_workspace = LatticeConvolution::workspace_bytes(grid);
+        fft = used.memory_budget == 0 || used.fft_workspace <= used.memory_budget / 2;
     }
+    const int n_atoms = mol.num_atoms();
+    
+    Eigen::MatrixXd G = Eigen::MatrixXd::Zero(n_atoms, n_atoms);
+    bool have_G = false;
+    if (hessian == HessianMethod::Quadrature && GramQuadrature::supported(grid)) {
+        GramQuadrature::Stats stats;
+        have_G = GramQuadrature::accumulate(mol, grid, G, GramQuadrature::Config(), &stats);
+        used.estimated_points = stats.estimated_points;
+    }
+    used.rhs = fft ? RhsMethod::FFT : RhsMethod::Direct;
+    used.hessian = have_G ? HessianMethod::Quadrature : HessianMethod::Exact;
+    if (!have_G && !fft) {
+        build_esp_matrices(mol, grid, H, f, block_rows);
+        return used;
+    }
+    
+    Eigen::VectorXd g = Eigen::VectorXd::Zero(n_atoms);
+    if (!have_G) {
+        accumulate_gram_matrix(mol, grid, 0, grid.num_points(), G, block_rows);
+    }
+    if (fft) {
+        g = LatticeConvolution::apply(mol, grid, grid.potentials());
+    } else {
+        accumulate_rhs(mol, grid, 0, grid.num_points(), g, block_rows);
+    }
+    
+    finalize_esp_matrices(G, g, H, f);
+    return used;
+}
+
+Eigen::MatrixXd QPSolver::regularized_hessian(const Eigen::MatrixXd& H) const {
+    return H + 2.0 * config_.regularization * Eigen::MatrixXd::Identity(H.rows(), H.cols());
 }
 
 QPSolution QPSolver::solve(const Eigen::MatrixXd& H,
@@ -60,10 +202,17 @@ QPSolution QPSolver::solve(const Eigen::MatrixXd& H,
                           const Constraints& constraints) {
     
     // Add regularization to H
-    Eigen::MatrixXd H_reg = H + 2.0 * config_.regularization * Eigen::MatrixXd::Identity(H.rows(), H.cols());
+    Eigen::MatrixXd H_reg = regularized_hessian(H);
     
     // Use active-set method for constrained QP
     ActiveSetSolver solver(config_.tolerance, config_.max_iterations, config_.verbose);
+    
+    // Restraint toward a prior: lambda ||q - q_ref||^2 adds -2 lambda q_ref to f
+    if (config_.reference_charges.size() == f.size()) {
+        Eigen::VectorXd f_prior = f - 2.0 * config_.regularization * config_.reference_charges;
+        return solver.solve(H_reg, f_prior, constraints);
+    }
+    
     return solver.solve(H_reg, f, constraints);
 }
 
@@ -4,6 +4,8 @@
 #include "../core/esp_grid.hpp"
 #include "constraints.hpp"
 #include <Eigen/Dense>
+#include <functional>
+#include <string>
 
 namespace chargeopt {
 
@@ -24,22 +26,115 @@ public:
         int max_iterations = 1000;
         bool verbose = false;
         
+        // Optional prior: regularize toward these charges instead of zero,
+        // i.e. lambda * ||q - q_ref||^2 (e.g. EEM charges). Empty = zero.
+        Eigen::VectorXd reference_charges;
+        
         Config() {}
     };
     
     QPSolver(const Config& config = Config()) : config_(config) {}
     
+    const Config& config() const { return config_; }
+    
+    // H with the L2 regularization term added (what the KKT solve sees)
+    Eigen::MatrixXd regularized_hessian(const Eigen::MatrixXd& H) const;
+    
     // Solve: min 0.5 * x^T * H * x + f^T * x
     //        subject to: A_eq * x = b_eq
     QPSolution solve(const Eigen::MatrixXd& H, 
                      const Eigen::VectorXd& f,
                      const Constraints& constraints);
     
+    // ESP design matrix A(i,j) = 1/r_ij (grid point i, atom j)
+    static Eigen::MatrixXd build_design_matrix(const Molecule& mol, const ESPGrid& grid);
+    
+    // Grid rows streamed per block during assembly
+    static constexpr int default_block_rows = 4096;
+    
+    // How g = A^T V is formed during assembly
+    enum class RhsMethod {
+        Direct,     // Streamed together with A^T A, O(N_grid N_atoms)
+        FFT         // LatticeConvolution, O(N_grid log N_grid); cube grids only
+    };
+    
+    static RhsMethod parse_rhs_method(const std::string& name);
+    
+    // How G = A^T A is formed during assembly
+    enum class HessianMethod {
+        Exact,      // Lattice sum over every grid point
+        Quadrature  // GramQuadrature volume integral, cost independent of
+                    // the cube resolution; cube grids only
+    };
+    
+    static HessianMethod parse_hessian_method(const std::string& name);
+    
     // Build QP problem from molecule and ESP grid
     static void build_esp_matrices(const Molecule& mol,
                                    const ESPGrid& grid,
                                    Eigen::MatrixXd& H,
-                                   Eigen::VectorXd& f);
+                                   Eigen::VectorXd& f,
+                                   int block_rows = default_block_rows);
+    
+    // Methods build_esp_matrices actually used, after its fallbacks
+    struct Assembly {
+        RhsMethod rhs = RhsMethod::Direct;
+        HessianMethod hessian = HessianMethod::Exact;
+        double estimated_points = 0.0;  // GramQuadrature's point count estimate, if tried
+        size_t fft_workspace = 0;       // Bytes the FFT needs, if requested on a lattice
+        uint64_t memory_budget = 0;     // Bytes; FFT runs within half of it (0 = unknown)
+    };
+    
+    // As above with a choice of right-hand side and Hessian; FFT and
+    // Quadrature fall back to the exact sums for grids without lattice
+    // metadata, FFT also when its workspace exceeds half the memory budget,
+    // Quadrature also when GramQuadrature rejects the grid
+    static Assembly build_esp_matrices(const Molecule& mol,
+                                       const ESPGrid& grid,
+                                       Eigen::MatrixXd& H,
+                                       Eigen::VectorXd& f,
+                                       RhsMethod rhs,
+                                       HessianMethod hessian = HessianMethod::Exact,
+                                       int block_rows = default_block_rows);
+    
+    // Accumulate G += A^T A (lower triangle) and g += A^T V over grid
+    // points [begin, end), streaming block_rows rows of A at a time
+    static void accumulate_normal_equations(const Molecule& mol,
+                                            const ESPGrid& grid,
+                                            size_t begin, size_t end,
+                                            Eigen::MatrixXd& G,
+                                            Eigen::VectorXd& g,
+                                            int block_rows = default_block_rows);
+    
+    // Calls visit(first_row, A_blk, V_blk) for each row block of grid
+    // points [begin, end). Blocks are recomputed from the Coulomb kernel,
+    // capped at 1/32 of the memory budget, and reused between calls.
+    using BlockVisitor = std::function<void(size_t, const Eigen::MatrixXd&, const Eigen::VectorXd&)>;
+    static void for_each_design_block(const Molecule& mol,
+                                      const ESPGrid& grid,
+                                      size_t begin, size_t end,
+                                      const BlockVisitor& visit,
+                                      int block_rows = default_block_rows);
+    
+    // G += A^T A (lower triangle) only
+    static void accumulate_gram_matrix(const Molecule& mol,
+                                       const ESPGrid& grid,
+                                       size_t begin, size_t end,
+                                       Eigen::MatrixXd& G,
+                                       int block_rows = default_block_rows);
+    
+    // g += A^T V only
+    static void accumulate_rhs(const Molecule& mol,
+                               const ESPGrid& grid,
+                               size_t begin, size_t end,
+                               Eigen::VectorXd& g,
+                               int block_rows = default_block_rows);
+    
+    // Turn accumulated normal equations into the column-normalized H and f
+    static void finalize_esp_matrices(const Eigen::MatrixXd& G_lower,
+                                      const Eigen::VectorXd& g,
+                                      Eigen::MatrixXd& H,
+                                      Eigen::VectorXd& f);
 
 private:
     Config config_;
@@ -0,0 +1,156 @@
+#include "robust_fit.hpp"
+#include <iostream>
+#include <cmath>
+#include <algorithm>
+#include <stdexcept>
+#include <vector>
+
+namespace chargeopt {
+
+RobustFitter::Loss RobustFitter::parse_loss(const std::string& name) {
+    if (name == "none" || name == "off") return Loss::None;
+    if (name == "huber") return Loss::Huber;
+    if (name == "tukey") return Loss::Tukey;
+    throw std::runtime_error("Unknown robust loss: " + name);
+}
+
+double RobustFitter::default_tuning(Loss loss) {
+    // 95% asymptotic efficiency under Gaussian noise
+    if (loss == Loss::Huber) return 1.345;
+    if (loss == Loss::Tukey) return 4.685;
+    return 0.0;
+}
+
+double RobustFitter::weight(double u) const {
+    const double au = std::abs(u);
+    switch (config_.loss) {
+        case Loss::Huber:
+            return au <= 1.0 ? 1.0 : 1.0 / au;
+        case Loss::Tukey: {
+            if (au >= 1.0) return 0.0;
+            const double t = 1.0 - au * au;
+            return t * t;
+        }
+        default:
+            return 1.0;
+    }
+}
+
+QPSolution RobustFitter::fit(const Molecule& mol,
+                             const ESPGrid& grid,
+                             const Constraints& constraints) {
+    const int n_atoms = mol.num_atoms();
+    const size_t n_points = grid.num_points();
+    if (n_points == 0) {
+        throw std::runtime_error("Robust fit needs at least one grid point");
+    }
+    const int block_rows = std::max(1, config_.block_rows);
+    const double tuning = config_.tuning > 0.0 ? config_.tuning : default_tuning(config_.loss);
+    
+    // The design matrix is never held whole: each pass recomputes it block
+    // by block from the Coulomb kernel, as in the plain least-squares fit
+    QPSolver::Config qp_config = qp_config_;
+    qp_config.verbose = false;
+    QPSolver solver(qp_config);
+    
+    weights_ = Eigen::VectorXd::Ones(n_points);
+    
+    Eigen::MatrixXd G(n_atoms, n_atoms);
+    Eigen::VectorXd g(n_atoms);
+    Eigen::MatrixXd H;
+    Eigen::VectorXd f;
+    Eigen::VectorXd residual(n_points);
+    std::vector<double> abs_res(n_points);
+    
+    // Iteration 1 is the ordinary least-squares fit
+    G.setZero();
+    g.setZero();
+    QPSolver::accumulate_normal_equations(mol, grid, 0, n_points, G, g, block_rows);
+    QPSolver::finalize_esp_matrices(G, g, H, f);
+    QPSolution result = solver.solve(H, f, constraints);
+    result.iterations = 1;
+    
+    if (config_.loss == Loss::None) {
+        return result;
+    }
+    
+    // sigma = 1.4826 * median |r|
+    auto robust_scale = [&]() {
+        for (size_t i = 0; i < n_points; ++i) abs_res[i] = std::abs(residual(i));
+        auto mid = abs_res.begin() + n_points / 2;
+        std::nth_element(abs_res.begin(), mid, abs_res.end());
+        return 1.4826 * (*mid);
+    };
+    
+    // Scale of the least-squares residuals
+    const Eigen::VectorXd q_lsq = result.charges;
+    QPSolver::for_each_design_block(mol, grid, 0, n_points,
+        [&](size_t b, const Eigen::MatrixXd& A_blk, const Eigen::VectorXd& V) {
+            residual.segment(b, V.size()).noalias() = V - A_blk * q_lsq;
+        }, block_rows);
+    double next_sigma = robust_scale();
+    
+    bool converged = false;
+    while (result.iterations < config_.max_iterations) {
+        const double sigma = next_sigma;
+        if (sigma <= 1e-14) {
+            // Perfect fit on at least half the points; nothing to downweight
+            converged = true;
+            break;
+        }
+        
+        const double threshold = tuning * sigma;
+        
+        // Fused pass: residuals of the current (warm-start) charges, their
+        // weights, and A^T W A, A^T W V from the same block of A. The scale
+        // needs every residual, so it is the previous pass's and lags one
+        // iteration; at convergence the two agree.
+        const Eigen::VectorXd q = result.charges;
+        G.setZero();
+        g.setZero();
+        QPSolver::for_each_design_block(mol, grid, 0, n_points,
+            [&](size_t b, const Eigen::MatrixXd& A_blk, const Eigen::VectorXd& V) {
+                const Eigen::Index rows = V.size();
+                auto r = residual.segment(b, rows);
+                r.noalias() = V - A_blk * q;
+                auto w = weights_.segment(b, rows);
+                for (Eigen::Index i = 0; i < rows; ++i) {
+                    w(i) = weight(r(i) / threshold);
+                }
+                const Eigen::MatrixXd WA = w.cwiseSqrt().asDiagonal() * A_blk;
+                G.selfadjointView<Eigen::Lower>().rankUpdate(WA.transpose());
+                g.noalias() += A_blk.transpose() * w.cwiseProduct(V);
+            }, block_rows);
+        next_sigma = robust_scale();
+        
+        QPSolver::finalize_esp_matrices(G, g, H, f);
+        QPSolution next = solver.solve(H, f, constraints);
+        next.iterations = result.iterations + 1;
+        
+        const double change = (next.charges - result.charges).cwiseAbs().maxCoeff();
+        result = next;
+        
+        if (qp_config_.verbose) {
+            std::cout << "  IRLS iteration " << result.iterations
+                      << ": sigma = " << sigma
+                      << ", max charge change = " << change << std::endl;
+        }
+        
+        if (change < config_.tolerance) {
+            converged = true;
+            break;
+        }
+    }
+    
+    result.converged = result.converged && converged;
+    
+    if (qp_config_.verbose) {
+        const long down = (weights_.array() < 1.0).count();
+        std::cout << "  Robust fit: " << result.iterations << " iterations, "
+                  << down << " of " << n_points << " points downweighted" << std::endl;
+    }
+    
+    return result;
+}
+
+} // namespace chargeopt
@@ -0,0 +1,64 @@
+#pragma once
+
+#include "../core/molecule.hpp"
+#include "../core/esp_grid.hpp"
+#include "constraints.hpp"
+#include "qp_solver.hpp"
+#include <Eigen/Dense>
+#include <string>
+
+namespace chargeopt {
+
+// Robust ESP fitting by iteratively reweighted least squares (IRLS).
+//
+// Each iteration computes the residuals r = V - A q of the current charges,
+// a robust scale sigma = 1.4826 * median(|r|), and per-point weights from
+// the loss function. The weighted normal equations are accumulated in one
+// fused pass per iteration and re-solved, starting from the previous
+// charges, until the charges stop changing. The pass streams row blocks of
+// the design matrix, which is never formed whole; sigma therefore comes
+// from the previous pass's residuals.
+class RobustFitter {
+public:
+    enum class Loss {
+        None,    // Plain least squares (single iteration)
+        Huber,   // w = 1 for |r| <= k sigma, k sigma / |r| beyond
+        Tukey    // w = (1 - (r / c sigma)^2)^2 for |r| <= c sigma, 0 beyond
+    };
+    
+    struct Config {
+        Loss loss = Loss::Huber;
+        double tuning = 0.0;        // k or c in units of sigma (0 = 1.345 Huber, 4.685 Tukey)
+        int max_iterations = 50;
+        double tolerance = 1e-6;    // Max charge change between iterations
+        int block_rows = QPSolver::default_block_rows;
+        
+        Config() {}
+    };
+    
+    RobustFitter(const QPSolver::Config& qp_config = QPSolver::Config(),
+                 const Config& config = Config())
+        : qp_config_(qp_config), config_(config) {}
+    
+    // Fit charges; QPSolution::iterations reports the IRLS iteration count.
+    // Throws std::runtime_error on an empty grid.
+    QPSolution fit(const Molecule& mol,
+                   const ESPGrid& grid,
+                   const Constraints& constraints);
+    
+    // Final per-point weights from the last iteration
+    const Eigen::VectorXd& weights() const { return weights_; }
+    
+    static Loss parse_loss(const std::string& name);
+    static double default_tuning(Loss loss);
+
+private:
+    QPSolver::Config qp_config_;
+    Config config_;
+    Eigen::VectorXd weights_;
+    
+    // Weight for a residual scaled by the robust threshold (u = r / (k sigma))
+    double weight(double u) const;
+};
+
+} // namespace chargeopt
@@ -0,0 +1,371 @@
+#include <iostream>
+#include <Eigen/Dense>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <sys/resource.h>
+
+#include "core/molecule.hpp"
+#include "core/esp_grid.hpp"
+#include "solver/qp_solver.hpp"
+#include "solver/constraints.hpp"
+#include "solver/robust_fit.hpp"
+#include "analysis/validator.hpp"
+#include "pipeline/fit_pipeline.hpp"
+
+using namespace chargeopt;
+
+// Performance tier (ctest -L perf). Each case runs in its own process so
+// peak RSS is per case. After one untimed warm-up run, timings are the
+// median of several repeats of the case and are compared against
+// perf_baselines.txt: a case fails when
+// metric > max(baseline * max_ratio, baseline + floor).
+//
+// Baseline timings are kept relative to a fixed calibration workload (the
+// "calibration loop" line), timed in the same process: they are scaled by
+// how much slower or faster the calibration runs now than when they were
+// recorded, so a slow machine or a slow phase of a shared one is not read
+// as a regression.
+//
+//   perf_test <case> [--baselines <file>] [--repeat <n>] [--update]
+//
+// --update records the current numbers as the new baselines for <case>,
+// converted to the file's calibration (or setting it, if there is none).
+
+namespace {
+
+constexpr int skip_code = 77;
+constexpr double time_floor = 0.002;    // s; absorbs timer noise on sub-millisecond stages
+constexpr double memory_floor = 16.0;   // MB
+constexpr double default_time_ratio = 1.5;
+constexpr double default_memory_ratio = 1.5;
+constexpr double io_time_ratio = 2.0;    // Cube parsing: file reads, page cache
+constexpr int default_repeats = 5;
+
+using Metrics = std::map<std::string, double>;
+
+// Per-metric median over the repeats
+Metrics median(const std::vector<Metrics>& runs) {
+    std::map<std::string, std::vector<double>> samples;
+    for (const auto& run : runs) {
+        for (const auto& m : run) samples[m.first].push_back(m.second);
+    }
+    Metrics result;
+    for (auto& s : samples) {
+        std::vector<double>& v = s.second;
+        std::sort(v.begin(), v.end());
+        const size_t n = v.size();
+        result[s.first] = n % 2 ? v[n / 2] : 0.5 * (v[n / 2 - 1] + v[n / 2]);
+    }
+    return result;
+}
+
+double peak_rss_mb() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss / 1024.0;  // Linux reports KB
+}
+
+class Stopwatch {
+public:
+    double lap() {
+        auto now = std::chrono::steady_clock::now();
+        double elapsed = std::chrono::duration<double>(now - start_).count();
+        start_ = now;
+        return elapsed;
+    }
+
+private:
+    std::chrono::steady_clock::time_point start_ = std::chrono::steady_clock::now();
+};
+
+// Fixed workload standing in for the machine's current speed: parsing
+// numbers from text (as the cube parser does) and streaming over a few MB
+double calibration_run() {
+    static const std::string text = [] {
+        std::ostringstream out;
+        out.precision(6);
+        for (int i = 0; i < 100000; ++i) {
+            out << std::scientific << std::sin(0.001 * i) << (i % 6 == 5 ? "\n" : " ");
+        }
+        return out.str();
+    }();
+    static std::vector<double> values(1 << 19);
+    
+    Stopwatch clock;
+    const char* p = text.c_str();
+    char* end = nullptr;
+    size_t n = 0;
+    for (double v = std::strtod(p, &end); end != p; v = std::strtod(p, &end)) {
+        values[n++ % values.size()] += v;
+        p = end;
+    }
+    double sum = 0.0;
+    for (int pass = 0; pass < 8; ++pass) {
+        for (double& v : values) {
+            v = 0.5 * v + 1.0;
+            sum += v;
+        }
+    }
+    const double elapsed = clock.lap();
+    return sum == 0.0 ? elapsed + 1e-12 : elapsed;  // Keeps the loops from being dropped
+}
+
+double calibrate(int repeats) {
+    calibration_run();
+    std::vector<Metrics> runs(repeats);
+    for (auto& run : runs) {
+        run["loop"] = calibration_run();
+    }
+    return median(runs)["loop"];
+}
+
+void run_example(const std::string& name, Metrics& metrics) {
+    const std::string dir = std::string(CHARGEOPT_EXAMPLES_DIR) + "/" + name + "/";
+    FitJob job;
+    job.xyz_file = dir + name + ".xyz";
+    job.cube_file = dir + name + "_esp.cube";
+    
+    std::ostream quiet(nullptr);
+    FitResult result = FitPipeline::run(job, FitOptions(), quiet);
+    metrics["parse_cube"] = result.timings.parse_cube;
+    metrics["assemble"] = result.timings.assemble;
+    metrics["solve"] = result.timings.solve;
+    metrics["total"] = result.timings.total();
+}
+
+// Deterministic pseudo-random system: atoms in a box, grid points on
+// shells around random atoms, kept outside 1.5 Bohr of every nucleus
+void make_synthetic(int n_atoms, int n_points, Molecule& mol, ESPGrid& grid) {
+    uint64_t state = 0x9E3779B97F4A7C15ull;
+    auto uniform = [&state]() {
+        state = state * 6364136223846793005ull + 1442695040888963407ull;
+        return (state >> 11) * (1.0 / 9007199254740992.0);
+    };
+    
+    const double box = 2.2 * std::cbrt(static_cast<double>(n_atoms)) + 4.0;
+    const char* elements[] = {"C", "H", "N", "O", "H"};
+    while (static_cast<int>(mol.num_atoms()) < n_atoms) {
+        Eigen::Vector3d p(box * uniform(), box * uniform(), box * uniform());
+        bool clash = false;
+        for (size_t j = 0; j < mol.num_atoms() && !clash; ++j) {
+            clash = (p - mol.atom(j).position).norm() < 1.8;
+        }
+        if (!clash) {
+            mol.add_atom(Atom(elements[mol.num_atoms() % 5], p, mol.num_atoms()));
+        }
+    }
+    
+    Eigen::VectorXd q(n_atoms);
+    for (int j = 0; j < n_atoms; ++j) q(j) = uniform() - 0.5;
+    q.array() -= q.mean();
+    mol.set_charges(q);
+    
+    const Eigen::MatrixXd sites = mol.positions();
+    while (static_cast<int>(grid.num_points()) < n_points) {
+        const int a = static_cast<int>(uniform() * n_atoms);
+        const double r = 3.0 + 3.0 * uniform();
+        const double z = 2.0 * uniform() - 1.0, phi = 2.0 * M_PI * uniform();
+        Eigen::Vector3d dir(std::sqrt(1.0 - z * z) * std::cos(phi),
+                            std::sqrt(1.0 - z * z) * std::sin(phi), z);
+        Eigen::Vector3d p = sites.row(a).transpose() + r * dir;
+        Eigen::ArrayXd d = (sites.rowwise() - p.transpose()).rowwise().norm().array();
+        if (d.minCoeff() < 1.5) continue;
+        grid.add_point(p, (q.array() / d).sum());
+    }
+}
+
+void run_synthetic(int n_atoms, int n_points, bool robust, Metrics& metrics) {
+    Molecule mol;
+    ESPGrid grid;
+    make_synthetic(n_atoms, n_points, mol, grid);
+    
+    Constraints constraints;
+    constraints.add_charge_constraint(mol.num_atoms(), 0.0);
+    
+    Stopwatch clock;
+    QPSolution solution;
+    if (robust) {
+        RobustFitter fitter;
+        solution = fitter.fit(mol, grid, constraints);
+        metrics["fit"] = clock.lap();
+    } else {
+        Eigen::MatrixXd H;
+        Eigen::VectorXd f;
+        QPSolver::build_esp_matrices(mol, grid, H, f);
+        metrics["assemble"] = clock.lap();
+        solution = QPSolver().solve(H, f, constraints);
+        metrics["solve"] = clock.lap();
+    }
+    
+    mol.set_charges(solution.charges);
+    Validator::validate(mol, grid);
+    metrics["validate"] = clock.lap();
+}
+
+const std::map<std::string, std::function<void(Metrics&)>> cases = {
+    {"water",   [](Metrics& m) { run_example("water", m); }},
+    {"methane", [](Metrics& m) { run_example("methane", m); }},
+    {"acetone", [](Metrics& m) { run_example("acetone", m); }},
+    {"synthetic_large",  [](Metrics& m) { run_synthetic(150, 60000, false, m); }},
+    {"synthetic_robust", [](Metrics& m) { run_synthetic(60, 30000, true, m); }},
+};
+
+struct Baseline {
+    std::string name;
+    std::string metric;
+    double value;
+    double max_ratio;
+};
+
+std::vector<Baseline> load_baselines(const std::string& path, std::vector<std::string>& comments) {
+    std::vector<Baseline> baselines;
+    std::ifstream in(path);
+    std::string line;
+    while (std::getline(in, line)) {
+        if (line.empty() || line[0] == '#') {
+            comments.push_back(line);
+            continue;
+        }
+        std::istringstream iss(line);
+        Baseline b;
+        if (iss >> b.name >> b.metric >> b.value >> b.max_ratio) {
+            baselines.push_back(b);
+        }
+    }
+    return baselines;
+}
+
+void save_baselines(const std::string& path, const std::vector<std::string>& comments,
+                    const std::vector<Baseline>& baselines) {
+    std::ofstream out(path);
+    for (const auto& c : comments) {
+        out << c << "\n";
+    }
+    for (const auto& b : baselines) {
+        out << std::left;
+        out.width(18); out << b.name;
+        out.width(12); out << b.metric;
+        out.width(12); out << b.value;
+        out << b.max_ratio << "\n";
+    }
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    if (argc < 2 || !cases.count(argv[1])) {
+        std::cerr << "Usage: " << argv[0] << " <case> [--baselines <file>] [--repeat <n>] [--update]\nCases:";
+        for (const auto& c : cases) std::cerr << " " << c.first;
+        std::cerr << std::endl;
+        return 1;
+    }
+    const std::string name = argv[1];
+    std::string baseline_file;
+    bool update = false;
+    int repeats = default_repeats;
+    for (int i = 2; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--baselines" && i + 1 < argc) baseline_file = argv[++i];
+        else if (arg == "--repeat" && i + 1 < argc) repeats = std::max(1, std::stoi(argv[++i]));
+        else if (arg == "--update") update = true;
+    }
+
+#ifndef NDEBUG
+    if (!update) {
+        std::cout << "Skipping " << name << ": timings are only meaningful in optimized builds" << std::endl;
+        return skip_code;
+    }
+#endif
+
+    // Warm-up: page cache, allocator and lazily built tables
+    Metrics warm_up;
+    cases.at(name)(warm_up);
+    
+    std::vector<Metrics> runs(repeats);
+    for (auto& run : runs) {
+        cases.at(name)(run);
+    }
+    Metrics metrics = median(runs);
+    metrics["peak_rss_mb"] = peak_rss_mb();
+    const double calibration = calibrate(repeats);
+    
+    std::vector<std::string> comments;
+    std::vector<Baseline> baselines;
+    if (!baseline_file.empty()) {
+        baselines = load_baselines(baseline_file, comments);
+    }
+    
+    // Current machine speed relative to the baselines' (1 without a
+    // calibration line)
+    const Baseline* reference = nullptr;
+    for (const auto& b : baselines) {
+        if (b.name == "calibration" && b.metric == "loop") reference = &b;
+    }
+    const double speed = reference ? calibration / reference->value : 1.0;
+    
+    if (update) {
+        if (!reference) {
+            baselines.insert(baselines.begin(), {"calibration", "loop", calibration, 1.0});
+        }
+        for (const auto& m : metrics) {
+            const bool memory = m.first == "peak_rss_mb";
+            const double value = memory ? m.second : m.second / speed;
+            bool found = false;
+            for (auto& b : baselines) {
+                if (b.name == name && b.metric == m.first) {
+                    b.value = value;
+                    found = true;
+                }
+            }
+            if (!found) {
+                // Example totals are mostly the cube parse
+                const bool io = m.first == "parse_cube"
+                             || (m.first == "total" && metrics.count("parse_cube"));
+                double ratio = memory ? default_memory_ratio
+                             : io ? io_time_ratio : default_time_ratio;
+                baselines.push_back({name, m.first, value, ratio});
+            }
+        }
+        save_baselines(baseline_file, comments, baselines);
+        std::cout << "Updated baselines for " << name << " in " << baseline_file << std::endl;
+        return 0;
+    }
+    
+    int regressions = 0;
+    std::cout << name << ":" << std::endl;
+    std::cout << "  calibration = " << calibration;
+    if (reference) {
+        std::cout << " (baseline " << reference->value << ", baselines scaled x" << speed << ")";
+    }
+    std::cout << std::endl;
+    for (const auto& m : metrics) {
+        const Baseline* baseline = nullptr;
+        for (const auto& b : baselines) {
+            if (b.name == name && b.metric == m.first) baseline = &b;
+        }
+        
+        std::cout << "  " << m.first << " = " << m.second;
+        if (!baseline) {
+            std::cout << " (no baseline)" << std::endl;
+            continue;
+        }
+        const bool memory = m.first == "peak_rss_mb";
+        const double floor = memory ? memory_floor : time_floor;
+        const double value = memory ? baseline->value : baseline->value * speed;
+        const double limit = std::max(value * baseline->max_ratio, value + floor);
+        const bool regressed = m.second > limit;
+        std::cout << " (baseline " << value << ", limit " << limit << ")"
+                  << (regressed ? "  REGRESSION" : "") << std::endl;
+        regressions += regressed;
+    }
+    
+    return regressions > 0 ? 1 : 0;
+}
@@ -2,6 +2,117 @@
 #include <Eigen/Dense>
 #include <cmath>
 
+#include "core/molecule.hpp"
+#include "core/esp_grid.hpp"
+#include "core/coulomb_kernel.hpp"
+#include "solver/qp_solver.hpp"
+#include "solver/constraints.hpp"
+#include "solver/charge_derivatives.hpp"
+#include "solver/robust_fit.hpp"
+#include "solver/gram_quadrature.hpp"
+#include "solver/eem_solver.hpp"
+#include "analysis/topology.hpp"
+#include "io/charge_database.hpp"
+#include "pipeline/job_key.hpp"
+#include "pipeline/batch_journal.hpp"
+#include "pipeline/batch_runner.hpp"
+#include "io/result_sink.hpp"
+#include "io/file_prefetcher.hpp"
+#include "io/xyz_parser.hpp"
+#include "io/cube_parser.hpp"
+#include "io/shared_grid_cache.hpp"
+#include "io/multipole_parser.hpp"
+#include "core/task_graph.hpp"
+#include "core/resource_limits.hpp"
+#include "analysis/conformer_clustering.hpp"
+#include <atomic>
+#include <stdexcept>
+#include <fstream>
+#include <cstdio>
+#include <cstring>
+#include <iterator>
+#include <sstream>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace chargeopt;
+
+// Small water-like test system with a synthetic shell grid (atomic units)
+static Molecule make_water() {
+    Molecule mol;
+    mol.add_atom(Atom("O", Eigen::Vector3d(0.0, 0.0, 0.22)));
+    mol.add_atom(Atom("H", Eigen::Vector3d(0.0, 1.43, -0.89)));
+    mol.add_atom(Atom("H", Eigen::Vector3d(0.1, -1.43, -0.89)));
+    return mol;
+}
+
+static ESPGrid make_shell_grid(const Molecule& mol, const Eigen::VectorXd& ref_charges) {
+    ESPGrid grid;
+    const int n_theta = 12, n_phi = 24;
+    for (double radius : {4.0, 5.0, 6.0}) {
+        for (int t = 0; t < n_theta; ++t) {
+            double theta = M_PI * (t + 0.5) / n_theta;
+            for (int p = 0; p < n_phi; ++p) {
+                double phi = 2.0 * M_PI * p / n_phi;
+                Eigen::Vector3d pos(radius * std::sin(theta) * std::cos(phi),
+                                    radius * std::sin(theta) * std::sin(phi),
+                                    radius * std::cos(theta));
+                double v = 0.0;
+                for (size_t j = 0; j < mol.num_atoms(); ++j) {
+                    v += ref_charges(j) / (pos - mol.atom(j).position).norm();
+                }
+                // Small deterministic perturbation so the fit is not exact
+                v += 1e-3 * std::sin(3.0 * phi) * std::cos(theta);
+                grid.add_point(pos, v);
+            }
+        }
+    }
+    return grid;
+}
+
+bool test_charge_derivatives() {
+    Molecule mol = make_water();
+    Eigen::VectorXd ref(3);
+    ref << -0.8, 0.4, 0.4;
+    ESPGrid grid = make_shell_grid(mol, ref);
+    
+    Constraints constraints;
+    constraints.add_charge_constraint(mol.num_atoms(), 0.0);
+    
+    QPSolver::Config config;
+    ChargeDerivatives deriv(config);
+    Eigen::MatrixXd J = deriv.compute(mol, grid, constraints);
+    
+    auto fit = [&](const Molecule& m) {
+        Eigen::MatrixXd H;
+        Eigen::VectorXd f;
+        QPSolver::build_esp_matrices(m, grid, H, f);
+        QPSolver solver(config);
+        return solver.solve(H, f, constraints).charges;
+    };
+    
+    // Central finite differences
+    const double h = 1e-4;
+    double max_err = 0.0;
+    double max_val = 0.0;
+    for (size_t a = 0; a < mol.num_atoms(); ++a) {
+        for (int c = 0; c < 3; ++c) {
+            Molecule plus = mol, minus = mol;
+            plus.atom(a).position(c) += h;
+            minus.atom(a).position(c) -= h;
+            Eigen::VectorXd fd = (fit(plus) - fit(minus)) / (2.0 * h);
+            max_err = std::max(max_err, (J.row(3 * a + c).transpose() - fd).cwiseAbs().maxCoeff());
+            max_val = std::max(max_val, fd.cwiseAbs().maxCoeff());
+        }
+    }
+    
+    return J.rows() == 9 && J.cols() == 3 && max_err < 1e-6 * std::max(1.0, max_val);
+}
+
 bool test_eigen() {
     Eigen::MatrixXd A(2, 2);
     A << 1, 2,
@@ -29,6 +140,836 @@ bool test_charge_conservation() {
     return std::abs(sum - expected) < 1e-10;
 }
 
+bool test_robust_fit() {
+    Molecule mol = make_water();
+    Eigen::VectorXd ref(3);
+    ref << -0.8, 0.4, 0.4;
+    ESPGrid clean = make_shell_grid(mol, ref);
+    
+    // Corrupt every 10th point with a large spike
+    ESPGrid noisy;
+    for (size_t i = 0; i < clean.num_points(); ++i) {
+        const auto& p = clean.point(i);
+        noisy.add_point(p.position, p.potential + (i % 10 == 0 ? 0.5 : 0.0));
+    }
+    
+    Constraints constraints;
+    constraints.add_charge_constraint(mol.num_atoms(), 0.0);
+    
+    QPSolver::Config config;
+    RobustFitter::Config plain;
+    plain.loss = RobustFitter::Loss::None;
+    RobustFitter::Config huber;
+    huber.loss = RobustFitter::Loss::Huber;
+    
+    QPSolution ols = RobustFitter(config, plain).fit(mol, noisy, constraints);
+    RobustFitter robust(config, huber);
+    QPSolution irls = robust.fit(mol, noisy, constraints);
+    
+    // Loss::None must agree with the regular assembly + solve
+    Eigen::MatrixXd H;
+    Eigen::VectorXd f;
+    QPSolver::build_esp_matrices(mol, noisy, H, f);
+    QPSolution direct = QPSolver(config).solve(H, f, constraints);
+    
+    // An empty grid is an error, not a fit with an undefined scale
+    bool empty_throws = false;
+    try {
+        robust.fit(mol, ESPGrid(), constraints);
+    } catch (const std::runtime_error&) {
+        empty_throws = true;
+    }
+    
+    return (ols.charges - direct.charges).norm() < 1e-10
+        && empty_throws
+        && irls.iterations > 1
+        && irls.converged
+        && (irls.charges - ref).norm() < 0.5 * (ols.charges - ref).norm();
+}
+
+// Cube-style lattice grid with spacing h around mol, points within 1.5 Bohr
+// of a nucleus dropped as CubeParser does
+static ESPGrid make_lattice_grid(const Molecule& mol, double h) {
+    const Eigen::MatrixXd sites = mol.positions();
+    GridLattice lattice;
+    lattice.origin = sites.colwise().minCoeff().transpose().array() - 6.0;
+    lattice.axes = h * Eigen::Matrix3d::Identity();
+    for (int a = 0; a < 3; ++a) {
+        lattice.dims[a] = static_cast<int>((sites.col(a).maxCoeff() + 6.0 - lattice.origin(a)) / h) + 1;
+    }
+    ESPGrid grid;
+    size_t node = 0;
+    for (int i = 0; i < lattice.dims[0]; ++i) {
+        for (int j = 0; j < lattice.dims[1]; ++j) {
+            for (int k = 0; k < lattice.dims[2]; ++k, ++node) {
+                const Eigen::Vector3d pos = lattice.origin + h * Eigen::Vector3d(i, j, k);
+                if ((sites.rowwise() - pos.transpose()).rowwise().norm().minCoeff() < 1.5) continue;
+                grid.add_point(pos, 0.0);
+                lattice.node.push_back(node);
+            }
+        }
+    }
+    grid.set_lattice(lattice);
+    return grid;
+}
+
+bool test_gram_quadrature() {
+    Molecule mol = make_water();
+    const int n = mol.num_atoms();
+    
+    // Relative error against the exact lattice sum; the lattice converges
+    // toward the integral as the spacing shrinks
+    auto error = [&](const ESPGrid& grid) {
+        Eigen::MatrixXd exact = Eigen::MatrixXd::Zero(n, n);
+        Eigen::MatrixXd quad = Eigen::MatrixXd::Zero(n, n);
+        QPSolver::accumulate_gram_matrix(mol, grid, 0, grid.num_points(), exact);
+        if (!GramQuadrature::accumulate(mol, grid, quad)) return 1.0;
+        const Eigen::MatrixXd full = exact.selfadjointView<Eigen::Lower>();
+        const Eigen::MatrixXd diff = (quad - exact).selfadjointView<Eigen::Lower>();
+        return diff.norm() / full.norm();
+    };
+    const double coarse = error(make_lattice_grid(mol, 0.5));
+    const ESPGrid fine = make_lattice_grid(mol, 0.25);
+    const double fine_error = error(fine);
+    
+    // A grid missing most of its points no longer matches the volume
+    ESPGrid truncated;
+    GridLattice lattice = fine.lattice();
+    lattice.node.resize(fine.num_points() / 2);
+    for (size_t i = 0; i < lattice.node.size(); ++i) {
+        truncated.add_point(fine.point(i).position, 0.0);
+    }
+    truncated.set_lattice(lattice);
+    Eigen::MatrixXd G = Eigen::MatrixXd::Zero(n, n);
+    
+    // Assembly reports the methods used: the fallback to the exact sum with
+    // the count behind it, and the FFT with its workspace
+    Eigen::MatrixXd H;
+    Eigen::VectorXd f;
+    const QPSolver::Assembly used = QPSolver::build_esp_matrices(
+        mol, truncated, H, f, QPSolver::RhsMethod::Direct, QPSolver::HessianMethod::Quadrature);
+    const QPSolver::Assembly kept = QPSolver::build_esp_matrices(
+        mol, fine, H, f, QPSolver::RhsMethod::FFT, QPSolver::HessianMethod::Quadrature);
+    
+    return fine_error < 3e-3
+        && fine_error < coarse
+        && !GramQuadrature::accumulate(mol, truncated, G)
+        && G.norm() == 0.0
+        && used.hessian == QPSolver::HessianMethod::Exact
+        && used.estimated_points > 1.5 * truncated.num_points()
+        && kept.hessian == QPSolver::HessianMethod::Quadrature
+        && kept.rhs == QPSolver::RhsMethod::FFT && kept.fft_workspace > 0
+        && used.rhs == QPSolver::RhsMethod::Direct && used.fft_workspace == 0;
+}
+
+bool test_eem_charges() {
+    Molecule mol = make_water();
+    Constraints constraints;
+    constraints.add_charge_constraint(mol.num_atoms(), -1.0);
+    
+    EEMSolver eem;
+    Eigen::MatrixXd J = eem.hardness_matrix(mol);
+    QPSolution sol = eem.solve(mol, constraints);
+    
+    // Equalized electronegativity: chi_i + (J q)_i is the same on every atom
+    Eigen::VectorXd mu = EEMSolver::electronegativities(mol) + J * sol.charges;
+    
+    return (J - J.transpose()).norm() < 1e-12
+        && std::abs(sol.charges.sum() + 1.0) < 1e-10
+        && sol.charges(0) < 0.0
+        && (mu.array() - mu(0)).abs().maxCoeff() < 1e-10;
+}
+
+bool test_charge_database() {
+    Molecule mol = make_water();
+    
+    // Same molecule with the atoms listed in a different order
+    Molecule reordered;
+    reordered.add_atom(mol.atom(2));
+    reordered.add_atom(mol.atom(0));
+    reordered.add_atom(mol.atom(1));
+    
+    auto keys = Topology::environment_hashes(mol);
+    auto keys_re = Topology::environment_hashes(reordered);
+    if (keys[0] != keys_re[1] || keys[1] != keys[2] || keys[0] == keys[1]) {
+        return false;
+    }
+    
+    const std::string path = "test_charges.db";
+    std::remove(path.c_str());
+    
+    Eigen::VectorXd q(3);
+    q << -0.8, 0.4, 0.4;
+    ChargeDatabase::update(path, keys, q, ChargeDatabase::default_depth);
+    q << -0.6, 0.3, 0.3;
+    ChargeDatabase::update(path, keys, q, ChargeDatabase::default_depth);
+    
+    ChargeDatabase db = ChargeDatabase::open(path);
+    double q_o = 0.0, q_h = 0.0, unused = 0.0;
+    bool ok = db.size() == 2
+           && db.lookup(keys_re[1], q_o) && std::abs(q_o + 0.7) < 1e-12
+           && db.lookup(keys_re[0], q_h) && std::abs(q_h - 0.35) < 1e-12
+           && !db.lookup(12345, unused);
+    
+    // Updates wait for the lock file: a child's update cannot finish while
+    // this process holds it
+    const int lock = open((path + ".lock").c_str(), O_RDWR | O_CREAT, 0644);
+    ok = ok && lock >= 0 && flock(lock, LOCK_EX) == 0;
+    pid_t child = fork();
+    if (child == 0) {
+        close(lock);  // Shares the parent's lock otherwise
+        ChargeDatabase::update(path, {100}, Eigen::VectorXd::Constant(1, 0.1), ChargeDatabase::default_depth);
+        _exit(0);
+    }
+    usleep(100000);
+    int status = 1;
+    ok = ok && waitpid(child, &status, WNOHANG) == 0 && ChargeDatabase::open(path).size() == 2;
+    close(lock);
+    waitpid(child, &status, 0);
+    ok = ok && WIFEXITED(status) && WEXITSTATUS(status) == 0 && ChargeDatabase::open(path).size() == 3;
+    
+    std::remove(path.c_str());
+    std::remove((path + ".lock").c_str());
+    return ok;
+}
+
+bool test_job_key() {
+    Molecule mol = make_water();
+    
+    // Same coordinates, atoms listed in another order
+    Molecule reordered;
+    for (int i : {2, 0, 1}) {
+        reordered.add_atom(Atom(mol.atom(i).element, mol.atom(i).position));
+    }
+    
+    // Rotated and translated copy
+    Eigen::Matrix3d R = Eigen::AngleAxisd(0.9, Eigen::Vector3d(1, 2, 3).normalized()).toRotationMatrix();
+    Eigen::Vector3d t(3.0, -1.0, 0.5);
+    Molecule moved;
+    for (size_t i = 0; i < mol.num_atoms(); ++i) {
+        moved.add_atom(Atom(mol.atom(i).element, R * mol.atom(i).position + t));
+    }
+    
+    // Genuinely different geometry
+    Molecule bent = mol;
+    bent.atom(1).position(1) += 0.2;
+    
+    // Cube headers with the same voxel data, around the original and the
+    // moved molecule
+    auto cube = [&](const Eigen::Vector3d& origin, const Eigen::Matrix3d& steps, const std::string& data) {
+        std::ostringstream out;
+        out.precision(17);
+        out << "title\nESP\n3 " << origin.transpose() << "\n";
+        for (int k = 0; k < 3; ++k) {
+            out << "4 " << steps.col(k).transpose() << "\n";
+        }
+        for (size_t j = 0; j < mol.num_atoms(); ++j) {
+            out << "1 0 " << mol.atom(j).position.transpose() << "\n";
+        }
+        out << data;
+        return out.str();
+    };
+    const Eigen::Vector3d origin(-3.0, -3.0, -3.0);
+    const std::string data = "0.1 0.2 0.3\n-0.4 0.5 0.6\n";
+    const std::string original_cube = cube(origin, 0.5 * Eigen::Matrix3d::Identity(), data);
+    JobKey::Source source = JobKey::Source::from_buffer(original_cube);
+    JobKey::Source moved_source = JobKey::Source::from_buffer(cube(R * origin + t, 0.5 * R, data));
+    JobKey::Source other_data = JobKey::Source::from_buffer(
+        cube(origin, 0.5 * Eigen::Matrix3d::Identity(), "0.1 0.2 0.3\n-0.4 0.5 0.7\n"));
+    
+    // A streamed file hashes like the same contents in memory
+    const std::string cube_path = "test_key.cube";
+    {
+        std::ofstream out(cube_path);
+        out << original_cube;
+    }
+    JobKey::Source from_file = JobKey::Source::from_file(cube_path);
+    std::remove(cube_path.c_str());
+    
+    // Not a cube: no frame to move, so the raw coordinates count
+    JobKey::Source opaque = JobKey::Source::from_buffer("not a cube file\n");
+    
+    FitOptions options;
+    JobKey a = JobKey::compute(mol, source, 0.0, options);
+    JobKey b = JobKey::compute(reordered, source, 0.0, options);
+    JobKey m = JobKey::compute(moved, moved_source, 0.0, options);
+    JobKey stale = JobKey::compute(moved, source, 0.0, options);
+    JobKey c = JobKey::compute(bent, source, 0.0, options);
+    JobKey d = JobKey::compute(mol, other_data, 0.0, options);
+    JobKey f = JobKey::compute(mol, from_file, 0.0, options);
+    const bool opaque_ok = !opaque.lattice && source.lattice
+        && JobKey::compute(mol, opaque, 0.0, options).key == JobKey::compute(reordered, opaque, 0.0, options).key
+        && JobKey::compute(mol, opaque, 0.0, options).key != JobKey::compute(moved, opaque, 0.0, options).key;
+    
+    // Canonical order maps each atom to its counterpart
+    bool order_ok = true;
+    for (size_t k = 0; k < mol.num_atoms(); ++k) {
+        order_ok = order_ok && mol.atom(a.order[k]).position == reordered.atom(b.order[k]).position;
+    }
+    
+    const bool canonical_ok = JobKey::canonical_geometry(mol).key == JobKey::canonical_geometry(moved).key;
+    
+    // Databases of equal size but different contents are different settings
+    const std::string db1 = "test_key_1.db", db2 = "test_key_2.db";
+    ChargeDatabase::update(db1, {1, 2}, Eigen::Vector2d(0.1, 0.2), ChargeDatabase::default_depth);
+    ChargeDatabase::update(db2, {1, 2}, Eigen::Vector2d(0.1, 0.3), ChargeDatabase::default_depth);
+    ChargeDatabase first = ChargeDatabase::open(db1), second = ChargeDatabase::open(db2);
+    FitOptions with_first, with_second;
+    with_first.database = &first;
+    with_second.database = &second;
+    const bool db_ok = first.size() == second.size()
+        && JobKey::options_hash(with_first) != JobKey::options_hash(with_second);
+    for (const std::string& path : {db1, db2}) {
+        std::remove(path.c_str());
+        std::remove((path + ".lock").c_str());
+    }
+    
+    // A moved molecule matches with its moved cube, not with the old one
+    return a.key == b.key && a.key == m.key && a.key != stale.key && a.key == f.key
+        && a.key != c.key && a.key != d.key
+        && order_ok && canonical_ok && opaque_ok && db_ok;
+}
+
+bool test_batch_journal() {
+    const std::string path = "test_journal.log";
+    std::remove(path.c_str());
+    
+    FitJob a, b, c;
+    a.xyz_file = "a.xyz"; a.cube_file = "a.cube";
+    b.xyz_file = "b.xyz"; b.cube_file = "b.cube";
+    c.xyz_file = "c.xyz"; c.cube_file = "c.cube";
+    
+    {
+        BatchJournal journal(path);
+        journal.mark_started(0, a);
+        journal.mark_done(0, a);
+        journal.mark_started(1, b);  // Killed before finishing
+    }
+    {
+        // A line that is not ours, and a torn final record from the crash
+        std::ofstream torn(path, std::ios::app);
+        torn << "done 3 zzzzzzzzzzzzzzzz\n";
+        torn << "done 2 0123";
+    }
+    
+    FitJob edited = a;
+    edited.cube_file = "other.cube";
+    bool ok = false;
+    {
+        BatchJournal resumed(path);
+        ok = resumed.is_done(0, a)
+          && !resumed.is_done(1, b)
+          && !resumed.is_done(2, c)
+          && !resumed.is_done(0, edited)
+          && resumed.in_flight() == 1;
+        resumed.mark_done(2, c);
+    }
+    
+    // The record appended after the torn line is read back on its own line
+    BatchJournal again(path);
+    ok = ok && again.is_done(2, c) && again.is_done(0, a);
+    
+    std::remove(path.c_str());
+    return ok;
+}
+
+bool test_result_sinks() {
+    const std::string ndjson = "test_results.ndjson";
+    const std::string binary = "test_results.bin";
+    
+    {
+        AsyncResultWriter writer;
+        writer.add_sink(std::unique_ptr<ResultSink>(new NdjsonSink(ndjson)));
+        writer.add_sink(std::unique_ptr<ResultSink>(new BinarySink(binary, 2)));
+        for (uint64_t i = 0; i < 3; ++i) {
+            JobRecord record;
+            record.job = i;
+            record.xyz_file = "mol\"" + std::to_string(i) + ".xyz";
+            record.elements = {"O", "H", "H"};
+            record.charges = {-0.8, 0.4, 0.4};
+            writer.submit(record);
+        }
+        writer.close();
+    }
+    
+    std::ifstream lines(ndjson);
+    std::string line;
+    int count = 0;
+    bool escaped = true;
+    while (std::getline(lines, line)) {
+        escaped = escaped && line.find("\"mol\\\"" + std::to_string(count)) != std::string::npos;
+        count++;
+    }
+    
+    // Two row groups (2 + 1) and a trailer holding the row count
+    std::ifstream in(binary, std::ios::binary);
+    std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    uint64_t rows = 0;
+    if (data.size() >= 16) {
+        std::memcpy(&rows, data.data() + data.size() - 8, sizeof(rows));
+    }
+    bool ok = count == 3 && escaped
+           && data.compare(0, 8, "CHGCOL01") == 0
+           && data.compare(data.size() - 16, 8, "CHGEND01") == 0
+           && rows == 3;
+    
+    std::remove(ndjson.c_str());
+    std::remove(binary.c_str());
+    return ok;
+}
+
+bool test_file_prefetcher() {
+    const std::string path = "test_prefetch.xyz";
+    {
+        std::ofstream xyz(path);
+        xyz << "3\nwater\nO 0.0 0.0 0.1173\nH 0.0 0.7572 -0.4692\nH 0.0 -0.7572 -0.4692\n";
+    }
+    
+    FilePrefetcher prefetcher;
+    prefetcher.request(path);
+    prefetcher.request("missing_prefetch.xyz");
+    
+    std::ostream quiet(nullptr);
+    FilePrefetcher::Buffer data = prefetcher.take(path);
+    Molecule from_buffer = XYZParser::parse_buffer(*data, quiet);
+    Molecule from_file = XYZParser::parse(path, quiet);
+    
+    bool missing_throws = false;
+    try {
+        prefetcher.take("missing_prefetch.xyz");
+    } catch (const std::exception&) {
+        missing_throws = true;
+    }
+    
+    bool ok = from_buffer.num_atoms() == 3
+           && (from_buffer.positions() - from_file.positions()).norm() == 0.0
+           && missing_throws
+           && prefetcher.take(path) == nullptr;  // Already taken
+    
+    std::remove(path.c_str());
+    return ok;
+}
+
+// Water ESP on a 12^3 cube around the origin
+static void write_water_cube(const std::string& path, double scale) {
+    Molecule mol = make_water();
+    std::ofstream cube(path);
+    cube << "water\nESP\n3 -6.0 -6.0 -6.0\n";
+    cube << "12 1.0 0.0 0.0\n12 0.0 1.0 0.0\n12 0.0 0.0 1.0\n";
+    for (size_t j = 0; j < mol.num_atoms(); ++j) {
+        const auto& p = mol.atom(j).position;
+        cube << "1 0 " << p(0) << " " << p(1) << " " << p(2) << "\n";
+    }
+    const double q[3] = {-0.8, 0.4, 0.4};
+    for (int n = 0; n < 12 * 12 * 12; ++n) {
+        const Eigen::Vector3d x(-6.0 + n / 144, -6.0 + (n / 12) % 12, -6.0 + n % 12);
+        double v = 0.0;
+        for (size_t j = 0; j < mol.num_atoms(); ++j) {
+            v += scale * q[j] / std::max(0.5, (x - mol.atom(j).position).norm());
+        }
+        cube << v << ((n % 6 == 5) ? "\n" : " ");
+    }
+}
+
+bool test_batch_resume_sinks() {
+    const std::string xyz = "test_resume.xyz";
+    const std::string cube = "test_resume.cube";
+    const std::string journal = "test_resume.log";
+    const std::string ndjson = "test_resume.ndjson";
+    const std::string binary = "test_resume.bin";
+    {
+        std::ofstream out(xyz);
+        out << "3\nwater\nO 0.0 0.0 0.1173\nH 0.0 0.7572 -0.4692\nH 0.0 -0.7572 -0.4692\n";
+    }
+    write_water_cube(cube, 1.0);
+    std::remove(journal.c_str());
+    
+    std::vector<FitJob> jobs(2);
+    for (size_t i = 0; i < jobs.size(); ++i) {
+        jobs[i].xyz_file = xyz;
+        jobs[i].cube_file = cube;
+        jobs[i].output_file = "test_resume_" + std::to_string(i) + ".txt";
+    }
+    
+    std::ostream quiet(nullptr);
+    BatchRunner::Config config;
+    config.journal = journal;
+    config.ndjson = ndjson;
+    config.binary = binary;
+    config.out = &quiet;
+    FitOptions options;
+    
+    auto lines = [&]() {
+        std::ifstream in(ndjson);
+        std::vector<std::string> result;
+        for (std::string line; std::getline(in, line);) {
+            result.push_back(line);
+        }
+        return result;
+    };
+    auto binary_rows = [&]() {
+        std::ifstream in(binary, std::ios::binary);
+        std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        uint64_t rows = 0;
+        if (data.size() >= 16 && data.compare(data.size() - 16, 8, "CHGEND01") == 0) {
+            std::memcpy(&rows, data.data() + data.size() - 8, sizeof(rows));
+        }
+        return rows;
+    };
+    
+    // Interrupted after the first job
+    BatchRunner first(options, config);
+    first.run(std::vector<FitJob>(jobs.begin(), jobs.begin() + 1));
+    const std::vector<std::string> before = lines();
+    
+    BatchRunner resumed(options, config);
+    resumed.run(jobs);
+    const std::vector<std::string> after = lines();
+    
+    // The resumed job's record comes back with its source and charges, as
+    // written to the output file
+    auto charges = [](const std::string& line) {
+        std::vector<double> q;
+        const size_t at = line.find("\"charges\":[");
+        if (at != std::string::npos) {
+            std::istringstream in(line.substr(at + 11, line.find(']', at) - at - 11));
+            for (std::string value; std::getline(in, value, ',');) {
+                q.push_back(std::stod(value));
+            }
+        }
+        return q;
+    };
+    bool ok = before.size() == 1 && after.size() == 2
+           && resumed.stats().resumed == 1 && resumed.stats().fitted == 1
+           && after[0].find("\"job\":0") != std::string::npos
+           && after[0].find("\"source\":\"fitted\"") != std::string::npos
+           && charges(after[0]).size() == 3 && charges(before[0]).size() == 3
+           && binary_rows() == 2;
+    for (size_t k = 0; ok && k < 3; ++k) {
+        ok = std::abs(charges(after[0])[k] - charges(before[0])[k]) < 1e-6;
+    }
+    
+    // A done job whose output file was lost is run again
+    std::remove(jobs[1].output_file.c_str());
+    BatchRunner again(options, config);
+    again.run(jobs);
+    ok = ok && again.stats().resumed == 1 && again.stats().fitted == 1
+            && lines().size() == 2 && binary_rows() == 2;
+    
+    for (const std::string& path : {xyz, cube, journal, ndjson, binary,
+                                    jobs[0].output_file, jobs[1].output_file}) {
+        std::remove(path.c_str());
+    }
+    return ok;
+}
+
+bool test_shared_grid_cache() {
+    const std::string path = "test_grid_cache.cube";
+    write_water_cube(path, 1.0);
+    SharedGridCache::Config config;
+    config.prefix = "chargeopt-test." + std::to_string(getpid());
+    std::ostream quiet(nullptr);
+    
+    auto same = [](const ESPGrid& a, const ESPGrid& b) {
+        bool ok = a.num_points() == b.num_points() && a.num_points() > 0
+               && a.has_lattice() && b.has_lattice()
+               && a.lattice().node == b.lattice().node;
+        for (size_t i = 0; ok && i < a.num_points(); ++i) {
+            ok = a.point(i).position == b.point(i).position && a.point(i).potential == b.point(i).potential;
+        }
+        return ok;
+    };
+    
+    const ESPGrid parsed = CubeParser::parse(path, true, quiet);
+    SharedGridCache::Source first, second;
+    ESPGrid published = SharedGridCache::load(path, true, quiet, config, &first);
+    ESPGrid mapped = SharedGridCache::load(path, true, quiet, config, &second);
+    bool ok = first == SharedGridCache::Source::Published
+           && second == SharedGridCache::Source::Mapped
+           && mapped.is_view()
+           && same(parsed, published) && same(parsed, mapped);
+    
+    // Another process maps the same copy
+    pid_t child = fork();
+    if (child == 0) {
+        SharedGridCache::Source source;
+        ESPGrid grid = SharedGridCache::load(path, true, quiet, config, &source);
+        _exit(source == SharedGridCache::Source::Mapped && same(parsed, grid) ? 0 : 1);
+    }
+    int status = 1;
+    waitpid(child, &status, 0);
+    ok = ok && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    
+    // Other parser options and edited files are separate entries
+    SharedGridCache::Source unfiltered, edited;
+    SharedGridCache::load(path, false, quiet, config, &unfiltered);
+    usleep(10000);
+    write_water_cube(path, 2.0);
+    ESPGrid fresh = SharedGridCache::load(path, true, quiet, config, &edited);
+    ok = ok && unfiltered == SharedGridCache::Source::Published
+            && edited == SharedGridCache::Source::Published
+            && same(CubeParser::parse(path, true, quiet), fresh);
+    
+    // Modifying a mapped grid works on a private copy
+    mapped.add_point(Eigen::Vector3d::Zero(), 0.0);
+    ok = ok && !mapped.is_view() && mapped.num_points() == parsed.num_points() + 1;
+    
+    // An index other users can write to is not trusted
+    SharedGridCache::Config planted;
+    planted.prefix = config.prefix + ".planted";
+    const std::string index_name = "/" + planted.prefix + ".index";
+    const int fd = shm_open(index_name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    ok = ok && fd >= 0 && fchmod(fd, 0666) == 0 && ftruncate(fd, 1 << 16) == 0;
+    if (fd >= 0) close(fd);
+    SharedGridCache::Source untrusted;
+    SharedGridCache::load(path, true, quiet, planted, &untrusted);
+    ok = ok && untrusted == SharedGridCache::Source::Parsed;
+    shm_unlink(index_name.c_str());
+    
+    SharedGridCache::clear(config.prefix);
+    std::remove(path.c_str());
+    return ok;
+}
+
+bool test_task_graph() {
+    // Diamond a -> (b, c) -> d, twice: serially and on a pool
+    bool ok = true;
+    ThreadPool pool(3);
+    for (ThreadPool* p : {static_cast<ThreadPool*>(nullptr), &pool}) {
+        std::atomic<int> clock(0);
+        int at[4] = {-1, -1, -1, -1};
+        TaskGraph graph;
+        const size_t a = graph.add([&] { at[0] = clock++; });
+        const size_t b = graph.add([&] { at[1] = clock++; }, {a});
+        const size_t c = graph.add([&] { at[2] = clock++; }, {a});
+        graph.add([&] { at[3] = clock++; }, {b, c});
+        graph.run(p);
+        ok = ok && at[0] == 0 && at[1] > 0 && at[2] > 0 && at[3] == 3;
+    }
+    
+    // A failure skips its dependents and surfaces from run()
+    bool dependent_ran = false;
+    TaskGraph failing;
+    const size_t bad = failing.add([] { throw std::runtime_error("stage failed"); });
+    failing.add([&] { dependent_ran = true; }, {bad});
+    bool threw = false;
+    try {
+        failing.run(&pool);
+    } catch (const std::runtime_error&) {
+        threw = true;
+    }
+    
+    // Dependencies must point backwards
+    bool rejected = false;
+    try {
+        TaskGraph().add([] {}, {0});
+    } catch (const std::runtime_error&) {
+        rejected = true;
+    }
+    
+    return ok && threw && !dependent_ran && rejected;
+}
+
+bool test_resource_limits() {
+    // Fake /proc and /sys trees; put() creates parents as needed
+    const std::string root = "test_cgroup_root." + std::to_string(getpid());
+    std::vector<std::string> files, dirs;
+    auto put = [&](const std::string& path, const std::string& text) {
+        const std::string full = root + path;
+        for (size_t slash = full.find('/'); slash != std::string::npos; slash = full.find('/', slash + 1)) {
+            const std::string dir = full.substr(0, slash);
+            if (mkdir(dir.c_str(), 0755) == 0) dirs.push_back(dir);
+        }
+        std::ofstream(full) << text << "\n";
+        files.push_back(full);
+    };
+    
+    // cgroup v2: the pod's quota and memory limit bind the container below it
+    put("/proc/self/cgroup", "0::/kubepods/pod1/c1");
+    put("/proc/self/mountinfo", "24 1 253:0 / / rw - ext4 /dev/vda1 rw\n"
+                                "30 24 0:26 / /sys/fs/cgroup rw,nosuid - cgroup2 cgroup2 rw");
+    put("/sys/fs/cgroup/kubepods/pod1/c1/cgroup.controllers", "cpu memory");
+    put("/sys/fs/cgroup/kubepods/pod1/c1/cpu.max", "max 100000");
+    put("/sys/fs/cgroup/kubepods/pod1/c1/memory.max", "max");
+    put("/sys/fs/cgroup/kubepods/pod1/cpu.max", "800000 100000");
+    put("/sys/fs/cgroup/kubepods/pod1/memory.max", "4294967296");
+    const ResourceLimits v2 = ResourceLimits::read(root);
+    bool ok = v2.cgroup_version == 2 && v2.cpu_quota == 8.0 && v2.memory_limit == 4294967296ULL;
+    
+    // cgroup v1 as seen inside a container: the mount root is its own cgroup
+    put("/proc/self/cgroup", "9:memory:/docker/abc\n4:cpu,cpuacct:/docker/abc\n0::/");
+    put("/proc/self/mountinfo", "31 25 0:27 /docker/abc /sys/fs/cgroup/cpu,cpuacct ro - cgroup cgroup rw,cpu,cpuacct\n"
+                                "32 25 0:28 /docker/abc /sys/fs/cgroup/memory ro - cgroup cgroup rw,memory");
+    put("/sys/fs/cgroup/cpu,cpuacct/tasks", "1");
+    put("/sys/fs/cgroup/cpu,cpuacct/cpu.cfs_quota_us", "250000");
+    put("/sys/fs/cgroup/cpu,cpuacct/cpu.cfs_period_us", "100000");
+    put("/sys/fs/cgroup/memory/tasks", "1");
+    put("/sys/fs/cgroup/memory/memory.limit_in_bytes", "9223372036854771712");
+    const ResourceLimits v1 = ResourceLimits::read(root);
+    ok = ok && v1.cgroup_version == 1 && v1.cpu_quota == 2.5 && v1.memory_limit == 0;
+    
+    // No cgroup files at all: only host figures
+    const ResourceLimits none = ResourceLimits::read(root + "/missing");
+    ok = ok && none.cgroup_version == 0 && none.cpu_quota == 0.0 && none.cpus() >= 1;
+    
+    for (const auto& f : files) std::remove(f.c_str());
+    for (auto d = dirs.rbegin(); d != dirs.rend(); ++d) rmdir(d->c_str());
+    
+    // 128 host cores, 8 allowed; a fractional quota rounds up
+    ResourceLimits limits;
+    limits.host_cpus = limits.affinity_cpus = 128;
+    limits.cpu_quota = 8.0;
+    limits.physical_memory = 64ULL << 30;
+    limits.memory_limit = 2ULL << 30;
+    ok = ok && limits.cpus() == 8 && limits.memory_budget() == (2ULL << 30);
+    limits.cpu_quota = 0.5;
+    ok = ok && limits.cpus() == 1;
+    
+    ResourceLimits::set_threads(5);
+    ok = ok && ResourceLimits::threads() == 5 && ThreadPool::default_threads() == 5;
+    ResourceLimits::set_threads(0);
+    return ok && ResourceLimits::threads() == ResourceLimits::detect().cpus();
+}
+
+bool test_conformer_clustering() {
+    // Two conformers of a chiral 5-atom frame (one arm swung by 2 Bohr),
+    // 10 and 5 snapshots, each rotated, translated and slightly perturbed
+    Molecule base;
+    base.add_atom(Atom("C", Eigen::Vector3d(0.0, 0.0, 0.0)));
+    base.add_atom(Atom("F", Eigen::Vector3d(2.6, 0.0, 0.0)));
+    base.add_atom(Atom("Cl", Eigen::Vector3d(-0.9, 3.1, 0.0)));
+    base.add_atom(Atom("Br", Eigen::Vector3d(-0.9, -1.5, 3.3)));
+    base.add_atom(Atom("H", Eigen::Vector3d(-0.7, -1.2, -1.6)));
+    std::vector<Molecule> frames;
+    for (int f = 0; f < 15; ++f) {
+        const Eigen::Matrix3d R = Eigen::AngleAxisd(0.7 * f, Eigen::Vector3d(1.0, 0.3 * f, 0.1 * f * f).normalized())
+            .toRotationMatrix();
+        Molecule mol;
+        for (size_t i = 0; i < base.num_atoms(); ++i) {
+            Eigen::Vector3d p = base.atom(i).position;
+            if (f >= 10 && i == 1) p += Eigen::Vector3d(0.0, 2.0, 0.0);
+            p += 0.01 * Eigen::Vector3d(std::sin(f + i), std::cos(3.0 * f - i), std::sin(2.0 * f * i));
+            mol.add_atom(Atom(base.atom(i).element, R * p + Eigen::Vector3d(f, -2.0 * f, 0.5), i));
+        }
+        frames.push_back(mol);
+    }
+    
+    // Rigid motion costs nothing; a mirror image is not a superposition
+    const Eigen::MatrixXd x = base.positions();
+    Eigen::MatrixXd mirrored = x;
+    mirrored.col(2) *= -1.0;
+    const Eigen::Matrix3d R = Eigen::AngleAxisd(1.1, Eigen::Vector3d(0.2, 0.5, 0.8).normalized()).toRotationMatrix();
+    const Eigen::MatrixXd moved = (x * R.transpose()).rowwise() + Eigen::RowVector3d(3.0, -1.0, 2.0);
+    bool ok = ConformerClustering::aligned_rmsd(x, moved) < 1e-6
+           && ConformerClustering::aligned_rmsd(x, mirrored) > 0.5;
+    
+    ConformerClustering::Config config;
+    config.rmsd_cutoff = 0.3;
+    ThreadPool pool(3);
+    const auto serial = ConformerClustering::cluster(frames, config);
+    const auto parallel = ConformerClustering::cluster(frames, config, &pool);
+    ok = ok && serial.representatives.size() == 2
+            && serial.representatives[0].population == 10 && serial.representatives[0].frame < 10
+            && serial.representatives[1].population == 5 && serial.representatives[1].frame >= 10
+            && std::abs(serial.representatives[0].weight - 2.0 / 3.0) < 1e-12
+            && serial.cluster == parallel.cluster
+            && serial.pairs_aligned == parallel.pairs_aligned;
+    for (size_t f = 0; f < frames.size(); ++f) {
+        ok = ok && serial.cluster[f] == (f < 10 ? 0u : 1u);
+    }
+    
+    // Multi-frame XYZ round trip; frames may be separated by blank lines
+    const std::string path = "test_ensemble.xyz";
+    {
+        std::ofstream out(path);
+        out << "2\nframe 1\nH 0.0 0.0 0.0\nH 0.74 0.0 0.0\n\n"
+            << "2\nframe 2\nH 0.0 0.0 0.0\nH 0.0 0.80 0.0\n";
+    }
+    std::ostream quiet(nullptr);
+    const std::vector<Molecule> read = XYZParser::parse_frames(path, quiet);
+    std::remove(path.c_str());
+    ok = ok && read.size() == 2 && read[1].num_atoms() == 2
+            && std::abs(read[1].atom(1).position.y() - 0.80 * 1.889726125) < 1e-9;
+    
+    // Frames must describe the same molecule
+    bool rejected = false;
+    try {
+        ConformerClustering::cluster({frames[0], read[0]}, config);
+    } catch (const std::runtime_error&) {
+        rejected = true;
+    }
+    return ok && rejected;
+}
+
+bool test_multipole_target() {
+    // Moments of a small charge cluster about c reproduce its far potential,
+    // better with each rank
+    const Eigen::Vector3d c(0.3, -0.2, 0.5);
+    const std::vector<std::pair<double, Eigen::Vector3d>> charges = {
+        {0.7, Eigen::Vector3d(0.8, -0.1, 0.9)}, {-0.4, Eigen::Vector3d(-0.1, 0.4, 0.2)},
+        {-0.5, Eigen::Vector3d(0.5, -0.9, 0.1)}, {0.3, Eigen::Vector3d(0.1, 0.2, 1.2)}};
+    Eigen::VectorXd Q = Eigen::VectorXd::Zero(9);
+    const double s3 = std::sqrt(3.0);
+    for (const auto& q : charges) {
+        const Eigen::Vector3d d = q.second - c;
+        Q += q.first * (Eigen::VectorXd(9) << 1.0, d.z(), d.x(), d.y(),
+                        0.5 * (3.0 * d.z() * d.z() - d.squaredNorm()), s3 * d.x() * d.z(), s3 * d.y() * d.z(),
+                        0.5 * s3 * (d.x() * d.x() - d.y() * d.y()), s3 * d.x() * d.y()).finished();
+    }
+    Eigen::MatrixXd far(2, 3);
+    far << 12.0, -7.0, 9.0,
+           -4.0, 11.0, -13.0;
+    bool ok = true;
+    for (Eigen::Index i = 0; i < far.rows(); ++i) {
+        double exact = 0.0;
+        for (const auto& q : charges) exact += q.first / (far.row(i).transpose() - q.second).norm();
+        double previous = 1.0;
+        for (int n : {1, 4, 9}) {
+            const double error = std::abs(CoulombKernel::multipole_column(far.row(i), c, Q.head(n))(0) - exact);
+            ok = ok && error < previous;
+            previous = error;
+        }
+        ok = ok && previous < 1e-5;
+    }
+    
+    // A punch file of atomic charges gives their exact potential on the
+    // Merz-Kollman shells, and the fit runs without a cube and recovers the
+    // charges. Unregularized, they come back within 0.02 e; the remainder
+    // (0.015 e on O) is the solver's column normalization, as for cubes.
+    const std::string xyz = "test_multipole.xyz", punch = "test_multipole.punch";
+    std::ofstream(xyz) << "3\nwater\nO 0.0 0.0 0.1173\nH 0.0 0.7572 -0.4692\nH 0.0 -0.7572 -0.4692\n";
+    std::ofstream(punch) << "! water, charges only\nUnits angstrom\n\n"
+                         << "O  0.0  0.0     0.1173  Rank 2\n -0.82\n 0.0 0.0 0.0\n 0.0 0.0 0.0 0.0 0.0\n"
+                         << "H  0.0  0.7572 -0.4692  Rank 1\n  0.41\n 0.0 0.0 0.0\n"
+                         << "H  0.0 -0.7572 -0.4692  Rank 0\n  0.41\n";
+    FitJob job;
+    job.xyz_file = xyz;
+    job.cube_file = punch;
+    std::ostream quiet(nullptr);
+    FitOptions unregularized;
+    unregularized.lambda = 0.0;
+    const FitResult fit = FitPipeline::run(job, unregularized, quiet);
+    const Eigen::Vector3d expected(-0.82, 0.41, 0.41);
+    const Eigen::VectorXd V = CoulombKernel::potential_matrix(fit.grid.positions(), fit.mol.positions()) * expected;
+    ok = ok && MultipoleParser::is_multipole_file(punch) && !MultipoleParser::is_multipole_file("water.cube")
+            && fit.grid.num_points() > 500
+            && (fit.grid.potentials() - V).cwiseAbs().maxCoeff() < 1e-12
+            && fit.solution.converged && std::abs(fit.solution.charges.sum()) < 1e-8
+            && (fit.solution.charges - expected).cwiseAbs().maxCoeff() < 0.02;
+    
+    // Truncated site blocks are reported
+    std::ofstream(punch) << "Units bohr\nO 0.0 0.0 0.0 Rank 1\n -0.8 0.0\n";
+    bool rejected = false;
+    try {
+        MultipoleParser::parse(punch, quiet);
+    } catch (const std::runtime_error&) {
+        rejected = true;
+    }
+    std::remove(xyz.c_str());
+    std::remove(punch.c_str());
+    return ok && rejected;
+}
+
 int main() {
     std::cout << "Running basic tests..." << std::endl;
     
@@ -51,6 +992,126 @@ int main() {
         failed++;
     }
     
+    if (test_charge_derivatives()) {
+        std::cout << "✓ Charge derivative test passed" << std::endl;
+        passed++;
+    } else {
+        std::cout << "✗ Charge derivative test failed" << std::endl;
+        failed++;
+    }
+    
+    if (test_robust_fit()) {
+        std::cout << "✓ Robust fit test passed" << std::endl;
+        passed++;
+    } else {
+        std::cout << "✗ Robust fit test failed" << std::endl;
+        failed++;
+    }
+    
+    if (test_gram_quadrature()) {
+        std::cout << "✓ Gram quadrature test passed" << std::endl;
+        passed++;
+    } else {
+        std::cout << "✗ Gram quadrature test failed" << std::endl;
+        failed++;
+    }
+    
+    if (test_eem_charges()) {
+        std::cout << "✓ EEM charge test passed" << std::endl;
+        passed++;
+    } else {
+        std::cout << "✗ EEM charge test failed" << std::endl;
+        failed++;
+    }
+    
+    if (test_charge_database()) {
+        std::cout << "✓ Charge database test passed" << std::endl;
+        passed++;
+    } else {
+        std::cout << "✗ Charge database test failed" << std::endl;
+        failed++;
+    }
+    
+    if (test_job_key()) {
+        std::cout << "✓ Job key test passed" << std::endl;
+        passed++;
+    } else {
+        std::cout << "✗ Job key test failed" << std::endl;
+        failed++;
+    }
+    
+    if (test_batch_journal()) {
+        std::cout << "✓ Batch journal test passed" << std::endl;
+        passed++;
+    } else {
+        std::cout << "✗ Batch journal test failed" << std::endl;
+        failed++;
+    }
+    
+    if (test_result_sinks()) {
+        std::cout << "✓ Result sink test passed" << std::endl;
+        passed++;
+    } else {
+        std::cout << "✗ Result sink test failed" << std::endl;
+        failed++;
+    }
+    
+    if (test_file_prefetcher()) {
+        std::cout << "✓ File prefetcher test passed" << std::endl;
+        passed++;
+    } else {
+        std::cout << "✗ File prefetcher test failed" << std::endl;
+        failed++;
+    }
+    
+    if (test_batch_resume_sinks()) {
+        std::cout << "✓ Batch resume sink test passed" << std::endl;
+        passed++;
+    } else {
+        std::cout << "✗ Batch resume sink test failed" << std::endl;
+        failed++;
+    }
+    
+    if (test_shared_grid_cache()) {
+        std::cout << "✓ Shared grid cache test passed" << std::endl;
+        passed++;
+    } else {
+        std::cout << "✗ Shared grid cache test failed" << std::endl;
+        failed++;
+    }
+    
+    if (test_task_graph()) {
+        std::cout << "✓ Task graph test passed" << std::endl;
+        passed++;
+    } else {
+        std::cout << "✗ Task graph test failed" << std::endl;
+        failed++;
+    }
+    
+    if (test_resource_limits()) {
+        std::cout << "✓ Resource limits test passed" << std::endl;
+        passed++;
+    } else {
+        std::cout << "✗ Resource limits test failed" << std::endl;
+        failed++;
+    }
+    
+    if (test_conformer_clustering()) {
+        std::cout << "✓ Conformer clustering test passed" << std::endl;
+        passed++;
+    } else {
+        std::cout << "✗ Conformer clustering test failed" << std::endl;
+        failed++;
+    }
+    
+    if (test_multipole_target()) {
+        std::cout << "✓ Multipole target test passed" << std::endl;
+        passed++;
+    } else {
+        std::cout << "✗ Multipole target test failed" << std::endl;
+        failed++;
+    }
+    
     std::cout << "\nTests: " << passed << " passed, " << failed << " failed" << std::endl;
     
     return failed > 0 ? 1 : 0;
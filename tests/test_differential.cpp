@@ -0,0 +1,473 @@
+#include <iostream>
+#include <Eigen/Dense>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <limits>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "core/molecule.hpp"
+#include "core/esp_grid.hpp"
+#include "solver/qp_solver.hpp"
+#include "solver/constraints.hpp"
+#include "solver/robust_fit.hpp"
+#include "analysis/validator.hpp"
+#include "pipeline/fit_pipeline.hpp"
+#include "io/file_prefetcher.hpp"
+
+using namespace chargeopt;
+
+// Differential tests: every fast path is checked against a reference
+// pipeline on randomly generated molecules, grids and constraint sets.
+//
+//   test_differential [--trials <n>] [--seed <s>] [--verbose]
+//
+// The reference is the straightforward formulation kept private to this
+// file: the dense design matrix A, H = 2 D^-1 A^T A D^-1 and
+// f = -2 D^-2 A^T V (D = column norms of A), L2 regularization and the
+// KKT system solved with fullPivLu. It must not call into the code under
+// test so a bug there cannot hide in both.
+//
+// Tolerances (per trial, against the reference):
+//   charges  max |q - q_ref|                   <= charge_tol
+//   RMSE     |rmse - rmse_ref| / rmse_ref      <= rmse_tol
+// Paths that only reorder floating-point sums get 1e-8 on charges: the
+// normalized, regularized KKT matrix has a condition number below ~1e6
+// for these sizes, so reordering error (~1e-14) stays well under it.
+// Approximate paths state their own tolerance where they are registered.
+//
+// A failure prints the trial seed; rerun with --seed <s> --trials 1.
+
+namespace {
+
+// Random test problem. The grid is a cube lattice (so the same problem can
+// be written out and read back through the file parsers) with the points
+// within 1.5 Bohr of a nucleus dropped, as CubeParser does.
+struct Problem {
+    uint64_t seed = 0;
+    Molecule mol;
+    ESPGrid grid;
+    Constraints constraints;
+    QPSolver::Config config;
+    double total_charge = 0.0;
+    bool total_charge_only = true;  // Constraints are exactly what FitPipeline builds
+    
+    // Lattice behind the grid, all points included
+    Eigen::Vector3d origin;
+    double spacing = 0.0;
+    int dims[3] = {0, 0, 0};
+    std::vector<double> values;
+    std::vector<double> angstrom;   // Atom coordinates as written to XYZ
+};
+
+struct Answer {
+    Eigen::VectorXd charges;
+    double rmse = 0.0;
+};
+
+struct FastPath {
+    std::string name;
+    double charge_tol;
+    double rmse_tol;
+    std::function<bool(const Problem&)> applies;    // Empty = every problem
+    std::function<Answer(const Problem&)> run;
+};
+
+constexpr double angstrom_to_bohr = 1.889726125;  // As XYZParser
+
+Problem make_problem(uint64_t seed) {
+    std::mt19937_64 rng(seed);
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+    auto pick = [&](int lo, int hi) { return lo + static_cast<int>(uniform(rng) * (hi - lo + 1)); };
+    
+    Problem p;
+    p.seed = seed;
+    
+    // Atoms at least 1.0 A apart in a box growing with their number;
+    // coordinates rounded to 1e-4 A like ordinary XYZ files
+    const int n_atoms = pick(2, 18);
+    const double box = 1.6 * std::cbrt(static_cast<double>(n_atoms)) + 1.0;
+    const char* elements[] = {"C", "H", "N", "O", "H", "S", "H", "F"};
+    int attempts = 0;
+    while (static_cast<int>(p.mol.num_atoms()) < n_atoms && attempts++ < 10000) {
+        Eigen::Vector3d a;
+        for (int c = 0; c < 3; ++c) a(c) = std::round(box * uniform(rng) * 1e4) / 1e4;
+        bool clash = false;
+        for (size_t j = 0; j < p.mol.num_atoms() && !clash; ++j) {
+            clash = (a * angstrom_to_bohr - p.mol.atom(j).position).norm() < angstrom_to_bohr;
+        }
+        if (clash) continue;
+        p.angstrom.insert(p.angstrom.end(), {a(0), a(1), a(2)});
+        p.mol.add_atom(Atom(elements[pick(0, 7)], a * angstrom_to_bohr, p.mol.num_atoms()));
+    }
+    const int n = p.mol.num_atoms();
+    
+    // Source charges for the potential, plus noise and a few outliers
+    Eigen::VectorXd q(n);
+    for (int j = 0; j < n; ++j) q(j) = 1.6 * uniform(rng) - 0.8;
+    p.total_charge = pick(-1, 1);
+    q.array() += (p.total_charge - q.sum()) / n;
+    std::normal_distribution<double> noise(0.0, 1e-3 * pick(0, 5));
+    
+    // Lattice enclosing the atoms with a 3-6 Bohr margin
+    const Eigen::MatrixXd sites = p.mol.positions();
+    const double margin = 3.0 + 3.0 * uniform(rng);
+    p.spacing = 0.55 + 0.6 * uniform(rng);
+    p.origin = sites.colwise().minCoeff().transpose().array() - margin;
+    const Eigen::Vector3d extent = sites.colwise().maxCoeff().transpose().array() + margin;
+    for (int c = 0; c < 3; ++c) {
+        p.dims[c] = static_cast<int>(std::ceil((extent(c) - p.origin(c)) / p.spacing)) + 1;
+    }
+    const Eigen::Vector3d vx(p.spacing, 0, 0), vy(0, p.spacing, 0), vz(0, 0, p.spacing);
+    GridLattice lattice;
+    lattice.origin = p.origin;
+    lattice.axes = p.spacing * Eigen::Matrix3d::Identity();
+    std::copy(p.dims, p.dims + 3, lattice.dims);
+    for (int i = 0; i < p.dims[0]; ++i) {
+        for (int j = 0; j < p.dims[1]; ++j) {
+            for (int k = 0; k < p.dims[2]; ++k) {
+                // Same expression as CubeParser so positions match bit for bit
+                Eigen::Vector3d pos = p.origin + i * vx + j * vy + k * vz;
+                Eigen::ArrayXd d = (sites.rowwise() - pos.transpose()).rowwise().norm().array();
+                double v = (q.array() / d.max(0.5)).sum() + noise(rng);
+                if (uniform(rng) < 0.002) v += 0.05 * (uniform(rng) - 0.5);
+                p.values.push_back(v);
+                if (d.minCoeff() >= 1.5) {
+                    p.grid.add_point(pos, v);
+                    lattice.node.push_back(p.values.size() - 1);
+                }
+            }
+        }
+    }
+    p.grid.set_lattice(lattice);
+    
+    // Constraint set: none, total charge only, or total charge plus
+    // symmetry pairs and fixed charges on disjoint atoms
+    const int kind = pick(0, 2);
+    p.total_charge_only = kind == 1;
+    if (kind > 0) {
+        p.constraints.add_charge_constraint(n, p.total_charge);
+    }
+    if (kind == 2) {
+        std::vector<int> order(n);
+        for (int j = 0; j < n; ++j) order[j] = j;
+        std::shuffle(order.begin(), order.end(), rng);
+        size_t next = 0;
+        for (int s = pick(0, n / 4); s > 0 && next + 2 < order.size(); --s, next += 2) {
+            p.constraints.add_symmetry_constraint(order[next], order[next + 1], n);
+        }
+        // Always leave one atom free so the total charge row stays independent
+        for (int s = pick(0, n / 4); s > 0 && next + 1 < order.size(); --s, ++next) {
+            p.constraints.add_fixed_charge_constraint(order[next], 0.8 * uniform(rng) - 0.4, n);
+        }
+    }
+    
+    const double lambdas[] = {1e-4, 5e-4, 5e-3};
+    p.config.regularization = lambdas[pick(0, 2)];
+    if (kind != 1 && uniform(rng) < 0.3) {
+        p.config.reference_charges = Eigen::VectorXd::Constant(n, 0.1 * uniform(rng));
+    }
+    return p;
+}
+
+// ---- Reference --------------------------------------------------------------
+
+Eigen::MatrixXd reference_design_matrix(const Molecule& mol, const ESPGrid& grid) {
+    Eigen::MatrixXd A(grid.num_points(), mol.num_atoms());
+    for (size_t i = 0; i < grid.num_points(); ++i) {
+        for (size_t j = 0; j < mol.num_atoms(); ++j) {
+            A(i, j) = 1.0 / (grid.point(i).position - mol.atom(j).position).norm();
+        }
+    }
+    return A;
+}
+
+Answer reference(const Problem& p) {
+    const Eigen::MatrixXd A = reference_design_matrix(p.mol, p.grid);
+    const Eigen::VectorXd V = p.grid.potentials();
+    const int n = A.cols();
+    
+    const Eigen::VectorXd scale = A.colwise().norm().transpose();
+    const Eigen::MatrixXd An = A * scale.cwiseInverse().asDiagonal();
+    Eigen::MatrixXd H = 2.0 * An.transpose() * An;
+    Eigen::VectorXd f = -2.0 * (A.transpose() * V).cwiseQuotient(scale.cwiseProduct(scale));
+    
+    const double lambda = p.config.regularization;
+    H += 2.0 * lambda * Eigen::MatrixXd::Identity(n, n);
+    if (p.config.reference_charges.size() == n) {
+        f -= 2.0 * lambda * p.config.reference_charges;
+    }
+    
+    const Eigen::MatrixXd& C = p.constraints.A_eq();
+    const int m = p.constraints.num_constraints();
+    Eigen::MatrixXd KKT = Eigen::MatrixXd::Zero(n + m, n + m);
+    KKT.topLeftCorner(n, n) = H;
+    Eigen::VectorXd rhs(n + m);
+    rhs.head(n) = -f;
+    if (m > 0) {
+        KKT.topRightCorner(n, m) = C.transpose();
+        KKT.bottomLeftCorner(m, n) = C;
+        rhs.tail(m) = p.constraints.b_eq();
+    }
+    
+    Answer answer;
+    answer.charges = KKT.fullPivLu().solve(rhs).head(n);
+    answer.rmse = std::sqrt((A * answer.charges - V).squaredNorm() / V.size());
+    return answer;
+}
+
+// ---- Fast paths -------------------------------------------------------------
+
+Answer finish(const Problem& p, const Eigen::VectorXd& charges) {
+    Molecule mol = p.mol;
+    mol.set_charges(charges);
+    Answer answer;
+    answer.charges = charges;
+    answer.rmse = Validator::validate(mol, p.grid).esp_rmse;
+    return answer;
+}
+
+Answer streamed(const Problem& p, int block_rows) {
+    Eigen::MatrixXd H;
+    Eigen::VectorXd f;
+    QPSolver::build_esp_matrices(p.mol, p.grid, H, f, block_rows);
+    return finish(p, QPSolver(p.config).solve(H, f, p.constraints).charges);
+}
+
+// g = A^T V from the FFT lattice convolution instead of the streamed sum
+Answer fft_rhs(const Problem& p) {
+    Eigen::MatrixXd H;
+    Eigen::VectorXd f;
+    QPSolver::build_esp_matrices(p.mol, p.grid, H, f, QPSolver::RhsMethod::FFT);
+    return finish(p, QPSolver(p.config).solve(H, f, p.constraints).charges);
+}
+
+// The per-rank slices of DistributedAssembly, reduced in process
+Answer sliced(const Problem& p, int ranks) {
+    const int n = p.mol.num_atoms();
+    const size_t points = p.grid.num_points();
+    Eigen::MatrixXd G = Eigen::MatrixXd::Zero(n, n);
+    Eigen::VectorXd g = Eigen::VectorXd::Zero(n);
+    for (int r = 0; r < ranks; ++r) {
+        Eigen::MatrixXd G_r = Eigen::MatrixXd::Zero(n, n);
+        Eigen::VectorXd g_r = Eigen::VectorXd::Zero(n);
+        QPSolver::accumulate_normal_equations(p.mol, p.grid, points * r / ranks,
+                                              points * (r + 1) / ranks, G_r, g_r);
+        G += G_r;
+        g += g_r;
+    }
+    Eigen::MatrixXd H;
+    Eigen::VectorXd f;
+    QPSolver::finalize_esp_matrices(G, g, H, f);
+    return finish(p, QPSolver(p.config).solve(H, f, p.constraints).charges);
+}
+
+Answer robust(const Problem& p, RobustFitter::Loss loss, double tuning) {
+    RobustFitter::Config config;
+    config.loss = loss;
+    config.tuning = tuning;
+    config.tolerance = 1e-12;
+    RobustFitter fitter(p.config, config);
+    return finish(p, fitter.fit(p.mol, p.grid, p.constraints).charges);
+}
+
+// Files written from the problem and fitted by FitPipeline, either read
+// from disk or handed over as FilePrefetcher buffers; stages overlap when
+// a pool is given
+Answer pipeline(const Problem& p, bool prefetch,
+                QPSolver::RhsMethod rhs = QPSolver::RhsMethod::Direct,
+                ThreadPool* pool = nullptr) {
+    const std::string base = "differential_" + std::to_string(p.seed);
+    FitJob job;
+    job.xyz_file = base + ".xyz";
+    job.cube_file = base + ".cube";
+    job.total_charge = p.total_charge;
+    
+    {
+        std::ofstream xyz(job.xyz_file);
+        xyz << std::setprecision(17) << p.mol.num_atoms() << "\nrandom\n";
+        for (size_t j = 0; j < p.mol.num_atoms(); ++j) {
+            xyz << p.mol.atom(j).element << " " << p.angstrom[3 * j] << " "
+                << p.angstrom[3 * j + 1] << " " << p.angstrom[3 * j + 2] << "\n";
+        }
+        
+        // Atoms are labelled as hydrogen in the cube so the parser's sign
+        // heuristic (only consulted for C and heavier) leaves the ESP alone
+        std::ofstream cube(job.cube_file);
+        cube << std::setprecision(17) << "random\nESP\n" << p.mol.num_atoms() << " "
+             << p.origin(0) << " " << p.origin(1) << " " << p.origin(2) << "\n";
+        for (int c = 0; c < 3; ++c) {
+            cube << p.dims[c];
+            for (int d = 0; d < 3; ++d) cube << " " << (c == d ? p.spacing : 0.0);
+            cube << "\n";
+        }
+        for (size_t j = 0; j < p.mol.num_atoms(); ++j) {
+            const auto& pos = p.mol.atom(j).position;
+            cube << "1 0 " << pos(0) << " " << pos(1) << " " << pos(2) << "\n";
+        }
+        for (size_t i = 0; i < p.values.size(); ++i) {
+            cube << p.values[i] << ((i % 6 == 5) ? "\n" : " ");
+        }
+        cube << "\n";
+    }
+    
+    if (prefetch) {
+        FilePrefetcher prefetcher;
+        prefetcher.request(job.xyz_file);
+        prefetcher.request(job.cube_file);
+        job.xyz_data = prefetcher.take(job.xyz_file);
+        job.cube_data = prefetcher.take(job.cube_file);
+    }
+    
+    FitOptions options;
+    options.lambda = p.config.regularization;
+    options.use_symmetry = false;
+    options.rhs = rhs;
+    std::ostream quiet(nullptr);
+    FitResult result = FitPipeline::run(job, options, quiet, pool);
+    std::remove(job.xyz_file.c_str());
+    std::remove(job.cube_file.c_str());
+    
+    if (result.grid.num_points() != p.grid.num_points()) {
+        throw std::runtime_error("parsed grid has " + std::to_string(result.grid.num_points()) +
+                                 " points, expected " + std::to_string(p.grid.num_points()));
+    }
+    Answer answer;
+    answer.charges = result.solution.charges;
+    answer.rmse = result.validation.esp_rmse;
+    return answer;
+}
+
+// Registry of checked paths. A new fast mode adds its entry here with the
+// tolerance it is expected to meet.
+std::vector<FastPath> fast_paths() {
+    auto pipeline_input = [](const Problem& p) {
+        return p.total_charge_only && p.config.reference_charges.size() == 0;
+    };
+    
+    std::vector<FastPath> paths;
+    paths.push_back({"streamed assembly (default blocks)", 1e-8, 1e-10, nullptr,
+                     [](const Problem& p) { return streamed(p, QPSolver::default_block_rows); }});
+    paths.push_back({"streamed assembly (1-row blocks)", 1e-8, 1e-10, nullptr,
+                     [](const Problem& p) { return streamed(p, 1); }});
+    paths.push_back({"streamed assembly (97-row blocks)", 1e-8, 1e-10, nullptr,
+                     [](const Problem& p) { return streamed(p, 97); }});
+    paths.push_back({"sliced assembly (3 ranks)", 1e-8, 1e-10, nullptr,
+                     [](const Problem& p) { return sliced(p, 3); }});
+    paths.push_back({"sliced assembly (7 ranks)", 1e-8, 1e-10, nullptr,
+                     [](const Problem& p) { return sliced(p, 7); }});
+    // Interpolation error of ~1e-7 in g, amplified by the conditioning
+    paths.push_back({"FFT right-hand side", 1e-4, 1e-4, nullptr, fft_rhs});
+    paths.push_back({"robust fit, loss none", 1e-8, 1e-10, nullptr,
+                     [](const Problem& p) { return robust(p, RobustFitter::Loss::None, 0.0); }});
+    // k = 1e6 sigma gives every point unit weight; the IRLS refit must
+    // reproduce the plain fit
+    paths.push_back({"robust fit, Huber k = 1e6", 1e-8, 1e-10, nullptr,
+                     [](const Problem& p) { return robust(p, RobustFitter::Loss::Huber, 1e6); }});
+    // Text round trip is exact (17 significant digits), so only the
+    // assembly order differs from the reference
+    paths.push_back({"pipeline (files)", 1e-8, 1e-10, pipeline_input,
+                     [](const Problem& p) { return pipeline(p, false); }});
+    paths.push_back({"pipeline (prefetched buffers)", 1e-8, 1e-10, pipeline_input,
+                     [](const Problem& p) { return pipeline(p, true); }});
+    paths.push_back({"pipeline (concurrent stages)", 1e-8, 1e-10, pipeline_input,
+                     [](const Problem& p) {
+                         ThreadPool pool(FitPipeline::max_parallel_stages);
+                         return pipeline(p, false, QPSolver::RhsMethod::Direct, &pool);
+                     }});
+    // Also checks the lattice metadata CubeParser records
+    paths.push_back({"pipeline (files, --rhs fft)", 1e-4, 1e-4, pipeline_input,
+                     [](const Problem& p) { return pipeline(p, false, QPSolver::RhsMethod::FFT); }});
+    return paths;
+}
+
+struct PathStats {
+    int runs = 0;
+    int failures = 0;
+    double worst_charge = 0.0;
+    double worst_rmse = 0.0;
+};
+
+} // namespace
+
+int main(int argc, char** argv) {
+    int trials = 40;
+    uint64_t seed = 20240611;
+    bool verbose = false;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--trials" && i + 1 < argc) trials = std::stoi(argv[++i]);
+        else if (arg == "--seed" && i + 1 < argc) seed = std::stoull(argv[++i]);
+        else if (arg == "--verbose") verbose = true;
+        else {
+            std::cerr << "Usage: " << argv[0] << " [--trials <n>] [--seed <s>] [--verbose]" << std::endl;
+            return 1;
+        }
+    }
+    
+    std::cout << "Running differential tests (" << trials << " trials, seed " << seed << ")..." << std::endl;
+    
+    const std::vector<FastPath> paths = fast_paths();
+    std::vector<PathStats> stats(paths.size());
+    
+    for (int t = 0; t < trials; ++t) {
+        const uint64_t trial_seed = seed + t;
+        const Problem problem = make_problem(trial_seed);
+        const Answer ref = reference(problem);
+        if (verbose) {
+            std::cout << "  seed " << trial_seed << ": " << problem.mol.num_atoms() << " atoms, "
+                      << problem.grid.num_points() << " points, "
+                      << problem.constraints.num_constraints() << " constraints, rmse "
+                      << ref.rmse << std::endl;
+        }
+        
+        for (size_t k = 0; k < paths.size(); ++k) {
+            const FastPath& path = paths[k];
+            if (path.applies && !path.applies(problem)) continue;
+            
+            PathStats& s = stats[k];
+            s.runs++;
+            double dq = std::numeric_limits<double>::infinity();
+            double drmse = std::numeric_limits<double>::infinity();
+            std::string error;
+            try {
+                Answer answer = path.run(problem);
+                if (answer.charges.size() == ref.charges.size()) {
+                    dq = (answer.charges - ref.charges).cwiseAbs().maxCoeff();
+                    drmse = std::abs(answer.rmse - ref.rmse) / std::max(ref.rmse, 1e-12);
+                }
+            } catch (const std::exception& e) {
+                error = e.what();
+            }
+            
+            s.worst_charge = std::max(s.worst_charge, dq);
+            s.worst_rmse = std::max(s.worst_rmse, drmse);
+            // Negated comparisons so NaN counts as a failure
+            if (!(dq <= path.charge_tol) || !(drmse <= path.rmse_tol)) {
+                s.failures++;
+                std::cout << "  " << path.name << ": seed " << trial_seed
+                          << " max |dq| = " << dq << ", rel dRMSE = " << drmse
+                          << (error.empty() ? "" : " (" + error + ")") << std::endl;
+            }
+        }
+    }
+    
+    int failed = 0;
+    for (size_t k = 0; k < paths.size(); ++k) {
+        const PathStats& s = stats[k];
+        std::cout << (s.failures == 0 ? "✓ " : "✗ ") << paths[k].name << ": " << s.runs
+                  << " runs, max |dq| = " << s.worst_charge << " (tol " << paths[k].charge_tol
+                  << "), max rel dRMSE = " << s.worst_rmse << " (tol " << paths[k].rmse_tol << ")"
+                  << std::endl;
+        failed += s.failures > 0;
+    }
+    
+    std::cout << "\nDifferential paths: " << (paths.size() - failed) << " passed, "
+              << failed << " failed" << std::endl;
+    return failed > 0 ? 1 : 0;
+}
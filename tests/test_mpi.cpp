@@ -0,0 +1,112 @@
+#include <iostream>
+#include <Eigen/Dense>
+#include <cmath>
+#include <cstdio>
+#include <mpi.h>
+
+#include "core/molecule.hpp"
+#include "core/esp_grid.hpp"
+#include "solver/qp_solver.hpp"
+#include "solver/distributed_assembly.hpp"
+#include "pipeline/mpi_batch.hpp"
+
+using namespace chargeopt;
+
+// Run under mpirun -np 2 (or more); every rank reports, rank 0 prints
+
+static Molecule make_water() {
+    Molecule mol;
+    mol.add_atom(Atom("O", Eigen::Vector3d(0.0, 0.0, 0.22)));
+    mol.add_atom(Atom("H", Eigen::Vector3d(0.0, 1.43, -0.89)));
+    mol.add_atom(Atom("H", Eigen::Vector3d(0.1, -1.43, -0.89)));
+    return mol;
+}
+
+static ESPGrid make_grid(const Molecule& mol) {
+    ESPGrid grid;
+    for (int k = 0; k < 997; ++k) {
+        // Deterministic scatter on shells 4-6 Bohr
+        double theta = std::acos(1.0 - 2.0 * (k + 0.5) / 997.0);
+        double phi = 2.399963 * k;
+        double radius = 4.0 + 2.0 * (k % 7) / 6.0;
+        Eigen::Vector3d pos(radius * std::sin(theta) * std::cos(phi),
+                            radius * std::sin(theta) * std::sin(phi),
+                            radius * std::cos(theta));
+        double v = -0.8 / (pos - mol.atom(0).position).norm()
+                 + 0.4 / (pos - mol.atom(1).position).norm()
+                 + 0.4 / (pos - mol.atom(2).position).norm();
+        grid.add_point(pos, v);
+    }
+    return grid;
+}
+
+bool test_distributed_assembly() {
+    Molecule mol = make_water();
+    ESPGrid grid = make_grid(mol);
+    
+    Eigen::MatrixXd H_ref, H;
+    Eigen::VectorXd f_ref, f;
+    QPSolver::build_esp_matrices(mol, grid, H_ref, f_ref);
+    DistributedAssembly::build_esp_matrices(mol, grid, H, f);
+    
+    // Only summation order differs
+    return (H - H_ref).norm() <= 1e-12 * H_ref.norm()
+        && (f - f_ref).norm() <= 1e-12 * f_ref.norm();
+}
+
+bool test_mpi_batch(int rank) {
+    // More jobs than workers, with a duplicate and a failure
+    const std::string water = std::string(CHARGEOPT_EXAMPLES_DIR) + "/water/water.xyz";
+    const std::string water_cube = std::string(CHARGEOPT_EXAMPLES_DIR) + "/water/water_esp.cube";
+    const std::string methane = std::string(CHARGEOPT_EXAMPLES_DIR) + "/methane/methane.xyz";
+    const std::string methane_cube = std::string(CHARGEOPT_EXAMPLES_DIR) + "/methane/methane_esp.cube";
+    
+    std::vector<FitJob> jobs(4);
+    jobs[0].xyz_file = water;   jobs[0].cube_file = water_cube;
+    jobs[1].xyz_file = methane; jobs[1].cube_file = methane_cube;
+    jobs[2].xyz_file = water;   jobs[2].cube_file = water_cube;
+    jobs[3].xyz_file = "missing.xyz"; jobs[3].cube_file = water_cube;
+    for (size_t i = 0; i < jobs.size(); ++i) {
+        jobs[i].output_file = "test_mpi_" + std::to_string(i) + ".txt";
+    }
+    
+    std::ostream quiet(nullptr);
+    BatchRunner::Config config;
+    config.out = &quiet;
+    FitOptions options;
+    size_t failed = MpiBatchRunner::run(jobs, options, config);
+    
+    bool ok = failed == 1;
+    if (rank == 0) {
+        for (size_t i = 0; i < 3; ++i) {
+            std::FILE* f = std::fopen(jobs[i].output_file.c_str(), "r");
+            ok = ok && f != nullptr;
+            if (f) std::fclose(f);
+            std::remove(jobs[i].output_file.c_str());
+        }
+    }
+    return ok;
+}
+
+int main(int argc, char** argv) {
+    MpiSession mpi(argc, argv);
+    int failed = 0;
+    
+    auto check = [&](bool ok, const char* name) {
+        int local = ok ? 0 : 1, total = 0;
+        MPI_Allreduce(&local, &total, 1, MPI_INT, MPI_SUM, MPI_COMM_WORLD);
+        if (mpi.is_root()) {
+            std::cout << (total == 0 ? "✓ " : "✗ ") << name
+                      << (total == 0 ? " test passed" : " test failed") << std::endl;
+        }
+        failed += total > 0;
+    };
+    
+    if (mpi.is_root()) {
+        std::cout << "Running on " << mpi.size() << " ranks" << std::endl;
+    }
+    check(test_distributed_assembly(), "Distributed assembly");
+    check(test_mpi_batch(mpi.rank()), "MPI batch");
+    
+    return failed > 0 ? 1 : 0;
+}